@@ -1,8 +1,12 @@
 #include "xc.h"
+#include "SPI.h"
 
 volatile char CS1 = 16;
 volatile char CS2 = 16;
 
+// Optional handler used by SPI_transfer_block, NULL if not set
+SPI_block_handler block_handler = 0;
+
 // Sets CS pin to val if valid. Otherwise, nothing will happen
 void SPI_set_CS(unsigned char module, unsigned char val){
     if (!val) {
@@ -129,6 +133,39 @@ unsigned char SPI_send_byte(unsigned char module, char b) {
     return 0;
 }
 
+// Sets a handler (such as a DMA transfer) to be used for block transfers.
+// Pass NULL to use the polled loop only.
+void SPI_set_block_handler(SPI_block_handler handler) {
+    block_handler = handler;
+}
+
+// Transfers len bytes in one call. If tx is NULL, 0xff is sent for every byte.
+// If rx is NULL, received bytes are discarded. Must enable CS seperatly
+void SPI_transfer_block(unsigned char module, const unsigned char *tx, unsigned char *rx, unsigned int len) {
+    
+    // Let the handler do the transfer if it is able to
+    if (block_handler && !block_handler(module, tx, rx, len)) return;
+    
+    // The module is only checked once instead of once per byte
+    unsigned int i;
+    unsigned char c;
+    if (module == 1) {
+        for (i = 0; i < len; i++) {
+            SPI1BUF = tx ? tx[i] : 0xff;    // Place char in array, initiate transfer
+            while(!SPI1STATbits.SPIRBF);    // Wait until T/R is complete
+            c = SPI1BUF;
+            if (rx) rx[i] = c;
+        }
+    } else {
+        for (i = 0; i < len; i++) {
+            SPI2BUF = tx ? tx[i] : 0xff;    // Place char in array, initiate transfer
+            while(!SPI2STATbits.SPIRBF);    // Wait until T/R is complete
+            c = SPI2BUF;
+            if (rx) rx[i] = c;
+        }
+    }
+}
+
 // Puts start sequence on the SD card
 char SD_start_seq() {
     for (int i = 0; i < 10; i++) SPI_send_byte(1, 0xff);
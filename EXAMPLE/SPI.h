@@ -17,6 +17,12 @@ extern volatile char CS2;
 // Initilize SPI1 module to proper pins in standard mode.
 int SPI_init(unsigned char module, unsigned char CS, unsigned char MOSI, unsigned char CLK, unsigned char MISO);
 unsigned char SPI_send_byte(unsigned char module, char b);
+
+// Optional block transfer handler (e.g. DMA). Returns 0 if the transfer was done,
+// non zero to fall back to the polled loop.
+typedef int (*SPI_block_handler)(unsigned char module, const unsigned char *tx, unsigned char *rx, unsigned int len);
+void SPI_set_block_handler(SPI_block_handler handler);
+void SPI_transfer_block(unsigned char module, const unsigned char *tx, unsigned char *rx, unsigned int len);
 void SPI_set_CS(unsigned char module, unsigned char val);
 char SD_start_seq();
 
@@ -3,9 +3,37 @@
     Library which interfaces with SD cards using SPI for PIC24 Microcontrollers
 
 */
+#include <string.h>
+#include "device.h"
 
 int module = 0;
 
+// Open CMD25 multiple block write, started from a write_hint run
+unsigned char multi_active = 0;     // 1 if a CMD25 write is open
+uint32_t multi_next = 0;            // Next sector the open write expects
+uint32_t multi_left = 0;            // Sectors left in the open write
+
+// Run from the last write_hint which has not been started yet
+uint32_t hint_sector = 0;
+uint32_t hint_count = 0;
+
+// Open CMD18 multiple block read, started from a read_hint run
+unsigned char read_active = 0;      // 1 if a CMD18 read is open
+uint32_t read_next = 0;             // Next sector the open read sends
+uint32_t read_left = 0;             // Sectors left in the open read
+
+// Run from the last read_hint which has not been started yet
+uint32_t read_hint_sector = 0;
+uint32_t read_hint_count = 0;
+
+// Write completion state. Once a data block is accepted the card holds MISO low
+// while it programs. write_block returns right away and the next operation which
+// needs the bus waits for the card with SD_wait_ready.
+unsigned char card_busy = 0;        // 1 if the card may still be programming
+unsigned char busy_check = 0;       // 1 if CMD13 is sent once the card is ready
+uint32_t busy_sector = 0;           // Sector being programmed
+unsigned char write_error = 0;      // 1 if a finished write failed, cleared once reported by write_flush or hardware_eject
+
 //////////////////////////// HELPER FUNCTIONS START //////////////////////
 
 // Calculates the CRC7 (x^7+x^3+1) for a given command and arg
@@ -32,6 +60,7 @@ unsigned char CRC7(unsigned char cmd, unsigned long arg) {
 // it into the buffer dest.
 void SD_send_CMD(unsigned char module, unsigned char cmd, unsigned long arg, unsigned char rBytes, unsigned char* dest) {
     
+    SD_wait_ready(module);          // Card can not take a command while programming
     cmd = (cmd & 0x7f) | 0x40;  // The first two bits must be 0b01
     unsigned char crc7 = (CRC7(cmd, arg) << 1) + 1;  // The last bit of CRC7 must be 1
     SPI_set_CS(module, 0);
@@ -61,6 +90,105 @@ void SD_send_app_CMD(unsigned char module, unsigned char acmd, unsigned long arg
     
 }
 
+// Checks once if the card is done programming. Returns 1 if the card is ready and
+// 0 if it is still busy. Never blocks, so it can be called between other work.
+// Once a single block write finishes, CMD13 checks it for programming errors.
+unsigned char SD_poll_ready(unsigned char module) {
+    
+    if (!card_busy) return 1;
+    
+    SPI_set_CS(module, 0);
+    unsigned char r = SPI_send_byte(module, 0xff);
+    if (!multi_active) SPI_set_CS(module, 1);   // CS stays low in a CMD25 write
+    if (!r) return 0;
+    
+    card_busy = 0;
+    if (busy_check) {
+        busy_check = 0;
+        unsigned char response[2] = {0xff, 0xff};
+        SD_send_CMD(module, 13, busy_sector, 2, response);
+        SPI_set_CS(module, 1);
+        if (response[0] || response[1]) write_error = 1;
+    }
+    
+    return 1;
+}
+
+// Waits until the card is done programming. Returns 0 when the card is ready,
+// or 1 if the card is still busy after the time limit
+unsigned char SD_wait_ready(unsigned char module) {
+    
+    unsigned int j = 50000;
+    while (!SD_poll_ready(module)) {
+        if (!j--) {write_error = 1; return 1;}
+    }
+    return 0;
+}
+
+// Sends a 512 byte data block after the given start token. Returns the data
+// response token. If the block is accepted, the card is marked busy and this
+// returns without waiting for the card to program it.
+unsigned char SD_send_data_block(unsigned char module, unsigned char token, const unsigned char* block) {
+    
+    SPI_send_byte(module, token);
+    SPI_transfer_block(module, block, NULL, 512);
+    
+    // Send the CRC 16 bytes. This is disabled in SPI mode, but the bytes must be sent
+    SPI_send_byte(module, 0x00);
+    SPI_send_byte(module, 0x00);
+    
+    // The card responds with a 1-byte response token, which is returned
+    unsigned char data_response = SPI_send_byte(module, 0xff);
+    
+    // If a proper token 0bXXX00101 is sent, the SD card holds the MISO line
+    // LOW until done programming the data
+    if ((data_response & 0x1f) == 0x05) card_busy = 1;
+    
+    return data_response;
+}
+
+// Ends an open CMD25 multiple block write with the stop token. The card is left
+// busy programming, and is checked with CMD13 once it is ready. Does nothing if
+// no write is open.
+void SD_end_multi_block(unsigned char module) {
+    
+    if (!multi_active) return;
+    
+    SD_wait_ready(module);          // Last block must be programmed before the stop token
+    SPI_send_byte(module, 0xfd);    // Stop token
+    SPI_send_byte(module, 0xff);    // Card goes busy one byte after the token
+    SPI_set_CS(module, 1);
+    
+    multi_active = 0;
+    multi_left = 0;
+    card_busy = 1;
+    busy_check = 1;
+    busy_sector = multi_next - 1;
+}
+
+// Ends an open CMD18 multiple block read with STOP_TRANSMISSION (CMD12). The byte
+// after CMD12 is a stuff byte and is skipped before the R1 response. The card is
+// left busy, as CMD12 has an R1b response. Does nothing if no read is open.
+void SD_end_multi_read(unsigned char module) {
+    
+    if (!read_active) return;
+    
+    SPI_send_byte(module, 0x4c);
+    SPI_send_byte(module, 0x00);
+    SPI_send_byte(module, 0x00);
+    SPI_send_byte(module, 0x00);
+    SPI_send_byte(module, 0x00);
+    SPI_send_byte(module, (CRC7(0x4c, 0l) << 1) + 1);
+    SPI_send_byte(module, 0xff);    // Stuff byte
+    unsigned char r = 0xff;
+    for (unsigned char i = 0; i < 10 && r == 0xff; i++) r = SPI_send_byte(module, 0xff);
+    SPI_set_CS(module, 1);
+    
+    read_active = 0;
+    read_left = 0;
+    card_busy = 1;
+}
+
 //////////////////////////// HELPER FUNCTIONS END ///////////////////////
 
 /*
@@ -77,46 +205,76 @@ void SD_send_app_CMD(unsigned char module, unsigned char acmd, unsigned long arg
 */
 int write_block(const uint8_t* data, uint32_t sector, uint32_t offset, uint32_t len) {
 
-    // Send CMD24 to initiate SD Write single block. Returns R1.
-    // If this is not zero, there is an error and 0xff is returned
-    unsigned char res;
-    SD_send_CMD(module, 24, sector, 1, &res);
-    if (res) {SPI_set_CS(module, 1); return 0;}
-    
-    // Send the start token to indicate transfer has started.
-    // Transfers must equal exactly 512 bytes
-    char d[512];
-    if (SD_read_block(module, d, sector, 0, 512)) return 0;
-    SPI_send_byte(module, 0xfe);            // Start token
-    for (unsigned int i = 0; i < 512; i++){
-        if (i >= offset && i < offset+len) SPI_send_byte(module, data[i-offset]);
-        else SPI_send_byte(module, d[i]); 
+    if (offset >= 512) return 0;
+    if (len > 512 - offset) len = 512 - offset;
+    
+    // The card can not write while a multiple block read is open
+    SD_end_multi_read(module);
+    
+    // Anything other than the next full sector ends an open multiple block write
+    if (multi_active && (sector != multi_next || offset != 0 || len != 512)) {
+        SD_end_multi_block(module);
     }
     
-    // Send the CRC 16 bytes. This is disabled in SPI mode, but the bytes must be sent
-    SPI_send_byte(module, 0x00);
-    SPI_send_byte(module, 0x00);
+    // Transfers must equal exactly 512 bytes. If only part of the sector is
+    // written, the rest of the sector is read first and merged with data
+    unsigned char d[512];
+    const unsigned char *block = data;
+    if (offset != 0 || len != 512) {
+        if (read_block(d, sector, 0, 512) != 512) return 0;
+        memcpy(&d[offset], data, len);
+        block = d;
+    }
     
-    // The card responds with a 1-byte response token, which is returned
-    unsigned char data_response = SPI_send_byte(module, 0xff);
+    // If this sector starts the hinted run, send ACMD23 so the card can pre-erase
+    // the run, then CMD25 to write it. CMD25 still works if ACMD23 is rejected.
+    unsigned char res[2];
+    if (!multi_active && hint_count > 1 && sector == hint_sector && block == data) {
+        SD_send_app_CMD(module, 23, hint_count, 1, res, &res[1]);
+        SD_send_CMD(module, 25, sector, 1, res);
+        if (res[0]) {
+            SPI_set_CS(module, 1);
+        } else {
+            multi_active = 1;
+            multi_next = sector;
+            multi_left = hint_count;
+        }
+        hint_count = 0;
+    }
     
-    // If a proper token 0bXXX00101 is sent, the SD card holds the MISO line
-    // LOW until done programming the data. Wait until this is done to return
-    unsigned char j = 100;
-    while (!SPI_send_byte(module, 0xff) && j-- > 0);
-    if (!j) {SPI_set_CS(module, 1); return 0;}   // If after 100 cycles still low, send an error
+    // Send the block as part of the open multiple block write, once the card
+    // is done with the last one
+    if (multi_active) {
+        if (SD_wait_ready(module)) {
+            SD_end_multi_block(module);
+            return 0;
+        }
+        if ((SD_send_data_block(module, 0xfc, block) & 0x1f) != 0x05) {
+            SD_end_multi_block(module);
+            return 0;
+        }
+        multi_next++;
+        if (--multi_left == 0) SD_end_multi_block(module);
+        return len;
+    }
     
+    // Send CMD24 to initiate SD Write single block. Returns R1.
+    // If this is not zero, there is an error and 0xff is returned
+    SD_send_CMD(module, 24, sector, 1, res);
+    if (res[0]) {SPI_set_CS(module, 1); return 0;}
     
-    // Send SEND_STATUS (CMD13) and see if there was a programming error
-    unsigned char response[2] = {0xff, 0xff};
-    SD_send_CMD(module, 13, sector, 2, response);
+    unsigned char data_response = SD_send_data_block(module, 0xfe, block);
     
-    // Set CS to 1 and return the data response token if not valid
+    // Set CS to 1 and return if the data response token is not valid
     SPI_set_CS(module, 1);
-    if (response[0]) return 0; // CMD 13 R1 error
-    if (response[1]) return 0; // CMD 13 programming error
     if ((data_response & 0x1f) != 0x05) return 0;
     
+    // Return while the card programs. SEND_STATUS (CMD13) is sent to check for a
+    // programming error once the card is ready, which is reported by write_flush
+    // or by hardware_eject
+    busy_check = 1;
+    busy_sector = sector;
+    
     return len;
 
 }
@@ -136,22 +294,55 @@ int write_block(const uint8_t* data, uint32_t sector, uint32_t offset, uint32_t
 */
 int read_block(uint8_t* data, uint32_t sector, uint32_t offset, uint32_t len) {
     
+    if (offset >= 512) return 0;
+    if (len > 512 - offset) len = 512 - offset;
+    
+    // The card can not read while a multiple block write is open
+    SD_end_multi_block(module);
+    
+    // Anything other than the next sector ends an open multiple block read
+    if (read_active && sector != read_next) SD_end_multi_read(module);
+    
+    // If this sector starts the hinted run, send CMD18 to read the run. The card
+    // sends the sectors one after another until CMD12 stops it.
+    unsigned char res;
+    if (!read_active && read_hint_count > 1 && sector == read_hint_sector) {
+        SD_send_CMD(module, 18, sector, 1, &res);
+        if (res) {
+            SPI_set_CS(module, 1);
+        } else {
+            read_active = 1;
+            read_next = sector;
+            read_left = read_hint_count;
+        }
+        read_hint_count = 0;
+    }
+    
     // Send CMD17 to initiate SD Read single block. Returns R1.
     // If this is not zero, there is an error and 1 is returned
-    unsigned char res;
-    SD_send_CMD(module, 17, sector, 1, &res);
-    if (res) {SPI_set_CS(module, 1); return 0;}
+    if (!read_active) {
+        SD_send_CMD(module, 17, sector, 1, &res);
+        if (res) {SPI_set_CS(module, 1); return 0;}
+    }
     
     // Wait until the card send the token 0xfe which preceeds the transmission
     // After 100 sends, assume and error and return 2.
     unsigned char counter = 100;
     while (SPI_send_byte(module, 0xff) != 0xfe && counter--);
-    if (!counter) {SPI_set_CS(module, 1); return 0;}
+    if (!counter) {
+        if (read_active) SD_end_multi_read(module);
+        SPI_set_CS(module, 1);
+        return 0;
+    }
     
-    // Place received results into buffer
-    for (int i = 0; i < 512; i++){
-        if (i >= offset && i < offset+len) rcv[i-offset] = SPI_send_byte(module, 0xff);
-        else SPI_send_byte(module, 0xff);
+    // Place received results into buffer. A full sector is received directly
+    // into data, otherwise the sector is received and the range copied.
+    if (offset == 0 && len == 512) {
+        SPI_transfer_block(module, NULL, data, 512);
+    } else {
+        unsigned char d[512];
+        SPI_transfer_block(module, NULL, d, 512);
+        memcpy(data, &d[offset], len);
     }
     
     // UNIMPLEMENTED (CRC16 is disabled by defualt) Receive CRC16 bytes
@@ -159,6 +350,13 @@ int read_block(uint8_t* data, uint32_t sector, uint32_t offset, uint32_t len) {
     CRC16[0] = SPI_send_byte(module, 0xff);
     CRC16[1] = SPI_send_byte(module, 0xff);
     
+    // CS stays low while the multiple block read is open
+    if (read_active) {
+        read_next++;
+        if (--read_left == 0) SD_end_multi_read(module);
+        return len;
+    }
+    
     // Reset CS and return
     SPI_set_CS(module, 1);
     return len;
@@ -252,5 +450,73 @@ int hardware_init(void *args) {
     @retval     others       Fail
 */
 int hardware_eject(void *args) {
+    SD_end_multi_read(module);
+    SD_end_multi_block(module);
+    if (SD_wait_ready(module) || write_error) {write_error = 0; return 1;}
+    return 0;
+}
+
+
+/*
+    Wait until every write passed to write_block is stored on the device, and
+    report whether any of them failed after write_block returned. An open multiple
+    block write is ended, and the card is waited for until it is done programming.
+    A failed write is only reported once.
+
+    @retval     0               Succuss
+    @retval     others          A write failed
+*/
+int write_flush(void) {
+    SD_end_multi_block(module);
+    if (SD_wait_ready(module) || write_error) {write_error = 0; return 1;}
+    return 0;
+}
+
+
+/*
+    Hint that a run of sectors is about to be written in order. The first write
+    to the run starts a multiple block write (CMD25) after telling the card the
+    run length with SET_WR_BLK_ERASE_COUNT (ACMD23) so it can pre-erase it.
+
+    @param      sector          First physical device sector of the run
+    @param      count           Amount of sectors in the run
+
+    @retval     0               Succuss
+    @retval     others          Fail
+*/
+int write_hint(uint32_t sector, uint32_t count) {
+    
+    SD_end_multi_block(module);
+    
+    if (count > 0x7fffff) count = 0x7fffff;     // ACMD23 takes 23 bits
+    hint_sector = sector;
+    hint_count = count;
+    
+    return 0;
+}
+
+
+/*
+    Hint that a run of sectors is about to be read in order. The first read of
+    the run starts a multiple block read (CMD18), so the card streams the run
+    without a command per sector. A run which starts at the next sector of the
+    open read extends it instead.
+
+    @param      sector          First physical device sector of the run
+    @param      count           Amount of sectors in the run
+
+    @retval     0               Succuss
+    @retval     others          Fail
+*/
+int read_hint(uint32_t sector, uint32_t count) {
+    
+    if (read_active && sector == read_next) {
+        if (count > read_left) read_left = count;
+        return 0;
+    }
+    
+    read_hint_sector = sector;
+    read_hint_count = count;
+    
     return 0;
 }
@@ -8,6 +8,11 @@
 unsigned char CRC7(unsigned char cmd, unsigned long arg);
 void SD_send_CMD(unsigned char module, unsigned char cmd, unsigned long arg, unsigned char rBytes, unsigned char* dest);
 void SD_send_app_CMD(unsigned char module, unsigned char acmd, unsigned long arg, unsigned char rBytes, unsigned char* cmddest, unsigned char* acmddest);
+unsigned char SD_poll_ready(unsigned char module);
+unsigned char SD_wait_ready(unsigned char module);
+unsigned char SD_send_data_block(unsigned char module, unsigned char token, const unsigned char* block);
+void SD_end_multi_block(unsigned char module);
+void SD_end_multi_read(unsigned char module);
 
 /*
     Write data to a physical device sector. Will write up to the end of a sector
@@ -57,3 +62,39 @@ int hardware_init(void *args);
     @retval     others       Fail
 */
 int hardware_eject(void *args);
+
+/*
+    Wait until every write passed to write_block is stored on the device, and
+    report whether any of them failed after write_block returned. Devices which
+    finish each write before write_block returns should return 0.
+
+    @retval     0               Succuss
+    @retval     others          A write failed
+*/
+int write_flush(void);
+
+/*
+    Hint that a run of sectors is about to be written in order. The device may
+    use this to prepare for the writes (such as pre-erasing the sectors). This
+    is only a hint. Implementations which do not use it should return 0.
+
+    @param      sector          First physical device sector of the run
+    @param      count           Amount of sectors in the run
+
+    @retval     0               Succuss
+    @retval     others          Fail
+*/
+int write_hint(uint32_t sector, uint32_t count);
+
+/*
+    Hint that a run of sectors is about to be read in order. The device may
+    use this to read ahead (such as streaming the run with one command). This
+    is only a hint. Implementations which do not use it should return 0.
+
+    @param      sector          First physical device sector of the run
+    @param      count           Amount of sectors in the run
+
+    @retval     0               Succuss
+    @retval     others          Fail
+*/
+int read_hint(uint32_t sector, uint32_t count);
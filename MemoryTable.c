@@ -46,6 +46,29 @@ int MT_TableUnload () {
 }
 
 
+/*
+    Writes back any changed memory to the disk without unloading the memory table.
+    Written sectors are marked as unchanged, except for permanent sectors which can
+    be changed directly through their pointer.
+
+    @returns    0   on succuss.
+    @returns    1   on failure.
+
+*/
+int MT_TableFlush () {
+
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+        if (DeviceSectors[i] & WRITE_SECTOR) {
+            if (write_block(DeviceMemory[i], DeviceSectors[i] & MAX_SECTORS, 0, SECTOR_SIZE) != SECTOR_SIZE) return 1;
+            if (!(DeviceSectors[i] & PERMANENT)) DeviceSectors[i] &= ~WRITE_SECTOR;
+        }
+    }
+
+    return 0;
+
+}
+
+
 /*
     Loads a device sector into the memory table. This function uses the clock
     page replacement algorithm to determine which sector gets replaced to load
@@ -63,7 +86,7 @@ uint8_t* MT_LoadMemory(uint32_t sector) {
     // Check memory table to see if sector is already in memory table
     for (int i = 0; i < TABLE_ENTRIES; i++) {
 
-        if (DeviceSectors[i] & MAX_SECTORS == sector) {
+        if ((DeviceSectors[i] & MAX_SECTORS) == sector) {
 
             if (DeviceSectors[i] & UNALLOCATED) continue;
 
@@ -157,6 +180,28 @@ uint8_t *MT_SetPermanent(uint32_t sector) {
 }
 
 
+/*
+    Find a sector in the memory table without loading it.
+
+    @param      sector      Sector to look for
+
+    @returns    >= 0        Index of the sector in the memory table
+    @returns    -1          Sector is not in the memory table
+
+*/
+int MT_FindSector(uint32_t sector) {
+
+    for (int i = 0; i < TABLE_ENTRIES; i++) {
+
+        if (DeviceSectors[i] & UNALLOCATED) continue;
+        if ((DeviceSectors[i] & MAX_SECTORS) == sector) return i;
+
+    }
+
+    return -1;
+}
+
+
 /*
     Write data to the memory table of given length and offset to a sector. This function
     will not write beyond a sector bouandry and will stop writing if the end of a sector
@@ -179,6 +224,13 @@ int MT_DeviceWrite(uint8_t* data, uint32_t sector, uint32_t offset, uint32_t len
     // through the table.
     uint8_t* sector_contents;
 
+    // A full sector that is not in the memory table is written straight to the device.
+    // Nothing has to be read first, and runs of sectors reach the device in order.
+    if (offset == 0 && len >= SECTOR_SIZE && MT_FindSector(sector) < 0) {
+        if (write_block(data, sector, 0, SECTOR_SIZE) != SECTOR_SIZE) return -1;
+        return SECTOR_SIZE;
+    }
+
     sector_contents = MT_LoadMemory(sector);
 
     if (sector_contents == NULL) return -1;
@@ -211,7 +263,16 @@ int MT_DeviceRead(uint8_t *data, uint32_t sector, uint32_t offset, uint32_t len)
 
     if (offset >= SECTOR_SIZE) return 0;
 
-    uint8_t *mem_table = &(MT_LoadMemory(sector)[offset]);
+    // A full sector that is not in the memory table is read straight into data.
+    // Nothing is copied, and the sectors already in the table are kept.
+    if (offset == 0 && len >= SECTOR_SIZE && MT_FindSector(sector) < 0) {
+        if (read_block(data, sector, 0, SECTOR_SIZE) != SECTOR_SIZE) return 0;
+        return SECTOR_SIZE;
+    }
+
+    uint8_t *mem_table = MT_LoadMemory(sector);
+    if (mem_table == NULL) return 0;
+    mem_table = &mem_table[offset];
 
     int i = offset;
     for (; i < offset + len && i < SECTOR_SIZE; i++) data[i-offset] = mem_table[i-offset];
@@ -86,6 +86,18 @@ int MT_TableInit ();
 int MT_TableUnload ();
 
 
+/*
+    Writes back any changed memory to the disk without unloading the memory table.
+    Written sectors are marked as unchanged, except for permanent sectors which can
+    be changed directly through their pointer.
+
+    @returns    0   on succuss.
+    @returns    1   on failure.
+
+*/
+int MT_TableFlush ();
+
+
 /*
     Loads a device sector into the memory table. This function uses the clock
     page replacement algorithm to determine which sector gets replaced to load
@@ -125,6 +137,18 @@ int MT_UnsetPermanent(uint32_t sector);
 uint8_t *MT_SetPermanent(uint32_t sector);
 
 
+/*
+    Find a sector in the memory table without loading it.
+
+    @param      sector      Sector to look for
+
+    @returns    >= 0        Index of the sector in the memory table
+    @returns    -1          Sector is not in the memory table
+
+*/
+int MT_FindSector(uint32_t sector);
+
+
 /*
     Write data to the memory table of given length and offset to a sector. This function
     will not write beyond a sector bouandry and will stop writing if the end of a sector
@@ -52,3 +52,39 @@ int hardware_init(void *args);
     @retval     others       Fail
 */
 int hardware_eject(void *args);
+
+/*
+    Wait until every write passed to write_block is stored on the device, and
+    report whether any of them failed after write_block returned. Devices which
+    finish each write before write_block returns should return 0.
+
+    @retval     0               Succuss
+    @retval     others          A write failed
+*/
+int write_flush(void);
+
+/*
+    Hint that a run of sectors is about to be written in order. The device may
+    use this to prepare for the writes (such as pre-erasing the sectors). This
+    is only a hint. Implementations which do not use it should return 0.
+
+    @param      sector          First physical device sector of the run
+    @param      count           Amount of sectors in the run
+
+    @retval     0               Succuss
+    @retval     others          Fail
+*/
+int write_hint(uint32_t sector, uint32_t count);
+
+/*
+    Hint that a run of sectors is about to be read in order. The device may
+    use this to read ahead (such as streaming the run with one command). This
+    is only a hint. Implementations which do not use it should return 0.
+
+    @param      sector          First physical device sector of the run
+    @param      count           Amount of sectors in the run
+
+    @retval     0               Succuss
+    @retval     others          Fail
+*/
+int read_hint(uint32_t sector, uint32_t count);
@@ -5,124 +5,385 @@
 ///////////////////  FAT32 HELPER FUNCTIONS /////////////////////////////
 
 /*
-    Check if a string is compliant with a long directory entry.
+    Fold a name character so that names are compared without case. ASCII
+    characters are looked up in FoldTable.
 
-    @param      IN  name            File/directory name
-    @param      IN  len             Length of name
-    @param      OUT new             File/directory to be returned
+    @param      c               Character
 
-    @retval     TRUE                File and name are matching
-    @retval     FALSE               File and name do not match
+    @return     Folded character
 */
-bool fat32IsValidLongEntry(char *name, uint16_t len, FILE *file) {
+char fat32FoldChar(char c) {
 
-    uint8_t pos = file->file.LongEntry.LDIR_Ord;
-    
-    if (pos & LAST_LONG_ENTRY) {
+    if ((uint8_t) c < 0x80) return FoldTable[(uint8_t) c];
+    return c;
+}
 
-        // 43h for example, len must be between 27 and 39 chars exactly to be valid
-        if ((len < (1 + 13*(pos & 0x3F))) || (len > (13*(1 + (pos & 0x3F))))) {
-            return FALSE;
-        }
 
-        len = len % 13;
-        if (len == 0) len = 13;
+/*
+    Compare two names without case.
 
-        return !(fat32StrCmp(&name[(pos & 0x3F)*13], len, file));
+    @param      IN  a               Name
+    @param      IN  b               Name
 
-    } else {
+    @retval     TRUE                Names match
+    @retval     FALSE               Names do not match
+*/
+bool fat32NameMatch(char *a, char *b) {
+
+    while (*a && fat32FoldChar(*a) == fat32FoldChar(*b)) {
+        a++;
+        b++;
+    }
+
+    return *a == *b;
+}
+
+
+/*
+    Hash a case folded name (FNV-1a).
+
+    @param      IN  name            Name
+
+    @return     Hash of the name
+*/
+uint32_t fat32NameHash32(char *name) {
 
-        // 3 for example, len must be 40 chars or greater
-        if (len > (pos * 3)) return FALSE;
+    uint32_t hash = 2166136261UL;
 
-        return !(fat32StrCmp(&name[pos*13], 13, file));
+    for (; *name; name++) {
+        hash ^= (uint8_t) fat32FoldChar(*name);
+        hash *= 16777619UL;
     }
 
-    return FALSE;
+    return hash;
 }
 
 
 /*
-    Check if a string is compliant with a short directory entry.
+    Hash a case folded name (FNV-1a, folded to 16 bits).
 
-    @param      IN  name            File/directory name
-    @param      IN  len             Length of name
-    @param      OUT new             File/directory to be returned
+    @param      IN  name            Name
+
+    @return     Hash of the name
+*/
+uint16_t fat32NameHash(char *name) {
+
+    uint32_t hash = fat32NameHash32(name);
+
+    return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+
+/*
+    Turn a short directory entry's name into a string, as NAME.EXT. Trailing spaces
+    are removed, and the lower case flags in DIR_NTRes are used.
+
+    @param      IN  entry           Short directory entry
+    @param      OUT name            Name, at least 13 bytes
+
+*/
+void fat32ShortName(DirEntry *entry, char *name) {
+
+    uint8_t len = 0;
+
+    for (uint8_t i = 0; i < 8 && entry->DIR_Name[i] != ' '; i++) {
+        char ch = entry->DIR_Name[i];
+        if (i == 0 && ch == FREE_ENTRY_JP) ch = FREE_ENTRY;
+        if ((entry->DIR_NTRes & NTRES_LOWER_BASE) && ch >= 'A' && ch <= 'Z') ch += 32;
+        name[len++] = ch;
+    }
 
-    @retval     TRUE                File and name are matching
-    @retval     FALSE               File and name do not match
+    if (entry->DIR_Name[8] != ' ') {
+        name[len++] = '.';
+        for (uint8_t i = 8; i < 11 && entry->DIR_Name[i] != ' '; i++) {
+            char ch = entry->DIR_Name[i];
+            if ((entry->DIR_NTRes & NTRES_LOWER_EXT) && ch >= 'A' && ch <= 'Z') ch += 32;
+            name[len++] = ch;
+        }
+    }
+
+    name[len] = 0;
+}
+
+
+/*
+    Convert part of a long name (its base or extension) to short name characters.
+    Spaces and periods are left out, characters which cannot be in a short name
+    become '_', and letters are made upper case.
+
+    @param      IN  from            First character of the part
+    @param      IN  to              Character after the part
+    @param      OUT out             Where the characters go
+    @param      IN  max             Most characters to store
+    @param      IN/OUT flags        SHORT_NAME_FITS is cleared if the part was changed or cut short.
+                                    SHORT_NAME_MIXED is set if it has both cases, and lower is set
+                                    if it is all lower case
+    @param      IN  lower           DIR_NTRes bit for the part being in lower case
+
+    @return     Amount of characters stored
 */
-bool fat32IsValidShortEntry(char *name, uint16_t len, FILE *file) {
+uint8_t fat32ShortPart(char *from, char *to, char *out, uint8_t max, uint8_t *flags, uint8_t lower) {
 
-    if (!strcmp(".          ", name)) return TRUE;
-    if (!strcmp("..         ", name)) return TRUE;
+    uint8_t len = 0;
+    bool hasUpper = FALSE;
+    bool hasLower = FALSE;
 
-    if (len > 12) return FALSE;
+    for (; from < to; from++) {
 
-    char shortName[11] = "           ";
-    char shortIndex = 0;
+        char ch = *from;
 
-    for (uint8_t i = 0; i < len; i++) {
-        if (shortIndex == 11) return FALSE;
-        if (shortIndex == 8 && i == shortIndex) return FALSE;
-        char temp = name[i];
-        if (name[i] >= 'a' && name[i] <= 'z') temp -= 32;
-        if (name[i] == '.') {
-            shortIndex = 8;
+        if (ch == ' ' || ch == '.') {
+            *flags &= ~SHORT_NAME_FITS;
             continue;
         }
-        shortName[shortIndex] = temp;
-        shortIndex++;
+
+        if (len == max) {
+            *flags &= ~SHORT_NAME_FITS;
+            break;
+        }
+
+        if (ch >= 'a' && ch <= 'z') {
+            hasLower = TRUE;
+            ch -= 32;
+        } else if (ch >= 'A' && ch <= 'Z') {
+            hasUpper = TRUE;
+        } else if ((uint8_t) ch < 0x20 || (uint8_t) ch > 0x7E || memchr(ShortNameIllegal, ch, sizeof(ShortNameIllegal))) {
+            *flags &= ~SHORT_NAME_FITS;
+            ch = '_';
+        }
+
+        out[len++] = ch;
+    }
+
+    if (hasUpper && hasLower) *flags |= SHORT_NAME_MIXED;
+    else if (hasLower) *flags |= lower;
+
+    return len;
+}
+
+
+/*
+    Make the basis of a short name from a long name: up to 8 characters before the
+    last period and 3 after it, converted with fat32ShortPart.
+
+    @param      IN  name            Long name
+    @param      OUT basis           11 character short name basis, padded with spaces
+
+    @return     SHORT_NAME_FITS if the basis is the long name unchanged, SHORT_NAME_MIXED,
+                and the DIR_NTRes lower case bits of the parts
+*/
+uint8_t fat32ShortBasis(char *name, char *basis) {
+
+    uint8_t flags = SHORT_NAME_FITS;
+    char *end = name + strlen(name);
+    char *dot;
+
+    memset(basis, ' ', 11);
+
+    // Leading periods are left out
+    while (*name == '.') {
+        flags &= ~SHORT_NAME_FITS;
+        name++;
     }
 
-    for (uint8_t i = 0; i < 11; i++) {
-        if (shortName[i] != file->file.ShortEntry.DIR_Name[i]) return FALSE;
+    dot = strrchr(name, '.');
+    if (dot == NULL) dot = end;
+
+    if (fat32ShortPart(name, dot, basis, 8, &flags, NTRES_LOWER_BASE) == 0) {
+        basis[0] = '_';
+        flags &= ~SHORT_NAME_FITS;
     }
-    return TRUE;
+
+    if (dot != end) fat32ShortPart(dot + 1, end, &basis[8], 3, &flags, NTRES_LOWER_EXT);
+
+    return flags;
 }
 
 
 /*
-    Check if a string matches a long directory entry
+    Make the short name to use for a tail. Tails 1 to SHORT_NUM_TAILS are added to
+    the basis (BASIS~1). Later tails use the first two characters of the basis, the
+    hash of the long name in hex and ~1 to ~9 (BA1F2C~1), as Windows does once many
+    names share a basis.
 
-    @param      IN  file            File/directory entry
-    @param      IN  str             ASCII Name to compare
-    @param      IN  len             Length of string
+    @param      IN  basis           Short name basis
+    @param      IN  hash            Hash of the long name
+    @param      IN  tail            Tail, 1 to SHORT_TAILS
+    @param      OUT shortName       11 character short name
+
+*/
+void fat32ShortTail(char *basis, uint16_t hash, uint8_t tail, char *shortName) {
 
-    @retval     0                   Match
-    @retval     1                   No Match
+    uint8_t len = 0;
+
+    memcpy(shortName, basis, 11);
+    while (len < 8 && basis[len] != ' ') len++;
+
+    if (tail > SHORT_NUM_TAILS) {
+        if (len > 2) len = 2;
+        for (uint8_t i = 0; i < 4; i++) shortName[len++] = "0123456789ABCDEF"[(hash >> (12 - 4 * i)) & 0xF];
+        tail -= SHORT_NUM_TAILS;
+    } else if (len > 6) {
+        len = 6;
+    }
+
+    shortName[len++] = '~';
+    shortName[len++] = '0' + tail;
+    while (len < 8) shortName[len++] = ' ';
+}
+
+
+/*
+    Find the tail an existing short name has, if it is a short name basis with a tail.
+
+    @param      shortName       11 character short name in the directory
+    @param      basis           Short name basis
+    @param      hash            Hash of the long name the basis is for
+
+    @retval     1 to SHORT_TAILS    Tail of the short name
+    @retval     0                   Short name is not the basis with a tail
+*/
+uint8_t fat32ShortTailOf(char *shortName, char *basis, uint16_t hash) {
+
+    char candidate[11];
+    uint8_t at = 8;
+    uint8_t n;
+
+    if (memcmp(&shortName[8], &basis[8], 3)) return 0;
+
+    // The tail starts at the last '~', as the basis may have one of its own
+    while (at > 0 && shortName[at - 1] != '~') at--;
+    if (at < 2 || at > 7 || shortName[at] < '1' || shortName[at] > '9') return 0;
+    n = shortName[at] - '0';
+
+    if (n <= SHORT_NUM_TAILS) {
+        fat32ShortTail(basis, hash, n, candidate);
+        if (!memcmp(candidate, shortName, 8)) return n;
+    }
+
+    fat32ShortTail(basis, hash, n + SHORT_NUM_TAILS, candidate);
+    if (!memcmp(candidate, shortName, 8)) return n + SHORT_NUM_TAILS;
+
+    return 0;
+}
+
+
+/*
+    Make the short name for a new file in a directory. A long name which fits is its
+    own short name. Otherwise the directory is read once to find which tails of the
+    basis are taken, and the first free one is used.
+
+    @param      IN  dir             Directory the file is created in
+    @param      IN  name            Long name of the file
+    @param      OUT shortName       11 character short name
+    @param      OUT flags           Flags from fat32ShortBasis
+
+    @retval     EXIT_SUCCESS        Short name was made
+    @retval     EXIT_ALREADY_EXIST  Every tail of the basis is taken
 */
-uint8_t fat32StrCmp(char *str, uint16_t len, FILE *file) {
+EXIT_STATUS fat32MakeShortName(FILE *dir, char *name, char *shortName, uint8_t *flags) {
+
+    char basis[11];
+    uint16_t hash = fat32NameHash(name);
+    uint16_t used = 0;
+    FileEntry *e;
+    DIR it;
+
+    *flags = fat32ShortBasis(name, basis);
+
+    // If a file already has this short name, it also has this long name (without case)
+    if (*flags & SHORT_NAME_FITS) {
+        memcpy(shortName, basis, 11);
+        return EXIT_SUCCESS;
+    }
+
+    fat32DirStart(dir, &it);
+
+    while ((e = fat32DirEntry(&it)) != NULL && e->ShortEntry.DIR_Name[0] != REST_FREE_ENTRY) {
+
+        if ((uint8_t) e->ShortEntry.DIR_Name[0] != FREE_ENTRY &&
+            (e->ShortEntry.DIR_Attr & ATTR_LONG_NAME_MASK) != ATTR_LONG_NAME) {
 
-    for (uint8_t i = 0; i < 5; i++) {
-        if (i >= len) {
-            if (file->file.LongEntry.LDIR_Name1[i] != 0) return 1;
-            return 0;
+            uint8_t tail = fat32ShortTailOf(e->ShortEntry.DIR_Name, basis, hash);
+            if (tail) used |= 1 << (tail - 1);
         }
-        if (file->file.LongEntry.LDIR_Name1[i] != str[i]) return 1;
+
+        it.offset += sizeof(FileEntry);
     }
 
-    for (uint8_t i = 0; i < 6; i++) {
-        if (i + 5 >= len) {
-            if (file->file.LongEntry.LDIR_Name1[i] != 0) return 1;
-            return 0;
+    for (uint8_t tail = 1; tail <= SHORT_TAILS; tail++) {
+        if (!(used & (1 << (tail - 1)))) {
+            fat32ShortTail(basis, hash, tail, shortName);
+            return EXIT_SUCCESS;
         }
-        if (file->file.LongEntry.LDIR_Name2[i] != str[i]) return 1;
     }
 
-    for (uint8_t i = 0; i < 2; i++) {
-        if (i + 11 >= len) {
-            if (file->file.LongEntry.LDIR_Name1[i] != 0) return 1;
-            return 0;
+    return EXIT_ALREADY_EXIST;
+}
+
+
+/*
+    Copy the 13 characters of a long directory entry into a name. Characters
+    outside of ASCII are replaced with '_'.
+
+    @param      IN  entry           Long directory entry
+    @param      OUT name            Where the characters go
+
+*/
+void fat32LongNameChars(LongDirEntry *entry, char *name) {
+
+    uint16_t chars[13];
+
+    for (uint8_t i = 0; i < 5; i++) chars[i] = entry->LDIR_Name1[i];
+    for (uint8_t i = 0; i < 6; i++) chars[i + 5] = entry->LDIR_Name2[i];
+    for (uint8_t i = 0; i < 2; i++) chars[i + 11] = entry->LDIR_Name3[i];
+
+    for (uint8_t i = 0; i < 13; i++) {
+        if (chars[i] == 0 || chars[i] == 0xFFFF) {
+            name[i] = 0;
+            return;
         }
-        if (file->file.LongEntry.LDIR_Name3[i] != str[i]) return 1;
+        name[i] = chars[i] > 0x7F ? '_' : (char) chars[i];
     }
+}
 
-    return 0;
 
+/*
+    Compare the 13 characters of a long directory entry with the part of a name
+    they should hold, without case. The characters are gathered into one buffer
+    and compared until the first difference. Characters outside of ASCII match
+    '_', as fat32LongNameChars shows them.
+
+    @param      entry           Long directory entry
+    @param      part            Part of the name the entry should hold
+    @param      remain          Characters left in the name from part
+
+    @retval     TRUE            Entry holds that part of the name
+    @retval     FALSE           Entry holds something else
+*/
+bool fat32LongNameMatch(LongDirEntry *entry, char *part, uint16_t remain) {
+
+    uint16_t chars[13];
+
+    for (uint8_t i = 0; i < 5; i++) chars[i] = entry->LDIR_Name1[i];
+    for (uint8_t i = 0; i < 6; i++) chars[i + 5] = entry->LDIR_Name2[i];
+    for (uint8_t i = 0; i < 2; i++) chars[i + 11] = entry->LDIR_Name3[i];
+
+    for (uint8_t i = 0; i < 13; i++) {
+
+        uint16_t ch = chars[i];
+
+        if (i == remain) return ch == 0 || ch == 0xFFFF;
+        if (ch == 0 || ch == 0xFFFF) return FALSE;
+        if (ch > 0x7F) ch = '_';
+        if (FoldTable[ch] != fat32FoldChar(part[i])) return FALSE;
+    }
+
+    return TRUE;
 }
 
 
+
 /*
     Copy a string into a long directory entry up to 13 chars. If a null terminator
     is reached, then the rest of the LDE is padded.
@@ -135,48 +396,17 @@ uint8_t fat32StrCmp(char *str, uint16_t len, FILE *file) {
 */
 uint8_t fat32StrCpy(char *str, FileEntry *file) {
 
-    for (char i = 0; i < 2; i++) file->LongEntry.LDIR_Name1[i] = 0xFFFF;
-    for (char i = 0; i < 6; i++) file->LongEntry.LDIR_Name2[i] = 0xFFFF;
-    for (char i = 0; i < 5; i++) file->LongEntry.LDIR_Name3[i] = 0xFFFF;
-
-    file->LongEntry.LDIR_Name1[0] = (uint16_t) str[0];
-    if (!file->LongEntry.LDIR_Name1[0]) return 0;
-
-    file->LongEntry.LDIR_Name1[1] = (uint16_t) str[1];
-    if (!file->LongEntry.LDIR_Name1[0]) return 0;
-
-    file->LongEntry.LDIR_Name2[0] = (uint16_t) str[2];
-    if (!file->LongEntry.LDIR_Name2[0]) return 0;
-
-    file->LongEntry.LDIR_Name2[1] = (uint16_t) str[3];
-    if (!file->LongEntry.LDIR_Name2[0]) return 0;
-
-    file->LongEntry.LDIR_Name2[2] = (uint16_t) str[4];
-    if (!file->LongEntry.LDIR_Name2[0]) return 0;
-    
-    file->LongEntry.LDIR_Name2[3] = (uint16_t) str[5];
-    if (!file->LongEntry.LDIR_Name2[0]) return 0;
-
-    file->LongEntry.LDIR_Name2[4] = (uint16_t) str[6];
-    if (!file->LongEntry.LDIR_Name2[0]) return 0;
-    
-    file->LongEntry.LDIR_Name2[5] = (uint16_t) str[7];
-    if (!file->LongEntry.LDIR_Name2[0]) return 0;
-
-    file->LongEntry.LDIR_Name3[0] = (uint16_t) str[8];
-    if (!file->LongEntry.LDIR_Name3[0]) return 0;
-    
-    file->LongEntry.LDIR_Name3[0] = (uint16_t) str[9];
-    if (!file->LongEntry.LDIR_Name3[1]) return 0;
+    uint16_t chars[13];
+    uint8_t i = 0;
 
-    file->LongEntry.LDIR_Name3[0] = (uint16_t) str[10];
-    if (!file->LongEntry.LDIR_Name3[2]) return 0;
+    for (; i < 13 && str[i]; i++) chars[i] = (uint8_t) str[i];
+    if (i < 13) chars[i++] = 0;
+    for (; i < 13; i++) chars[i] = 0xFFFF;
 
-    file->LongEntry.LDIR_Name3[0] = (uint16_t) str[11];
-    if (!file->LongEntry.LDIR_Name3[3]) return 0;
+    for (i = 0; i < 5; i++) file->LongEntry.LDIR_Name1[i] = chars[i];
+    for (i = 0; i < 6; i++) file->LongEntry.LDIR_Name2[i] = chars[i + 5];
+    for (i = 0; i < 2; i++) file->LongEntry.LDIR_Name3[i] = chars[i + 11];
 
-    file->LongEntry.LDIR_Name3[0] = (uint16_t) str[12];
-    
     return 0;
 
 }
@@ -203,7 +433,7 @@ uint16_t fat32ReadCluster(uint8_t *data, uint32_t cluster, uint32_t offset, uint
     uint32_t currOffset = offset;
     sector += offset / SECTOR_SIZE;
 
-    if (sector > endSector) return 0;
+    if (sector >= endSector) return 0;
 
     // Get the first sectors data
     if (len < SECTOR_SIZE - (offset % SECTOR_SIZE)) {
@@ -251,18 +481,18 @@ uint16_t fat32WriteCluster(uint8_t *data, uint32_t cluster, uint32_t offset, uin
 
     uint32_t sector = FSGetSector(cluster);
     if (sector == 0) return 0;
+    if (EXIT_SUCCESS != fat32SetDirty(TRUE)) return 0;
 
     uint32_t endSector = sector + BS->BPB_SecPerClus;
-    uint32_t currOffset = 0;
+    uint32_t currOffset = offset;
     sector += offset / SECTOR_SIZE;
 
-    if (sector > endSector) return 0;
+    if (sector >= endSector) return 0;
 
     // Get the first sectors data
-    uint32_t bytes;
     if (len < SECTOR_SIZE - (offset % SECTOR_SIZE)) {
         currOffset += MT_DeviceWrite(data, sector, offset % SECTOR_SIZE, len);
-        return bytes;
+        return currOffset - offset;
     }
     else {
         currOffset += MT_DeviceWrite(data, sector++, offset % SECTOR_SIZE, SECTOR_SIZE - (offset % SECTOR_SIZE));
@@ -370,290 +600,3052 @@ EXIT_STATUS fat32FileToDisk(FILE *file) {
 
 
 /*
-    Get the first cluster of the directory that a file is in.
+    Check that the dates and times of a FileTime can be stored in a directory entry.
 
-    @param      file            File to write back to disk
-
-    @retval    EXIT_SUCCUSS     Succussful
-    @retval    EXIT_WRITE_FAIL  Disk write failed.
+    @param      time                Time to check
 
+    @return     EXIT_SUCCUSS            Time is valid
+    @return     EXIT_INVALID_TIME       Time is not valid
 */
-uint32_t fat32GetDirCluster(FILE *file) {
-
-    return (file->dir->file.ShortEntry.DIR_FstClusHI << 16) + file->dir->file.ShortEntry.DIR_FstClusLO;
-}
-
-///////////////////  FILE SYSTEM FUNCTIONS //////////////////////////////
+EXIT_STATUS fat32CheckTime(FileTime *time) {
+
+    if (time->createYear < 1980 || time->createYear > 2107) return EXIT_INVALID_TIME;
+    if (time->wrtYear < 1980 || time->wrtYear > 2107) return EXIT_INVALID_TIME;
+    if (time->lstAccYear < 1980 || time->lstAccYear > 2107) return EXIT_INVALID_TIME;
+    if (time->createMonth < 1 || time->createMonth > 12) return EXIT_INVALID_TIME;
+    if (time->wrtMonth < 1 || time->wrtMonth > 12) return EXIT_INVALID_TIME;
+    if (time->lstAccMonth < 1 || time->lstAccMonth > 12) return EXIT_INVALID_TIME;
+    if (time->createDay < 1 || time->createDay > 31) return EXIT_INVALID_TIME;
+    if (time->wrtDay < 1 || time->wrtDay > 31) return EXIT_INVALID_TIME;
+    if (time->lstAccDay < 1 || time->lstAccDay > 31) return EXIT_INVALID_TIME;
+    if (time->createHour > 23) return EXIT_INVALID_TIME;
+    if (time->wrtHour > 23) return EXIT_INVALID_TIME;
+    if (time->createMinute > 59) return EXIT_INVALID_TIME;
+    if (time->wrtMinute > 59) return EXIT_INVALID_TIME;
+    if (time->createSecond > 59) return EXIT_INVALID_TIME;
+    if (time->wrtSecond > 59) return EXIT_INVALID_TIME;
+    if (time->createTenthSec > 9) return EXIT_INVALID_TIME;
+
+    // 30 Day Months
+    if (time->createMonth == 4 || time->createMonth == 6 || time->createMonth == 9 ||
+        time->createMonth == 11) {
+
+        if (time->createDay == 31) return EXIT_INVALID_TIME;
+    }
 
+    if (time->wrtMonth == 4 || time->wrtMonth == 6 || time->wrtMonth == 9 ||
+        time->wrtMonth == 11) {
 
+        if (time->wrtDay == 31) return EXIT_INVALID_TIME;
+    }
 
-/*
-    Allocate a new cluster to the end of a file
+    if (time->lstAccMonth == 4 || time->lstAccMonth == 6 || time->lstAccMonth == 9 ||
+        time->lstAccMonth == 11) {
 
-    @param      from                File End Of Cluster file, or zero, if there is not a cluster allocated
-    for a file.
-    @param      args                Hardware Initilization arguments. Varies based on implementation
+        if (time->lstAccDay == 31) return EXIT_INVALID_TIME;
+    }
 
-    @retval    > 0                      New Cluster Number
-    @retval    0                        Fail   
+    if (time->createMonth == 2) {
 
-*/
-uint32_t FSAllocateCluster(uint32_t from) {
+        if (time->createYear % 4 == 0 && time->createYear != 2100) {
+            if (time->createDay > 29) return EXIT_INVALID_TIME;
+        } else {
+            if (time->createDay > 28) return EXIT_INVALID_TIME;
+        }
 
-    // The provided FROM cluster must be EOC or unallocated
-    if (FSGetFatTableEntry(from) & FAT_MASK >= BS->PAR_Max_Cluster &&
-        FSGetFatTableEntry(from) & FAT_MASK < 2) {
-        return 0;
     }
 
-    // Full disk is error
-    if (BS->FSI_Free_Count == 0) return 0; 
-
-    uint32_t next_cluster = BS->FSI_Nxt_Free;  
+    // February
+    if (time->wrtMonth == 2) {
 
-    if (from != 0) FSFatTableUpdate(from, next_cluster);
-    FSFatTableUpdate(next_cluster, FAT_EOC);
+        if (time->wrtYear % 4 == 0 && time->wrtYear != 2100) {
+            if (time->wrtDay > 29) return EXIT_INVALID_TIME;
+        } else {
+            if (time->wrtDay > 28) return EXIT_INVALID_TIME;
+        }
 
-    BS->FSI_Free_Count--;
+    }
 
-    // Iterate through the FAT until a free cluster is found
-    while (1) {
-        
-        if (++BS->FSI_Nxt_Free >= BS->PAR_Max_Cluster) BS->FSI_Nxt_Free = 2;
+    if (time->lstAccMonth == 2) {
 
-        if (FSGetFatTableEntry(BS->FSI_Nxt_Free) == 0) break;
+        if (time->lstAccYear % 4 == 0 && time->lstAccYear != 2100) {
+            if (time->lstAccDay > 29) return EXIT_INVALID_TIME;
+        } else {
+            if (time->lstAccDay > 28) return EXIT_INVALID_TIME;
+        }
 
     }
 
-    return next_cluster;
+    return EXIT_SUCCESS;
 }
 
 
 /*
-    Update a FAT table entry with a given status
-
-    @param      cluster     Cluster which is to have FAT value updated
-    @param      status      New FAT table entry. The first four bits will be unchanged
-
-    @retval     EXIT_SUCCUSS            On Success
-    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
-    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+    Set the creation, write and last access dates and times of a short directory entry.
 
+    @param      entry               Short directory entry
+    @param      time                Time to set. It must have been checked with fat32CheckTime
 */
-EXIT_STATUS FSFatTableUpdate(uint32_t cluster, uint32_t status) {
+void fat32SetTime(DirEntry *entry, FileTime *time) {
 
-    if (cluster & FAT_MASK >= BS->PAR_Max_Cluster) return EXIT_INVALID_PARAMETER;
-    if (cluster < 2) return EXIT_INVALID_PARAMETER;
+    entry->DIR_CrtDate = time->createDay;
+    entry->DIR_CrtDate += time->createMonth << 5;
+    entry->DIR_CrtDate += (time->createYear - 1980) << 9;
 
-    // Iterate through all FAT tables and update all of the fat tables
-    for (uint8_t FATTable = 0; FATTable < BS->BPB_FATSz32; FATTable++) {
-        
-        uint32_t sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + 
-        (4*cluster)/SECTOR_SIZE + FATTable*BS->BPB_FATSz32;
+    entry->Dir_WrtDate = time->wrtDay;
+    entry->Dir_WrtDate += time->wrtMonth << 5;
+    entry->Dir_WrtDate += (time->wrtYear - 1980) << 9;
 
-        uint16_t offset = 4 * (cluster % (SECTOR_SIZE/4));
+    entry->DIR_LstAccDate = time->lstAccDay;
+    entry->DIR_LstAccDate += time->lstAccMonth << 5;
+    entry->DIR_LstAccDate += (time->lstAccYear - 1980) << 9;
 
-        if (sizeof(uint32_t) != MT_DeviceWrite((char*)&status, sector , offset & FAT_MASK, sizeof(uint32_t))) {
-            return EXIT_MEMORY_TABLE_FAIL;
-        }
-    }
+    entry->DIR_CrtTime = time->createSecond / 2;
+    entry->DIR_CrtTime += time->createMinute << 5;
+    entry->DIR_CrtTime += time->createHour << 11;
 
-    return EXIT_SUCCESS;
+    entry->DIR_WrtTime = time->wrtSecond / 2;
+    entry->DIR_WrtTime += time->wrtMinute << 5;
+    entry->DIR_WrtTime += time->wrtHour << 11;
+
+    entry->DIR_CrtTimeTenth = time->createTenthSec + 10 * (time->createSecond % 2);
 }
 
 
 /*
-    Get the first physcial sector of a cluster given the cluster
-
-    @param      cluster     Cluster which is to have FAT value updated
-    @param      status      New FAT table entry. The first four bits will be unchanged
-
-    @retval     sector number       On Success
-    @retval     0                   Fail - Not valid cluster                       
+    Set a DIR to read a directory from its first entry.
 
+    @param      dir             Directory to read
+    @param      it              DIR to set
 */
-uint32_t FSGetSector(uint32_t cluster) {
-
-    if (cluster > BS->PAR_Max_Cluster) return 0;
-    if (cluster < 2) return 0;
-
-    // Sector of cluster 2
-    uint32_t first_sector = BS->BPB_HiddSec + BS->BPB_HiddSec + 
-    BS->BPB_FATSz32 * BS->BPB_NumFATs;
-
-    return (cluster - 2) * BS->BPB_SecPerClus;
+void fat32DirStart(FILE *dir, DIR *it) {
 
+    it->dir = dir;
+    it->offset = 0;
+    it->bufOffset = DIR_NO_SECTOR;
 }
 
 
 /*
-    Get the cluster that a physical sector is in. It is possible to get a cluster
-    value equal to MAX_CLUSTER because of the final incomplete cluster on a partition.
-
-    @param      cluster     Cluster which is to have FAT value updated
-    @param      status      New FAT table entry. The first four bits will be unchanged
+    Tell the device a directory is about to be read from a sector of one of its
+    clusters up to the end of the next cluster, if the next cluster follows it on
+    the device. Finding the next cluster here also means the FAT is not read in the
+    middle of the run.
 
-    @retval     cluster number    On Success
-    @retval     0                 Fail - Sector not in partition data area                       
+    @param      dir             Directory being read
+    @param      index           Cluster index within the directory
+    @param      cluster         Cluster being read
+    @param      sector          First sector within the cluster to be read
 
 */
-uint32_t FSGetCluster(uint32_t sector) {
-
-
-    // Sector of cluster 2
-    uint32_t first_cluster = BS->BPB_HiddSec + BS->BPB_HiddSec + 
-    BS->BPB_FATSz32 * BS->BPB_NumFATs;
-
-    if (sector < first_cluster) return 0;
-    if (sector >= BS->MBR_Part.StartingLBA + BS->MBR_Part.SizeInLBA) return 0;
+void fat32DirPrefetch(FILE *dir, uint32_t index, uint32_t cluster, uint32_t sector) {
 
-    return ((sector - first_cluster) / BS->BPB_SecPerClus) + 2;
+    uint32_t allocated;
+    uint32_t count = BS->BPB_SecPerClus - sector;
 
+    if (fat32NextCluster(dir, index, cluster, 0, &allocated) == cluster + 1) count += BS->BPB_SecPerClus;
+    read_hint(FSGetSector(cluster) + sector, count);
 }
 
 
 /*
-    Get a value in the FAT table given a cluster entry
-
-    @param      cluster     Cluster which is to have FAT value updated
+    Get the directory entry at a directory's read offset. The sector holding it is
+    read into the DIR if it is not already there. Whole sectors are read straight
+    from the device, and the entries in them are decoded in place.
 
-    @retval     0           Fail or invalid
-    @retval     > 0         Sector number in table                       
+    @param      it              Directory being read
 
+    @retval     != NULL         Directory entry
+    @retval     NULL            Offset is past the end of the directory's clusters
 */
-uint32_t FSGetFatTableEntry(uint32_t cluster) {
+FileEntry *fat32DirEntry(DIR *it) {
 
-    if (cluster & FAT_MASK >= BS->PAR_Max_Cluster) return 0;
-    if (cluster & FAT_MASK < 2) return 0;
+    uint32_t sectorOffset = it->offset - it->offset % SECTOR_SIZE;
 
-    uint32_t sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + 
-    (4*cluster)/SECTOR_SIZE;
+    if (sectorOffset != it->bufOffset) {
 
-    uint16_t offset = 4 * (cluster % (SECTOR_SIZE/4));
+        uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+        uint32_t index = sectorOffset / bytesPerCluster;
+        uint32_t sector = (sectorOffset % bytesPerCluster) / SECTOR_SIZE;
+        uint32_t cluster = fat32ClusterAt(it->dir, index);
 
-    uint32_t status;
-    if (sizeof(uint32_t) != MT_DeviceRead((char*)&status, sector, offset, sizeof(uint32_t))) {
-        return 0;
-    }
+        if (cluster == 0) {
+            it->bufOffset = DIR_NO_SECTOR;
+            return NULL;
+        }
 
-    return status;
+        // A read which starts a cluster, or does not follow the last one, starts a new run
+        if (sector == 0 || it->bufOffset != sectorOffset - SECTOR_SIZE) {
+            fat32DirPrefetch(it->dir, index, cluster, sector);
+        }
 
-}
+        if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&it->buf, FSGetSector(cluster) + sector, 0, SECTOR_SIZE)) {
+            it->bufOffset = DIR_NO_SECTOR;
+            return NULL;
+        }
 
+        it->bufOffset = sectorOffset;
+    }
 
-/*
-    Search a directory for a file name and return it if found.
+    return &it->buf.Entry[(it->offset % SECTOR_SIZE) / sizeof(FileEntry)];
+}
 
-    @param      IN  name            File/directory to search for
-    @param      IN  directory       Directory which is to be searched
-    @param      OUT new             File/directory to be returned
 
-    @retval     EXIT_SUCCESS            Directory succussfully found
-    @retval     EXIT_NOT_FOUND          Directory not found
-    @retval     EXIT_INVALID_PARAMETER  Device Error
-    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table driver failed
+/*
+    Read the next file of a directory. Free entries, volume labels and long entries
+    which do not belong to the short entry after them are skipped.
+
+    @param      IN  it              Directory being read. Its offset is where reading starts, and
+                                    is set to the offset after the short entry, or of the end of
+                                    the directory
+    @param      OUT entry           Short entry of the file
+    @param      OUT start           Offset of the file's first entry (its first long entry, if it has any)
+    @param      OUT name            Long name of the file, or its short name if it has none.
+                                    NAME_BUF_LEN bytes
+
+    @retval     EXIT_SUCCESS        A file was read
+    @retval     EXIT_NOT_FOUND      The end of the directory was reached
 */
-EXIT_STATUS FSDirectorySearch(char *name, FILE *directory, FILE *new) {
-    
-    // Length of string name
-    uint16_t len = strlen(name);
-
-    // Max directory entry value (first to search for)
-    uint8_t MaxLDEntry = LAST_LONG_ENTRY | ((uint8_t) (len / 13) + 1);
+EXIT_STATUS fat32DirRead(DIR *it, FileEntry *entry, uint32_t *start, char *name) {
 
-    // Current entry
-    uint8_t LDEntry = MaxLDEntry;
+    FileEntry *e;
+    uint8_t ord = 0;            // Long entry expected next, 0 if none
+    uint8_t chkSum = 0;
 
-    // Storage container for files
-    FILE File;
+    while ((e = fat32DirEntry(it)) != NULL) {
 
-    // Current cluster that is being searched
-    uint16_t cluster = (directory->file.ShortEntry.DIR_FstClusHI << 16) + directory->file.ShortEntry.DIR_FstClusLO;
+        uint8_t first = e->ShortEntry.DIR_Name[0];
 
-    // Current sector to search through
-    uint16_t sector = FSGetSector(cluster);
-    if (sector == 0) {
-        return EXIT_INVALID_PARAMETER;
-    }
+        if (first == REST_FREE_ENTRY) break;
 
-    // Byte offset in directory
-    uint32_t byteOffset = 0;
-     
-    // Search file entries within the directory
-    while (cluster < FAT_DEFECTIVE) {
+        it->offset += sizeof(FileEntry);
 
-        // Search within a cluster
-        for (uint16_t sec = 0; sec < BS->BPB_SecPerClus; sec++) {
+        if (first == FREE_ENTRY) {
+            ord = 0;
+            continue;
+        }
+
+        // Long entries are put together from the last part of the name to the first
+        if ((e->ShortEntry.DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
+
+            uint8_t n = e->LongEntry.LDIR_Ord & 0x3F;
+
+            if (e->LongEntry.LDIR_Ord & LAST_LONG_ENTRY) {
+                if (n == 0 || n > LONG_NAME_ENTRIES) {
+                    ord = 0;
+                    continue;
+                }
+                *start = it->offset - sizeof(FileEntry);
+                chkSum = e->LongEntry.LDIR_Checksum;
+                name[n * 13] = 0;
+            } else if (ord == 0 || n != ord - 1 || e->LongEntry.LDIR_Checksum != chkSum) {
+                ord = 0;
+                continue;
+            }
+
+            ord = n;
+            fat32LongNameChars(&e->LongEntry, &name[(n - 1) * 13]);
+            continue;
+        }
+
+        if (e->ShortEntry.DIR_Attr & ATTR_VOLUME_ID) {
+            ord = 0;
+            continue;
+        }
+
+        // Use the long name only if all of it was found and it belongs to this entry
+        if (ord != 1 || chkSum != fat32ChkSum((uint8_t*)e->ShortEntry.DIR_Name)) {
+            fat32ShortName(&e->ShortEntry, name);
+            *start = it->offset - sizeof(FileEntry);
+        }
+
+        memcpy(entry, e, sizeof(FileEntry));
+        return EXIT_SUCCESS;
+    }
+
+    return EXIT_NOT_FOUND;
+}
+
+
+/*
+    Find a file by name in a directory. Long entries are compared with the part of
+    the name they hold as they are read, so long names are never put together. A
+    file is passed over as soon as its long entry count shows its name has another
+    length, or one of its long entries differs. The short entry checksum is only
+    worked out for a file whose long entries all matched. Short names are compared
+    with the 8.3 form of the name, if it has one.
+
+    @param      IN  it              Directory being read. Its offset is where reading starts,
+                                    and is set to the offset after the short entry found
+    @param      IN  name            Name to find, compared without case
+    @param      OUT entry           Short entry of the file
+    @param      OUT start           Offset of the file's first entry (its first long entry, if it has any)
+
+    @retval     EXIT_SUCCESS        File was found
+    @retval     EXIT_NOT_FOUND      The end of the directory was reached
+*/
+EXIT_STATUS fat32DirFind(DIR *it, char *name, FileEntry *entry, uint32_t *start) {
+
+    FileEntry *e;
+    char basis[11];
+    uint16_t len = strlen(name);
+    bool hasShort = (fat32ShortBasis(name, basis) & SHORT_NAME_FITS) != 0;
+    uint8_t ord = 0;            // Long entry expected next, 0 if none
+    uint8_t chkSum = 0;
+    bool match = FALSE;         // Long entries read so far hold the name
+
+    while ((e = fat32DirEntry(it)) != NULL) {
+
+        uint8_t first = e->ShortEntry.DIR_Name[0];
+
+        if (first == REST_FREE_ENTRY) break;
+
+        it->offset += sizeof(FileEntry);
+
+        if (first == FREE_ENTRY) {
+            ord = 0;
+            continue;
+        }
+
+        if ((e->ShortEntry.DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
+
+            uint8_t n = e->LongEntry.LDIR_Ord & 0x3F;
+
+            // The last long entry is read first, and its number gives the length of the name
+            if (e->LongEntry.LDIR_Ord & LAST_LONG_ENTRY) {
+                if (n == 0 || n > LONG_NAME_ENTRIES) {
+                    ord = 0;
+                    continue;
+                }
+                *start = it->offset - sizeof(FileEntry);
+                chkSum = e->LongEntry.LDIR_Checksum;
+                match = len > (n - 1) * 13 && len <= n * 13;
+            } else if (ord == 0 || n != ord - 1 || e->LongEntry.LDIR_Checksum != chkSum) {
+                ord = 0;
+                continue;
+            }
+
+            ord = n;
+            if (match) match = fat32LongNameMatch(&e->LongEntry, &name[(n - 1) * 13], len - (n - 1) * 13);
+            continue;
+        }
+
+        if (e->ShortEntry.DIR_Attr & ATTR_VOLUME_ID) {
+            ord = 0;
+            continue;
+        }
+
+        bool longName = ord == 1 && chkSum == fat32ChkSum((uint8_t*)e->ShortEntry.DIR_Name);
+
+        if ((ord == 1 && match && longName) || (hasShort && !memcmp(e->ShortEntry.DIR_Name, basis, 11))) {
+            if (!longName) *start = it->offset - sizeof(FileEntry);
+            memcpy(entry, e, sizeof(FileEntry));
+            return EXIT_SUCCESS;
+        }
+
+        ord = 0;
+    }
+
+    return EXIT_NOT_FOUND;
+}
+
+
+/*
+    Insert a name into a directory index, unless the index is too full.
+
+    @param      index           Directory index
+    @param      name            Name of the file
+    @param      start           Offset of the file's first directory entry
+
+    @retval     TRUE            Name was inserted
+    @retval     FALSE           Index is too full
+*/
+bool fat32DirIndexInsert(DirIndex *index, char *name, uint32_t start) {
+
+    uint16_t hash = fat32NameHash(name);
+    uint16_t slot = hash & (DIR_INDEX_SLOTS - 1);
+
+    // Keep a quarter of the slots empty so probes stay short
+    if (index->used >= DIR_INDEX_SLOTS - DIR_INDEX_SLOTS/4 || start / 32 >= DIR_INDEX_REMOVED) return FALSE;
+
+    while (index->slots[slot].entry != DIR_INDEX_EMPTY && index->slots[slot].entry != DIR_INDEX_REMOVED) {
+        slot = (slot + 1) & (DIR_INDEX_SLOTS - 1);
+    }
+
+    if (index->slots[slot].entry == DIR_INDEX_EMPTY) index->used++;
+    index->slots[slot].hash = hash;
+    index->slots[slot].entry = start / 32;
+
+    return TRUE;
+}
+
+
+/*
+    Get the index of a directory. If the directory is not indexed, it is read and
+    indexed, replacing the least recently used index. An index holds about
+    DIR_INDEX_SLOTS * 3/8 files, so only the first files of a larger directory are
+    indexed, up to the index's end. The rest of the directory is not read.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Index of the directory
+    @retval     NULL            Directory could not be indexed
+*/
+DirIndex *fat32DirIndexGet(FILE *dir) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    DirIndex *index = &DirIndexes[0];
+    FileEntry entry;
+    char name[NAME_BUF_LEN];
+    char shortName[13];
+    uint32_t start;
+    DIR it;
+
+    if (cluster < 2) return NULL;
+    fat32DirStart(dir, &it);
+
+    for (uint8_t i = 0; i < DIR_INDEXES; i++) {
+        if (DirIndexes[i].cluster == cluster) {
+            DirIndexes[i].stamp = ++DirIndexClock;
+            return &DirIndexes[i];
+        }
+        if ((uint16_t)(DirIndexClock - DirIndexes[i].stamp) > (uint16_t)(DirIndexClock - index->stamp)) {
+            index = &DirIndexes[i];
+        }
+    }
+
+    index->cluster = cluster;
+    index->used = 0;
+    index->stamp = ++DirIndexClock;
+    index->complete = TRUE;
+    index->end = 0;
+    for (uint16_t i = 0; i < DIR_INDEX_SLOTS; i++) index->slots[i].entry = DIR_INDEX_EMPTY;
+
+    while (fat32DirRead(&it, &entry, &start, name) == EXIT_SUCCESS) {
+
+        fat32ShortName(&entry.ShortEntry, shortName);
+
+        // The first file which does not fit ends the indexed part of the directory
+        if (!fat32DirIndexInsert(index, name, start) ||
+            (strcmp(shortName, name) && !fat32DirIndexInsert(index, shortName, start))) {
+            index->complete = FALSE;
+            index->end = start;
+            break;
+        }
+    }
+
+    return index;
+}
+
+
+/*
+    Add a new file to the index of its directory, if the directory is indexed. A file
+    after the end of a partial index is not added, as lookups read that part of the
+    directory. If the index is too full for the file, the index is dropped and built
+    again by the next lookup.
+
+    @param      dir             Directory the file is in
+    @param      name            Long name of the file, or NULL
+    @param      entry           Short entry of the file
+    @param      start           Offset of the file's first directory entry
+
+*/
+void fat32DirIndexAdd(FILE *dir, char *name, FileEntry *entry, uint32_t start) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    char shortName[13];
+
+    fat32ShortName(&entry->ShortEntry, shortName);
+
+    for (uint8_t i = 0; i < DIR_INDEXES; i++) {
+
+        if (DirIndexes[i].cluster != cluster) continue;
+        if (!DirIndexes[i].complete && start >= DirIndexes[i].end) continue;
+
+        if ((name != NULL && !fat32DirIndexInsert(&DirIndexes[i], name, start)) ||
+            ((name == NULL || strcmp(shortName, name)) && !fat32DirIndexInsert(&DirIndexes[i], shortName, start))) {
+            DirIndexes[i].cluster = 0;
+        }
+    }
+}
+
+
+/*
+    Remove a file from the index of its directory, if the directory is indexed.
+
+    @param      dir             Directory the file was in
+    @param      start           Offset of the file's first directory entry
+
+*/
+void fat32DirIndexRemove(FILE *dir, uint32_t start) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+
+    for (uint8_t i = 0; i < DIR_INDEXES; i++) {
+
+        if (DirIndexes[i].cluster != cluster) continue;
+
+        for (uint16_t slot = 0; slot < DIR_INDEX_SLOTS; slot++) {
+            if (DirIndexes[i].slots[slot].entry == start / 32) DirIndexes[i].slots[slot].entry = DIR_INDEX_REMOVED;
+        }
+    }
+}
+
+
+/*
+    Record a run of removed entries in a directory's free entry hint. The run is
+    joined to the runs it borders on either side. Otherwise it takes an unused run, or replaces the
+    smallest run if it is larger. The hint is marked if a run is dropped.
+
+    @param      slots           Free entry hint of the directory
+    @param      entry           First removed entry (byte offset / 32)
+    @param      count           Amount of removed entries
+
+*/
+void fat32DirSlotsFree(DirSlots *slots, uint16_t entry, uint16_t count) {
+
+    FreeRun *smallest = &slots->runs[0];
+    FreeRun *before = NULL;
+    FreeRun *after = NULL;
+
+    for (uint8_t i = 0; i < DIR_FREE_RUNS; i++) {
+
+        FreeRun *run = &slots->runs[i];
+
+        if (run->count && (uint32_t) run->entry + run->count == entry) before = run;
+        if (run->count && (uint32_t) entry + count == run->entry) after = run;
+        if (run->count < smallest->count) smallest = run;
+    }
+
+    if (before != NULL) {
+        before->count += count;
+        if (after != NULL) {
+            before->count += after->count;
+            after->count = 0;
+        }
+        return;
+    }
+    if (after != NULL) {
+        after->entry = entry;
+        after->count += count;
+        return;
+    }
+
+    if (smallest->count) slots->missed = TRUE;
+
+    if (smallest->count < count) {
+        smallest->entry = entry;
+        smallest->count = count;
+    }
+}
+
+
+/*
+    Get the free entry hint of a directory. If the directory does not have one, the
+    least recently used hint is replaced and the directory is read once to find its
+    end marker and runs of removed entries.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Free entry hint of the directory
+    @retval     NULL            Directory has no clusters
+
+*/
+DirSlots *fat32DirSlotsGet(FILE *dir) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    DirSlots *slots = &DirSlotHints[0];
+    FileEntry *e;
+    uint16_t runEntry = 0;
+    uint16_t runCount = 0;
+    DIR it;
+
+    if (cluster < 2) return NULL;
+
+    for (uint8_t i = 0; i < DIR_SLOT_HINTS; i++) {
+        if (DirSlotHints[i].cluster == cluster) {
+            DirSlotHints[i].stamp = ++DirSlotClock;
+            return &DirSlotHints[i];
+        }
+        if ((uint16_t)(DirSlotClock - DirSlotHints[i].stamp) > (uint16_t)(DirSlotClock - slots->stamp)) {
+            slots = &DirSlotHints[i];
+        }
+    }
+
+    slots->cluster = cluster;
+    slots->stamp = ++DirSlotClock;
+    slots->missed = FALSE;
+    for (uint8_t i = 0; i < DIR_FREE_RUNS; i++) slots->runs[i].count = 0;
+
+    fat32DirStart(dir, &it);
+
+    while ((e = fat32DirEntry(&it)) != NULL && e->ShortEntry.DIR_Name[0] != REST_FREE_ENTRY) {
+
+        if ((uint8_t) e->ShortEntry.DIR_Name[0] == FREE_ENTRY) {
+            if (runCount == 0) runEntry = it.offset / sizeof(FileEntry);
+            runCount++;
+        } else if (runCount) {
+            fat32DirSlotsFree(slots, runEntry, runCount);
+            runCount = 0;
+        }
+
+        it.offset += sizeof(FileEntry);
+    }
+
+    if (runCount) fat32DirSlotsFree(slots, runEntry, runCount);
+    slots->end = it.offset;
+
+    return slots;
+}
+
+
+/*
+    Fill a cluster of a directory with end markers. A cluster past the end of the
+    directory's chain is allocated.
+
+    @param      dir             Directory
+    @param      index           Cluster index within the directory
+
+    @retval     EXIT_SUCCESS        Cluster was cleared
+    @retval     EXIT_WRITE_FAIL     Cluster could not be allocated or written
+
+*/
+EXIT_STATUS fat32DirClear(FILE *dir, uint32_t index) {
+
+    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+    Block zero;
+
+    memset(zero.data, 0, SECTOR_SIZE);
+
+    for (uint32_t off = 0; off < bytesPerCluster; off += SECTOR_SIZE) {
+        if (SECTOR_SIZE != FSWriteFile((uint8_t*)zero.data, index * bytesPerCluster + off, SECTOR_SIZE, dir)) {
+            return EXIT_WRITE_FAIL;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Find free entries in a directory for a new file. The smallest run of removed
+    entries which is large enough is used. If none is and some runs were dropped
+    from the hint, the directory is read again to find them. Otherwise the entries
+    are placed at the end marker and the directory is grown if it is full.
+
+    @param      dir             Directory
+    @param      count           Amount of entries needed
+
+    @retval     != DIR_NO_SLOT  Offset of the first entry
+    @retval     DIR_NO_SLOT     The directory is full or could not be grown
+
+*/
+uint32_t fat32DirTakeSlots(FILE *dir, uint32_t count) {
+
+    DirSlots *slots = fat32DirSlotsGet(dir);
+    FreeRun *best = NULL;
+    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+    uint32_t offset;
+
+    if (slots == NULL) return DIR_NO_SLOT;
+
+    for (uint8_t i = 0; i < DIR_FREE_RUNS; i++) {
+        FreeRun *run = &slots->runs[i];
+        if (run->count >= count && (best == NULL || run->count < best->count)) best = run;
+    }
+
+    if (best == NULL && slots->missed) {
+
+        slots->cluster = 0;
+        slots = fat32DirSlotsGet(dir);
+
+        for (uint8_t i = 0; i < DIR_FREE_RUNS; i++) {
+            FreeRun *run = &slots->runs[i];
+            if (run->count >= count && (best == NULL || run->count < best->count)) best = run;
+        }
+    }
+
+    if (best != NULL) {
+        offset = (uint32_t) best->entry * sizeof(FileEntry);
+        best->entry += count;
+        best->count -= count;
+        return offset;
+    }
+
+    offset = slots->end;
+    if (offset / sizeof(FileEntry) + count > DIR_MAX_ENTRIES) return DIR_NO_SLOT;
+
+    // Clusters added to the directory are cleared, so the entries after the new ones read as the end
+    uint32_t last = (offset + count * sizeof(FileEntry) - 1) / bytesPerCluster;
+    for (uint32_t index = offset / bytesPerCluster; index <= last; index++) {
+        if (fat32ClusterAt(dir, index) != 0) continue;
+        if (fat32DirClear(dir, index) != EXIT_SUCCESS) return DIR_NO_SLOT;
+    }
+
+    slots->end = offset + count * sizeof(FileEntry);
+
+    return offset;
+}
+
+
+/*
+    Record entries of a removed file in the free entry hint of its directory, if
+    the directory has one.
+
+    @param      dir             Directory the file was in
+    @param      start           Offset of the file's first entry
+    @param      count           Amount of entries the file had
+
+*/
+void fat32DirSlotsRelease(FILE *dir, uint32_t start, uint16_t count) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+
+    for (uint8_t i = 0; i < DIR_SLOT_HINTS; i++) {
+        if (DirSlotHints[i].cluster == cluster) fat32DirSlotsFree(&DirSlotHints[i], start / sizeof(FileEntry), count);
+    }
+}
+
+
+/*
+    Write the entries of a directory sector being filled which were not written.
+
+    @param      dir             Directory
+    @param      buf             Sector being filled
+    @param      pos             Offset after the last entry added
+    @param      from            Offset of the first entry in buf which was not written. Set to pos
+
+    @retval     EXIT_SUCCESS        Entries were written
+    @retval     EXIT_WRITE_FAIL     Sector could not be written
+
+*/
+EXIT_STATUS fat32DirFlush(FILE *dir, Block *buf, uint32_t pos, uint32_t *from) {
+
+    uint32_t len = pos - *from;
+
+    if (len && len != FSWriteFile((uint8_t*)&buf->data[*from % SECTOR_SIZE], *from, len, dir)) return EXIT_WRITE_FAIL;
+    *from = pos;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Add an entry to a directory sector being filled. The sector is written once it
+    is full, so a run of new entries is written a sector at a time.
+
+    @param      dir             Directory
+    @param      buf             Sector being filled
+    @param      pos             Offset of the entry. Set to the offset of the next entry
+    @param      from            Offset of the first entry in buf which was not written
+    @param      entry           Entry to add
+
+    @retval     EXIT_SUCCESS        Entry was added
+    @retval     EXIT_WRITE_FAIL     Sector could not be written
+
+*/
+EXIT_STATUS fat32DirPut(FILE *dir, Block *buf, uint32_t *pos, uint32_t *from, FileEntry *entry) {
+
+    memcpy(&buf->Entry[(*pos % SECTOR_SIZE) / sizeof(FileEntry)], entry, sizeof(FileEntry));
+    *pos += sizeof(FileEntry);
+
+    if (*pos % SECTOR_SIZE) return EXIT_SUCCESS;
+
+    return fat32DirFlush(dir, buf, *pos, from);
+}
+
+
+/*
+    Fill entries of a directory with an empty entry, through a directory sector
+    being filled. The entries filled are written before returning.
+
+    @param      dir             Directory
+    @param      buf             Sector being filled
+    @param      pos             Offset of the first entry to fill. Set to end
+    @param      from            Offset of the first entry in buf which was not written
+    @param      end             Offset after the last entry to fill
+    @param      mark            First byte of the entries, FREE_ENTRY or REST_FREE_ENTRY
+
+    @retval     EXIT_SUCCESS        Entries were written
+    @retval     EXIT_WRITE_FAIL     Sector could not be written
+
+*/
+EXIT_STATUS fat32DirFill(FILE *dir, Block *buf, uint32_t *pos, uint32_t *from, uint32_t end, uint8_t mark) {
+
+    FileEntry entry;
+
+    memset(&entry, 0, sizeof(FileEntry));
+    entry.ShortEntry.DIR_Name[0] = mark;
+
+    while (*pos < end) {
+        if (fat32DirPut(dir, buf, pos, from, &entry) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+    }
+
+    return fat32DirFlush(dir, buf, *pos, from);
+}
+
+
+/*
+    Find the remembered result of looking up a name in a directory.
+
+    @param      parent          First cluster of the directory
+    @param      name            Name looked up
+
+    @retval     != NULL         Remembered result
+    @retval     NULL            Name was not remembered
+*/
+Dentry *fat32DentryFind(uint32_t parent, char *name) {
+
+    for (uint8_t i = 0; i < DENTRY_CACHE; i++) {
+        if (Dentries[i].parent == parent && fat32NameMatch(name, Dentries[i].name)) {
+            Dentries[i].stamp = ++DentryClock;
+            return &Dentries[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    Remember the result of looking up a name in a directory, replacing the least
+    recently used result. Names longer than DENTRY_NAME_LEN are not remembered.
+
+    @param      parent          First cluster of the directory
+    @param      name            Name looked up
+    @param      offset          Offset of the file's short entry, DENTRY_NEGATIVE if not found
+
+*/
+void fat32DentryStore(uint32_t parent, char *name, uint32_t offset) {
+
+    Dentry *dentry = &Dentries[0];
+
+    if (strlen(name) > DENTRY_NAME_LEN) return;
+
+    for (uint8_t i = 0; i < DENTRY_CACHE; i++) {
+        if (Dentries[i].parent == 0) {
+            dentry = &Dentries[i];
+            break;
+        }
+        if ((uint16_t)(DentryClock - Dentries[i].stamp) > (uint16_t)(DentryClock - dentry->stamp)) {
+            dentry = &Dentries[i];
+        }
+    }
+
+    dentry->parent = parent;
+    dentry->offset = offset;
+    dentry->stamp = ++DentryClock;
+    strcpy(dentry->name, name);
+}
+
+
+/*
+    Forget every remembered result for a directory. Called when files are added
+    to or removed from it.
+
+    @param      parent          First cluster of the directory
+
+*/
+void fat32DentryDrop(uint32_t parent) {
+
+    for (uint8_t i = 0; i < DENTRY_CACHE; i++) {
+        if (Dentries[i].parent == parent) Dentries[i].parent = 0;
+    }
+}
+
+
+/*
+    Check that a remembered short entry still belongs to the file it was remembered
+    for. The file's long entries are walked back to its first entry, then the file
+    is read again. It must end at the remembered short entry and have the name
+    looked up, as its long or short name.
+
+    @param      IN  dir             Directory the file is in
+    @param      IN  offset          Remembered offset of the file's short entry
+    @param      IN  name            Name the file was looked up by
+    @param      OUT entry           Short entry of the file
+
+    @retval     TRUE                The entry is the file looked up
+    @retval     FALSE               The entry was removed or is another file
+
+*/
+bool fat32DentryCheck(FILE *dir, uint32_t offset, char *name, FileEntry *entry) {
+
+    char entryName[NAME_BUF_LEN];
+    char shortName[13];
+    uint32_t start = offset;
+    uint32_t found;
+    FileEntry e;
+    DIR it;
+
+    while (start >= sizeof(FileEntry) && offset - start < LONG_NAME_ENTRIES * sizeof(FileEntry)) {
+
+        if (sizeof(FileEntry) != FSReadFile((uint8_t*)&e, start - sizeof(FileEntry), sizeof(FileEntry), dir)) return FALSE;
+        if ((uint8_t)e.ShortEntry.DIR_Name[0] == FREE_ENTRY || (e.ShortEntry.DIR_Attr & ATTR_LONG_NAME_MASK) != ATTR_LONG_NAME) break;
+
+        start -= sizeof(FileEntry);
+        if (e.LongEntry.LDIR_Ord & LAST_LONG_ENTRY) break;
+    }
+
+    fat32DirStart(dir, &it);
+    it.offset = start;
+    if (fat32DirRead(&it, entry, &found, entryName) != EXIT_SUCCESS || it.offset != offset + sizeof(FileEntry)) return FALSE;
+
+    fat32ShortName(&entry->ShortEntry, shortName);
+
+    return fat32NameMatch(name, entryName) || fat32NameMatch(name, shortName);
+}
+
+
+/*
+    Drop the index, free entry hint and remembered lookups of a directory, after
+    entries in it were moved or the directory was removed.
+
+    @param      cluster         First cluster of the directory
+
+*/
+void fat32DirForget(uint32_t cluster) {
+
+    for (uint8_t i = 0; i < DIR_INDEXES; i++) {
+        if (DirIndexes[i].cluster == cluster) DirIndexes[i].cluster = 0;
+    }
+    for (uint8_t i = 0; i < DIR_SLOT_HINTS; i++) {
+        if (DirSlotHints[i].cluster == cluster) DirSlotHints[i].cluster = 0;
+    }
+    fat32DentryDrop(cluster);
+}
+
+
+/*
+    Read the first sector of a directory, finding its index file and which of the
+    sector's entries are free.
+
+    @param      IN  dir             Directory
+    @param      OUT freeMap         Free entries in the sector, one bit each
+
+    @retval     != DIR_NO_SLOT      Offset of the index file's short entry
+    @retval     DIR_NO_SLOT         The first sector has no index file
+*/
+uint32_t fat32IndexFileFind(FILE *dir, uint16_t *freeMap) {
+
+    uint32_t offset = DIR_NO_SLOT;
+    FileEntry *e;
+    DIR it;
+
+    *freeMap = 0;
+    fat32DirStart(dir, &it);
+
+    for (uint8_t i = 0; i < SECTOR_SIZE / sizeof(FileEntry); i++) {
+
+        it.offset = i * sizeof(FileEntry);
+        e = fat32DirEntry(&it);
+        if (e == NULL) break;
+
+        uint8_t first = e->ShortEntry.DIR_Name[0];
+
+        // Long entries have the volume label bit set, so they are not taken for the index file
+        if (first == FREE_ENTRY || first == REST_FREE_ENTRY) {
+            *freeMap |= 1 << i;
+        } else if (offset == DIR_NO_SLOT && !memcmp(e->ShortEntry.DIR_Name, INDEX_FILE_NAME, 11) &&
+                   (e->ShortEntry.DIR_Attr & (INDEX_FILE_ATTR | ATTR_DIRECTORY | ATTR_VOLUME_ID)) == INDEX_FILE_ATTR) {
+            offset = it.offset;
+        }
+    }
+
+    return offset;
+}
+
+
+/*
+    Forget the index file of a directory, so it is read again when next used.
+
+    @param      cluster         First cluster of the directory
+
+*/
+void fat32IndexFileDrop(uint32_t cluster) {
+
+    for (uint8_t i = 0; i < INDEX_FILES; i++) {
+        if (IndexFiles[i].dirCluster == cluster) IndexFiles[i].dirCluster = 0;
+    }
+}
+
+
+/*
+    Get the index file of a directory. If it is not remembered, the directory's first
+    sector and the index file's header are read, replacing the least recently used
+    index file. The keys are valid if they were built for the header's generation,
+    the free entries of the first sector have not changed, and nothing was added
+    after the end the directory had when they were built.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Index file of the directory
+    @retval     NULL            The directory has no index file
+*/
+IndexFile *fat32IndexFileLoad(FILE *dir) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    IndexFile *index = &IndexFiles[0];
+    IndexHeader *header;
+    uint16_t freeMap;
+    FileEntry *e;
+    DIR it;
+
+    if (cluster < 2) return NULL;
+
+    for (uint8_t i = 0; i < INDEX_FILES; i++) {
+        if (IndexFiles[i].dirCluster == cluster) {
+            IndexFiles[i].stamp = ++IndexFileClock;
+            return IndexFiles[i].offset == DIR_NO_SLOT ? NULL : &IndexFiles[i];
+        }
+    }
+
+    for (uint8_t i = 0; i < INDEX_FILES; i++) {
+        if (IndexFiles[i].dirCluster == 0) {
+            index = &IndexFiles[i];
+            break;
+        }
+        if ((uint16_t)(IndexFileClock - IndexFiles[i].stamp) > (uint16_t)(IndexFileClock - index->stamp)) {
+            index = &IndexFiles[i];
+        }
+    }
+
+    index->dirCluster = cluster;
+    index->stamp = ++IndexFileClock;
+    index->valid = FALSE;
+    index->checked = FALSE;
+    index->offset = fat32IndexFileFind(dir, &freeMap);
+    if (index->offset == DIR_NO_SLOT) return NULL;
+
+    fat32DirStart(dir, &it);
+    it.offset = index->offset;
+    e = fat32DirEntry(&it);
+    if (e == NULL) {
+        index->offset = DIR_NO_SLOT;
+        return NULL;
+    }
+
+    memcpy(&index->file.file, e, sizeof(FileEntry));
+    index->file.len = strlen("DIRINDEX.SYS");
+    index->file.dir = NULL;
+    index->file.dirCluster = cluster;
+    index->file.dirOffset = index->offset;
+    index->file.allocLen = 0;
+    fat32ResetCache(&index->file);
+
+    header = &index->header;
+    if (sizeof(IndexHeader) != FSReadFile((uint8_t*)header, 0, sizeof(IndexHeader), &index->file)) header->magic = 0;
+
+    if (header->magic != INDEX_FILE_MAGIC || header->version != INDEX_FILE_VERSION || header->dirCluster != cluster) {
+        header->magic = 0;
+        return index;
+    }
+
+    it.offset = header->dirEnd;
+    e = fat32DirEntry(&it);
+
+    index->valid = header->built == header->generation && header->freeMap == freeMap &&
+                   (e == NULL || e->ShortEntry.DIR_Name[0] == REST_FREE_ENTRY);
+
+    return index;
+}
+
+
+/*
+    Mark the keys of a directory's index file stale before the directory is changed,
+    by moving the header's generation past the one the keys were built for. The
+    header is only written the first time. The directory must not be changed if the
+    header could not be written.
+
+    @param      dir             Directory about to be changed
+
+    @retval     EXIT_SUCCESS        Keys are stale, or the directory has no index file
+    @retval     EXIT_WRITE_FAIL     Header could not be written
+
+*/
+EXIT_STATUS fat32IndexFileStale(FILE *dir) {
+
+    IndexFile *index = fat32IndexFileLoad(dir);
+
+    if (index == NULL) return EXIT_SUCCESS;
+
+    index->valid = FALSE;
+    if (index->header.magic != INDEX_FILE_MAGIC || index->header.built != index->header.generation) return EXIT_SUCCESS;
+
+    // The generation is kept if the header is not written, so the next change tries again
+    index->header.generation++;
+    if (sizeof(IndexHeader) != FSWriteFile((uint8_t*)&index->header, 0, sizeof(IndexHeader), &index->file)) {
+        index->header.generation--;
+        return EXIT_WRITE_FAIL;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Sort the keys of an index file node by hash. Nodes are small, so an insertion
+    sort is used.
+
+    @param      keys            Keys to sort
+    @param      count           Amount of keys
+
+*/
+void fat32IndexSort(IndexKey *keys, uint16_t count) {
+
+    for (uint16_t i = 1; i < count; i++) {
+
+        IndexKey key = keys[i];
+        uint16_t j = i;
+
+        for (; j > 0 && keys[j - 1].hash > key.hash; j--) keys[j] = keys[j - 1];
+        keys[j] = key;
+    }
+}
+
+
+/*
+    Sort and write the leaf being filled while an index file is built. Leaves are
+    written from the index file's second sector on.
+
+    @param      idx             Index file
+    @param      buf             Leaf being filled
+    @param      keys            Keys added so far, the last of which is in buf
+
+    @retval     EXIT_SUCCESS        Leaf was written
+    @retval     EXIT_WRITE_FAIL     Leaf could not be written
+
+*/
+EXIT_STATUS fat32IndexWriteLeaf(FILE *idx, Block *buf, uint32_t keys) {
+
+    buf->Node.count = keys == 0 ? 0 : (keys - 1) % INDEX_KEYS + 1;
+    buf->Node.level = 0;
+    buf->Node.reserved = 0;
+    fat32IndexSort(buf->Node.keys, buf->Node.count);
+
+    uint32_t sector = keys == 0 ? 1 : (keys - 1) / INDEX_KEYS + 1;
+    if (SECTOR_SIZE != FSWriteFile((uint8_t*)buf->data, sector * SECTOR_SIZE, SECTOR_SIZE, idx)) return EXIT_WRITE_FAIL;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Add a key to the leaf being filled while an index file is built. A full leaf is
+    sorted and written, so the leaves start as sorted runs of one sector.
+
+    @param      idx             Index file
+    @param      buf             Leaf being filled
+    @param      keys            Keys added so far. Incremented
+    @param      name            Name of the file
+    @param      entry           First directory entry of the file (byte offset / 32)
+
+    @retval     EXIT_SUCCESS        Key was added
+    @retval     EXIT_WRITE_FAIL     Leaf could not be written
+
+*/
+EXIT_STATUS fat32IndexAddKey(FILE *idx, Block *buf, uint32_t *keys, char *name, uint32_t entry) {
+
+    IndexKey *key = &buf->Node.keys[*keys % INDEX_KEYS];
+
+    key->hash = fat32NameHash32(name);
+    key->entry = entry;
+    (*keys)++;
+
+    if (*keys % INDEX_KEYS) return EXIT_SUCCESS;
+
+    return fat32IndexWriteLeaf(idx, buf, *keys);
+}
+
+
+/*
+    Read a directory and write the keys of its files to an index file as sorted
+    leaves. A file with a long name gets a key for its long name and one for its
+    short name. There is always at least one leaf, even if it has no keys.
+
+    @param      IN  idx             Index file
+    @param      IN  dir             Directory
+    @param      OUT keys            Amount of keys
+    @param      OUT end             Offset of the end of the directory
+
+    @retval     EXIT_SUCCESS        Keys were written
+    @retval     EXIT_WRITE_FAIL     A leaf could not be written
+*/
+EXIT_STATUS fat32IndexRuns(FILE *idx, FILE *dir, uint32_t *keys, uint32_t *end) {
+
+    FileEntry entry;
+    char name[NAME_BUF_LEN];
+    char shortName[13];
+    uint32_t start;
+    Block buf;
+    DIR it;
+
+    *keys = 0;
+    fat32DirStart(dir, &it);
+
+    while (fat32DirRead(&it, &entry, &start, name) == EXIT_SUCCESS) {
+
+        if (fat32IndexAddKey(idx, &buf, keys, name, start / sizeof(FileEntry)) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+
+        fat32ShortName(&entry.ShortEntry, shortName);
+        if (strcmp(shortName, name) && fat32IndexAddKey(idx, &buf, keys, shortName, start / sizeof(FileEntry)) != EXIT_SUCCESS) {
+            return EXIT_WRITE_FAIL;
+        }
+    }
+
+    *end = it.offset;
+
+    if (*keys != 0 && *keys % INDEX_KEYS == 0) return EXIT_SUCCESS;
+
+    return fat32IndexWriteLeaf(idx, &buf, *keys);
+}
+
+
+/*
+    Sum the names in a directory up to an offset, so another OS changing, removing or
+    adding a file there is noticed. Long entries are summed whole, short entries up to
+    their attributes, as sizes, dates and clusters change without a file being renamed.
+
+    @param      IN  dir             Directory
+    @param      IN  end             Offset after the last entry to sum
+    @param      IN  skip            Offset of an entry which is not summed, the index file's
+    @param      OUT sum             Sum of the entries
+
+    @retval     EXIT_SUCCESS        Entries were summed
+    @retval     EXIT_READ_FAIL      Directory could not be read
+*/
+EXIT_STATUS fat32IndexDirSum(FILE *dir, uint32_t end, uint32_t skip, uint32_t *sum) {
+
+    FileEntry *e;
+    DIR it;
+
+    *sum = 0;
+    fat32DirStart(dir, &it);
+
+    for (it.offset = 0; it.offset < end; it.offset += sizeof(FileEntry)) {
+
+        if (it.offset == skip) continue;
+
+        e = fat32DirEntry(&it);
+        if (e == NULL) return EXIT_READ_FAIL;
+
+        uint8_t *b = (uint8_t*)e;
+        uint8_t len = (e->ShortEntry.DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME ? sizeof(FileEntry) : 12;
+
+        for (uint8_t i = 0; i < len; i++) *sum = (*sum << 5 | *sum >> 27) + b[i];
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Merge pairs of sorted runs of an index file's leaves into runs twice as long,
+    from one area of the file to another. Every leaf but the last is full, so each
+    run starts at the start of a leaf.
+
+    @param      idx             Index file
+    @param      from            Sector of the first leaf to read
+    @param      to              Sector of the first leaf to write
+    @param      keys            Keys in the leaves
+    @param      width           Leaves in each run read
+
+    @retval     EXIT_SUCCESS        Runs were merged
+    @retval     EXIT_READ_FAIL      A leaf could not be read
+    @retval     EXIT_WRITE_FAIL     A leaf could not be written
+
+*/
+EXIT_STATUS fat32IndexMerge(FILE *idx, uint32_t from, uint32_t to, uint32_t keys, uint32_t width) {
+
+    uint32_t run = width * INDEX_KEYS;
+    uint32_t loaded[2] = {0, 0};    // Sector in each input buffer, 0 (the header) if none
+    uint32_t pos = 0;               // Keys written
+    Block in[2];
+    Block out;
+
+    for (uint32_t start = 0; start < keys; start += 2 * run) {
+
+        uint32_t next[2] = {start, start + run};        // Next key of each run
+        uint32_t last[2] = {start + run, start + 2 * run};
+
+        if (last[0] > keys) last[0] = keys;
+        if (next[1] > keys) next[1] = keys;
+        if (last[1] > keys) last[1] = keys;
+
+        while (next[0] < last[0] || next[1] < last[1]) {
+
+            IndexKey *key[2] = {NULL, NULL};
+
+            for (uint8_t r = 0; r < 2; r++) {
+
+                if (next[r] == last[r]) continue;
+
+                uint32_t sector = from + next[r] / INDEX_KEYS;
+                if (loaded[r] != sector) {
+                    if (SECTOR_SIZE != FSReadFile((uint8_t*)in[r].data, sector * SECTOR_SIZE, SECTOR_SIZE, idx)) return EXIT_READ_FAIL;
+                    loaded[r] = sector;
+                }
+
+                key[r] = &in[r].Node.keys[next[r] % INDEX_KEYS];
+            }
+
+            uint8_t r = (key[0] == NULL || (key[1] != NULL && key[1]->hash < key[0]->hash)) ? 1 : 0;
+
+            out.Node.keys[pos % INDEX_KEYS] = *key[r];
+            next[r]++;
+            pos++;
+
+            if (pos % INDEX_KEYS && pos != keys) continue;
+
+            out.Node.count = (pos - 1) % INDEX_KEYS + 1;
+            out.Node.level = 0;
+            out.Node.reserved = 0;
+            if (SECTOR_SIZE != FSWriteFile((uint8_t*)out.data, (to + (pos - 1) / INDEX_KEYS) * SECTOR_SIZE, SECTOR_SIZE, idx)) {
+                return EXIT_WRITE_FAIL;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Write the level of an index file's nodes above a level. Each node holds the first
+    hash and the sector of up to INDEX_KEYS nodes of the level below.
+
+    @param      idx             Index file
+    @param      children        Sector of the first node of the level below
+    @param      count           Nodes in the level below
+    @param      parent          Sector of the first node to write
+    @param      level           Level of the nodes written
+
+    @retval     EXIT_SUCCESS        Level was written
+    @retval     EXIT_READ_FAIL      A node could not be read
+    @retval     EXIT_WRITE_FAIL     A node could not be written
+
+*/
+EXIT_STATUS fat32IndexLevel(FILE *idx, uint32_t children, uint32_t count, uint32_t parent, uint16_t level) {
+
+    Block child;
+    Block node;
+
+    for (uint32_t i = 0; i < count; i++) {
+
+        IndexKey *key = &node.Node.keys[i % INDEX_KEYS];
+
+        if (SECTOR_SIZE != FSReadFile((uint8_t*)child.data, (children + i) * SECTOR_SIZE, SECTOR_SIZE, idx)) return EXIT_READ_FAIL;
+
+        key->hash = child.Node.count ? child.Node.keys[0].hash : 0;
+        key->entry = children + i;
+
+        if ((i + 1) % INDEX_KEYS && i + 1 < count) continue;
+
+        node.Node.count = i % INDEX_KEYS + 1;
+        node.Node.level = level;
+        node.Node.reserved = 0;
+        if (SECTOR_SIZE != FSWriteFile((uint8_t*)node.data, (parent + i / INDEX_KEYS) * SECTOR_SIZE, SECTOR_SIZE, idx)) {
+            return EXIT_WRITE_FAIL;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Write the keys of a directory's index file. The file's old clusters are freed
+    and the keys are written to new ones: the leaves as sorted runs, merged until
+    they are one run, then the levels of nodes above them. The header is written
+    last, so a write which is stopped leaves keys which are not used.
+
+    @param      index           Index file, whose entry is written through dir
+    @param      dir             Directory the index file is in
+
+    @retval     EXIT_SUCCESS        Keys were written
+    @retval     others              Index file could not be written
+
+*/
+EXIT_STATUS fat32IndexWrite(IndexFile *index, FILE *dir) {
+
+    FILE *idx = &index->file;
+    IndexHeader *header = &index->header;
+    uint32_t cluster = fat32GetFirstCluster(idx);
+    uint32_t generation = header->magic == INDEX_FILE_MAGIC ? header->generation + 1 : 1;
+    uint32_t keys, end, sum, leaves, sectors, count, first, other;
+    uint16_t freeMap;
+    EXIT_STATUS status;
+    Block buf;
+
+    // The entry is cleared before the old clusters are freed, so it never holds free clusters
+    idx->file.ShortEntry.DIR_FstClusHI = 0;
+    idx->file.ShortEntry.DIR_FstClusLO = 0;
+    idx->file.ShortEntry.DIR_FileSize = 0;
+    idx->allocLen = 0;
+    fat32ResetCache(idx);
+
+    status = fat32FileToDisk(idx);
+    if (status != EXIT_SUCCESS) return status;
+
+    if (cluster >= 2) {
+        status = fat32FreeChain(cluster);
+        if (status != EXIT_SUCCESS) return status;
+    }
+
+    // An empty header is written first, so the file is not used until the keys are built
+    memset(buf.data, 0, SECTOR_SIZE);
+    if (SECTOR_SIZE != FSWriteFile((uint8_t*)buf.data, 0, SECTOR_SIZE, idx)) return EXIT_WRITE_FAIL;
+
+    status = fat32FileToDisk(idx);
+    if (status != EXIT_SUCCESS) return status;
+
+    status = fat32IndexRuns(idx, dir, &keys, &end);
+    if (status != EXIT_SUCCESS) return status;
+
+    status = fat32IndexDirSum(dir, end, index->offset, &sum);
+    if (status != EXIT_SUCCESS) return status;
+
+    // The leaves need room twice, as runs are merged from one area to the other, then the levels above them
+    leaves = keys == 0 ? 1 : (keys - 1) / INDEX_KEYS + 1;
+    sectors = 1 + 2 * leaves;
+    for (count = leaves; count > 1; sectors += count) count = (count - 1) / INDEX_KEYS + 1;
+
+    status = FSReserve(idx, sectors * SECTOR_SIZE);
+    if (status != EXIT_SUCCESS) return status;
+    idx->file.ShortEntry.DIR_FileSize = sectors * SECTOR_SIZE;
+
+    first = 1;
+    other = 1 + leaves;
+    for (uint32_t width = 1; width < leaves; width *= 2) {
+
+        status = fat32IndexMerge(idx, first, other, keys, width);
+        if (status != EXIT_SUCCESS) return status;
+
+        other = first;
+        first = first == 1 ? 1 + leaves : 1;
+    }
+
+    header->height = 1;
+    header->root = first;
+    other = 1 + 2 * leaves;
+
+    for (count = leaves; count > 1; header->height++) {
+
+        status = fat32IndexLevel(idx, header->root, count, other, header->height);
+        if (status != EXIT_SUCCESS) return status;
+
+        header->root = other;
+        count = (count - 1) / INDEX_KEYS + 1;
+        other += count;
+    }
+
+    fat32IndexFileFind(dir, &freeMap);
+
+    header->magic = INDEX_FILE_MAGIC;
+    header->version = INDEX_FILE_VERSION;
+    header->generation = generation;
+    header->built = generation;
+    header->dirCluster = fat32GetFirstCluster(dir);
+    header->dirEnd = end;
+    header->freeMap = freeMap;
+    header->reserved = 0;
+    header->keys = keys;
+    header->firstLeaf = first;
+    header->leaves = leaves;
+    header->dirSum = sum;
+
+    memset(buf.data, 0, SECTOR_SIZE);
+    memcpy(&buf.Index, header, sizeof(IndexHeader));
+    if (SECTOR_SIZE != FSWriteFile((uint8_t*)buf.data, 0, SECTOR_SIZE, idx)) return EXIT_WRITE_FAIL;
+
+    return fat32FileToDisk(idx);
+}
+
+
+/*
+    Build the keys of a directory's index file (see fat32IndexWrite). The index file
+    is only linked to the directory while they are written, and its keys are used by
+    lookups if they were.
+
+    @param      index           Index file
+    @param      dir             Directory the index file is in
+
+    @retval     EXIT_SUCCESS        Keys were built
+    @retval     others              Index file could not be written
+
+*/
+EXIT_STATUS fat32IndexBuild(IndexFile *index, FILE *dir) {
+
+    EXIT_STATUS status;
+
+    index->valid = FALSE;
+    index->checked = FALSE;
+
+    index->file.dir = dir;
+    status = fat32IndexWrite(index, dir);
+    index->file.dir = NULL;
+
+    index->valid = status == EXIT_SUCCESS;
+    index->checked = index->valid;
+
+    return status;
+}
+
+
+/*
+    Get the index file of a directory for a lookup. Stale keys (the directory was
+    changed by another OS, or by this driver since they were built) are not used,
+    and are only built again by FSIndexDirectory.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Index file with valid keys
+    @retval     NULL            The directory has no index file, or its keys are stale
+*/
+IndexFile *fat32IndexFileGet(FILE *dir) {
+
+    IndexFile *index = fat32IndexFileLoad(dir);
+
+    if (index == NULL || !index->valid) return NULL;
+
+    return index;
+}
+
+
+/*
+    Find a file by name through a directory's index file. The nodes are followed down
+    to the first leaf which can have the name's hash, and each file with the hash is
+    read from the directory to compare its names.
+
+    @param      IN  index           Index file of the directory
+    @param      IN  name            Name to find, compared without case
+    @param      IN  it              Directory being read. Set to the offset after the short entry found
+    @param      OUT entry           Short entry of the file
+    @param      OUT entryName       Long name of the file, or its short name if it has none.
+                                    NAME_BUF_LEN bytes
+
+    @retval     EXIT_SUCCESS        File was found
+    @retval     EXIT_NOT_FOUND      File is not in the directory
+    @retval     EXIT_READ_FAIL      A node could not be read
+*/
+EXIT_STATUS fat32IndexFileSearch(IndexFile *index, char *name, DIR *it, FileEntry *entry, char *entryName) {
+
+    uint32_t hash = fat32NameHash32(name);
+    uint32_t sector = index->header.root;
+    char shortName[13];
+    uint32_t start;
+    Block node;
+
+    // Follow the child before the first one which starts at or after the hash, as keys
+    // with the hash can be at the end of the child before
+    for (uint16_t level = index->header.height; level > 1; level--) {
+
+        if (SECTOR_SIZE != FSReadFile((uint8_t*)node.data, sector * SECTOR_SIZE, SECTOR_SIZE, &index->file)) return EXIT_READ_FAIL;
+
+        uint16_t low = 0;
+        uint16_t high = node.Node.count;
+
+        while (low < high) {
+            uint16_t mid = (low + high) / 2;
+            if (node.Node.keys[mid].hash < hash) low = mid + 1;
+            else high = mid;
+        }
+
+        sector = node.Node.keys[low ? low - 1 : 0].entry;
+    }
+
+    // Keys with the hash can go on into the next leaves
+    for (; sector < index->header.firstLeaf + index->header.leaves; sector++) {
+
+        if (SECTOR_SIZE != FSReadFile((uint8_t*)node.data, sector * SECTOR_SIZE, SECTOR_SIZE, &index->file)) return EXIT_READ_FAIL;
+
+        for (uint16_t i = 0; i < node.Node.count; i++) {
+
+            IndexKey *key = &node.Node.keys[i];
+
+            if (key->hash < hash) continue;
+            if (key->hash > hash) return EXIT_NOT_FOUND;
+
+            it->offset = key->entry * sizeof(FileEntry);
+            if (fat32DirRead(it, entry, &start, entryName) != EXIT_SUCCESS || start != key->entry * sizeof(FileEntry)) continue;
+
+            fat32ShortName(&entry->ShortEntry, shortName);
+            if (fat32NameMatch(name, entryName) || fat32NameMatch(name, shortName)) return EXIT_SUCCESS;
+        }
+    }
+
+    return EXIT_NOT_FOUND;
+}
+
+
+/*
+    Check that a directory still matches the keys of its index file, so a name they
+    do not have is not in the directory. Another OS can have removed or renamed files
+    anywhere in it, so the directory is read and summed up to the end it had when the
+    keys were built. This is done once per index file read, the first time a name is
+    not found in the keys; keys which do not match are stale.
+
+    @param      index           Index file with valid keys
+    @param      dir             Directory the index file is in
+
+    @retval     TRUE            The directory matches the keys
+    @retval     FALSE           The directory does not match the keys, or could not be read
+*/
+bool fat32IndexFileCheck(IndexFile *index, FILE *dir) {
+
+    uint32_t sum;
+
+    if (index->checked) return TRUE;
+    if (fat32IndexDirSum(dir, index->header.dirEnd, index->offset, &sum) != EXIT_SUCCESS) return FALSE;
+
+    index->checked = sum == index->header.dirSum;
+    if (!index->checked) index->valid = FALSE;
+
+    return index->checked;
+}
+
+
+/*
+    Add an empty index file to a directory, in its first sector. If the sector has no
+    free entry, the first file in it is moved to the end of the directory.
+
+    @param      dir                 Directory
+    @param      open                Files open in the directory, may be NULL if openCount is 0
+    @param      openCount           Amount of files in open
+
+    @retval     EXIT_SUCCESS        Index file was added
+    @retval     EXIT_FAIL           No file could be moved out of the first sector
+    @retval     EXIT_READ_FAIL      Directory could not be read
+    @retval     EXIT_WRITE_FAIL     Directory could not be written
+
+*/
+EXIT_STATUS fat32IndexFileCreate(FILE *dir, FILE **open, uint8_t openCount) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    uint32_t slot = DIR_NO_SLOT;
+    uint8_t freeEntry = FREE_ENTRY;
+    char name[NAME_BUF_LEN];
+    uint16_t freeMap;
+    FileEntry entry;
+    uint32_t start;
+    DIR it;
+
+    fat32IndexFileFind(dir, &freeMap);
+    for (uint8_t i = 0; i < SECTOR_SIZE / sizeof(FileEntry) && slot == DIR_NO_SLOT; i++) {
+        if (freeMap & (1 << i)) slot = i * sizeof(FileEntry);
+    }
+
+    if (slot == DIR_NO_SLOT) {
+
+        // The first file after the dot entries is copied to new entries, then its old ones are removed
+        fat32DirStart(dir, &it);
+        do {
+            if (fat32DirRead(&it, &entry, &start, name) != EXIT_SUCCESS) return EXIT_FAIL;
+        } while (entry.ShortEntry.DIR_Name[0] == '.');
+
+        if (start >= SECTOR_SIZE) return EXIT_FAIL;
+
+        uint32_t len = it.offset - start;
+        uint32_t dest = fat32DirTakeSlots(dir, len / sizeof(FileEntry));
+        if (dest == DIR_NO_SLOT) return EXIT_FAIL;
+
+        for (uint32_t off = 0; off < len; off += sizeof(FileEntry)) {
+            if (sizeof(FileEntry) != FSReadFile((uint8_t*)&entry, start + off, sizeof(FileEntry), dir)) return EXIT_READ_FAIL;
+            if (sizeof(FileEntry) != FSWriteFile((uint8_t*)&entry, dest + off, sizeof(FileEntry), dir)) return EXIT_WRITE_FAIL;
+        }
+        for (uint32_t off = 0; off < len; off += sizeof(FileEntry)) {
+            if (1 != FSWriteFile(&freeEntry, start + off, 1, dir)) return EXIT_WRITE_FAIL;
+        }
+
+        for (uint8_t i = 0; i < openCount; i++) {
+            if (open[i]->dirCluster == cluster && open[i]->dirOffset == it.offset - sizeof(FileEntry)) {
+                open[i]->dirOffset = dest + len - sizeof(FileEntry);
+            }
+        }
+
+        slot = start;
+    }
+
+    memset(&entry, 0, sizeof(FileEntry));
+    memcpy(entry.ShortEntry.DIR_Name, INDEX_FILE_NAME, 11);
+    entry.ShortEntry.DIR_Attr = INDEX_FILE_ATTR;
+    entry.ShortEntry.DIR_CrtDate = 0b000000000100001; // 1/1/1980
+    entry.ShortEntry.DIR_LstAccDate = 0b000000000100001;
+    entry.ShortEntry.Dir_WrtDate = 0b000000000100001;
+
+    if (sizeof(FileEntry) != FSWriteFile((uint8_t*)&entry, slot, sizeof(FileEntry), dir)) return EXIT_WRITE_FAIL;
+
+    fat32DirForget(cluster);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Open a file in a directory, using the remembered result of an earlier lookup
+    if there is one and its entry still holds the file. The result is remembered,
+    even if the file was not found.
+
+    @param      IN  name            Name of the file
+    @param      IN  dir             Directory to search
+    @param      OUT file            File which was found
+
+    @retval     EXIT_SUCCESS        File was found
+    @retval     EXIT_NOT_FOUND      File is not in the directory
+    @retval     others              Search failed
+*/
+EXIT_STATUS fat32Lookup(char *name, FILE *dir, FILE *file) {
+
+    uint32_t parent = fat32GetFirstCluster(dir);
+    Dentry *dentry = fat32DentryFind(parent, name);
+
+    if (dentry != NULL) {
+
+        if (dentry->offset == DENTRY_NEGATIVE) return EXIT_NOT_FOUND;
+
+        if (fat32DentryCheck(dir, dentry->offset, name, &file->file)) {
+            file->len = strlen(name);
+            file->dir = dir;
+            file->dirCluster = parent;
+            file->dirOffset = dentry->offset;
+            file->allocLen = 0;
+            fat32ResetCache(file);
+            return EXIT_SUCCESS;
+        }
+
+        dentry->parent = 0;
+    }
+
+    EXIT_STATUS status = FSDirectorySearch(name, dir, file);
+
+    if (status == EXIT_SUCCESS) fat32DentryStore(parent, name, file->dirOffset);
+    else if (status == EXIT_NOT_FOUND) fat32DentryStore(parent, name, DENTRY_NEGATIVE);
+
+    return status;
+}
+
+
+/*
+    Write data to a sector through the memory table and straight to the device, then
+    wait until the device has stored it. Sectors written back later by the memory
+    table can then not reach the device before it.
+
+    @param      data            Data to write
+    @param      sector          Device sector to write to
+    @param      offset          Byte offset in the sector
+    @param      len             Amount of bytes to write, not past the end of the sector
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+    @retval     EXIT_WRITE_FAIL         Device write failed
+    @retval     EXIT_HARDWARE_FAIL      Device did not store the write
+
+*/
+EXIT_STATUS fat32WriteThrough(uint8_t *data, uint32_t sector, uint32_t offset, uint32_t len) {
+
+    if (len != MT_DeviceWrite(data, sector, offset, len)) return EXIT_MEMORY_TABLE_FAIL;
+    if (len != write_block(data, sector, offset, len)) return EXIT_WRITE_FAIL;
+    if (0 != write_flush()) return EXIT_HARDWARE_FAIL;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Set or clear the dirty state of the volume. The clean shutdown bit of FAT[1]
+    is cleared on the first write after a mount, and set again on eject. The FAT
+    entry is only written if the state changes, and is written through to the
+    device, so the volume is marked dirty on the device before anything else
+    changed reaches it.
+
+    @param      dirty           TRUE to mark the volume dirty, FALSE to mark it clean
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table or device write failed
+
+*/
+EXIT_STATUS fat32SetDirty(bool dirty) {
+
+    uint32_t entry;
+    uint32_t sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt;
+
+    if (dirty == ((flg & FS_DIRTY) != 0)) return EXIT_SUCCESS;
+
+    if (sizeof(uint32_t) != MT_DeviceRead((uint8_t*)&entry, sector, 4, sizeof(uint32_t))) {
+        return EXIT_READ_FAIL;
+    }
+
+    if (dirty) entry &= ~FAT_CLEAN_SHUTDOWN;
+    else entry |= FAT_CLEAN_SHUTDOWN;
+
+    for (uint8_t FATTable = 0; FATTable < BS->BPB_NumFATs; FATTable++) {
+        if (EXIT_SUCCESS != fat32WriteThrough((uint8_t*)&entry, sector + FATTable*BS->BPB_FATSz32, 4, sizeof(uint32_t))) {
+            return EXIT_MEMORY_TABLE_FAIL;
+        }
+    }
+
+    if (dirty) flg |= FS_DIRTY;
+    else flg &= ~FS_DIRTY;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Write the free cluster count and next free cluster hint to the FSInfo sector.
+    The sector is only written if they have changed.
+
+    @retval    EXIT_SUCCUSS             Succussful
+    @retval    EXIT_READ_FAIL           FSInfo sector could not be read
+    @retval    EXIT_WRITE_FAIL          FSInfo sector could not be written
+
+*/
+EXIT_STATUS fat32WriteFSInfo() {
+
+    Block buf;
+    uint32_t sector = BS->BPB_HiddSec + BS->BPB_FSInfo;
+
+    if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, sector, 0, SECTOR_SIZE)) return EXIT_READ_FAIL;
+
+    if (buf.File.FSI_LeadSig == FSI_LEAD_SIG && buf.File.FSI_StrucSig == FSI_STR_SIG &&
+        buf.File.FSI_TrailSig == FSI_TRAIL_SIG && buf.File.FSI_Free_Count == BS->FSI_Free_Count &&
+        buf.File.FSI_Nxt_Free == BS->FSI_Nxt_Free) return EXIT_SUCCESS;
+
+    buf.File.FSI_LeadSig = FSI_LEAD_SIG;
+    buf.File.FSI_StrucSig = FSI_STR_SIG;
+    buf.File.FSI_TrailSig = FSI_TRAIL_SIG;
+    buf.File.FSI_Free_Count = BS->FSI_Free_Count;
+    buf.File.FSI_Nxt_Free = BS->FSI_Nxt_Free;
+
+    if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, sector, 0, SECTOR_SIZE)) return EXIT_WRITE_FAIL;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Find the first free entry in a sector of the FAT. Entries are checked four
+    at a time, and groups where every entry is in use are skipped.
+
+    @param      buf             FAT sector contents
+    @param      from            First entry to check
+    @param      to              Entry to stop at (not checked)
+
+    @retval     < to            Index of the first free entry
+    @retval     to              No free entry was found
+
+*/
+uint16_t fat32FindFreeEntry(Block *buf, uint16_t from, uint16_t to) {
+
+    uint16_t i = from;
+
+    for (; i + 4 <= to; i += 4) {
+        if ((buf->FAT[i] & FAT_MASK) && (buf->FAT[i+1] & FAT_MASK) &&
+            (buf->FAT[i+2] & FAT_MASK) && (buf->FAT[i+3] & FAT_MASK)) continue;
+        break;
+    }
+
+    for (; i < to; i++) {
+        if ((buf->FAT[i] & FAT_MASK) == FAT_FREE) return i;
+    }
+
+    return to;
+}
+
+
+/*
+    Count the free entries in a sector of the FAT. Entries are counted four at a time.
+
+    @param      buf             FAT sector contents
+    @param      from            First entry to count
+    @param      to              Entry to stop at (not counted)
+
+    @return     Amount of free entries
+
+*/
+uint16_t fat32CountFreeEntries(Block *buf, uint16_t from, uint16_t to) {
+
+    uint16_t count = 0;
+    uint16_t i = from;
+
+    for (; i + 4 <= to; i += 4) {
+        count += ((buf->FAT[i] & FAT_MASK) == FAT_FREE) + ((buf->FAT[i+1] & FAT_MASK) == FAT_FREE) +
+                 ((buf->FAT[i+2] & FAT_MASK) == FAT_FREE) + ((buf->FAT[i+3] & FAT_MASK) == FAT_FREE);
+    }
+
+    for (; i < to; i++) count += (buf->FAT[i] & FAT_MASK) == FAT_FREE;
+
+    return count;
+}
+
+
+/*
+    Build the free cluster map from the FAT, and optionally verify the free cluster
+    count. If counting, the whole FAT is read a sector at a time and FSI_Free_Count
+    is corrected if it does not match the amount of free clusters found, and full
+    FAT sectors past the map are marked in the map of full FAT sectors. Otherwise
+    only the FAT sectors covered by the map are read. Called when a partition is mounted.
+
+    @param      count           TRUE to count every free cluster in the FAT
+
+    @retval    EXIT_SUCCUSS     Succussful
+    @retval    EXIT_READ_FAIL   FAT could not be read
+
+*/
+EXIT_STATUS fat32BuildFreeMap(bool count) {
+
+    Block buf;
+    uint32_t fatStart = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt;
+    uint32_t end = BS->PAR_Max_Cluster;
+    uint32_t freeCount = 0;
+
+    // Clusters past the end of the partition are never free
+    for (uint16_t i = 0; i < FREE_MAP_BYTES/4; i++) FreeMap[i] = 0xFFFFFFFF;
+    for (uint16_t i = 0; i < FULL_MAP_BYTES/4; i++) FullMap[i] = 0;
+
+    // Read the FAT a sector at a time. Free clusters within the map have their bit cleared
+    for (uint32_t cluster = 0; cluster < end; cluster += SECTOR_SIZE/4) {
+
+        uint16_t to = end - cluster < SECTOR_SIZE/4 ? end - cluster : SECTOR_SIZE/4;
+        uint16_t from = cluster == 0 ? 2 : 0;   // Clusters 0 and 1 are reserved
+
+        if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, fatStart + cluster/(SECTOR_SIZE/4), 0, SECTOR_SIZE)) {
+            return EXIT_READ_FAIL;
+        }
+
+        if (cluster >= FREE_MAP_CLUSTERS) {
+
+            if (!count) break;
+
+            uint16_t found = fat32CountFreeEntries(&buf, from, to);
+            uint32_t bit = fat32FullMapBit(cluster);
+
+            if (found == 0 && bit < FULL_MAP_SECTORS) FullMap[bit / 32] |= 1UL << (bit % 32);
+            freeCount += found;
+            continue;
+        }
+
+        for (uint16_t i = fat32FindFreeEntry(&buf, from, to); i < to; i = fat32FindFreeEntry(&buf, i + 1, to)) {
+            FreeMap[(cluster + i) / 32] &= ~(1UL << ((cluster + i) % 32));
+            freeCount++;
+        }
+    }
+
+    // Clusters 0 and 1 are reserved
+    FreeMap[0] |= 0x3;
+
+    // The free count on disk is only a hint, correct it if it is wrong
+    if (count && BS->FSI_Free_Count != freeCount) BS->FSI_Free_Count = freeCount;
+    if (BS->FSI_Nxt_Free < 2 || BS->FSI_Nxt_Free >= end) BS->FSI_Nxt_Free = 2;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Get the bit of a cluster's FAT sector in the map of full FAT sectors.
+
+    @param      cluster         Cluster past the free cluster map
+
+    @retval     < FULL_MAP_SECTORS  Bit of the cluster's FAT sector
+    @retval     FULL_MAP_SECTORS    The cluster's FAT sector is not in the map
+
+*/
+uint32_t fat32FullMapBit(uint32_t cluster) {
+
+    if (cluster < FREE_MAP_CLUSTERS) return FULL_MAP_SECTORS;
+
+    uint32_t bit = (cluster - FREE_MAP_CLUSTERS) / (SECTOR_SIZE/4);
+
+    return bit < FULL_MAP_SECTORS ? bit : FULL_MAP_SECTORS;
+}
+
+
+/*
+    Update the free cluster map for a cluster given its new FAT table entry.
+    For clusters past the map, a freed cluster clears its FAT sector's bit in the
+    map of full FAT sectors.
+
+    @param      cluster         Cluster which had its FAT entry updated
+    @param      status          New FAT table entry
+
+*/
+void fat32FreeMapSet(uint32_t cluster, uint32_t status) {
+
+    if (cluster >= FREE_MAP_CLUSTERS) {
+        uint32_t bit = fat32FullMapBit(cluster);
+        if (bit < FULL_MAP_SECTORS && (status & FAT_MASK) == FAT_FREE) FullMap[bit / 32] &= ~(1UL << (bit % 32));
+        return;
+    }
+
+    if ((status & FAT_MASK) == FAT_FREE) FreeMap[cluster / 32] &= ~(1UL << (cluster % 32));
+    else FreeMap[cluster / 32] |= 1UL << (cluster % 32);
+}
+
+
+/*
+    Find a free cluster, starting the search at a given cluster and wrapping
+    around to cluster 2. The free cluster map is searched a word at a time, and
+    clusters beyond the map are searched in the FAT, skipping the FAT sectors known
+    to be full. A FAT sector found to be full is marked as such.
+
+    @param      start           Cluster to start searching at
+
+    @retval     > 0             Free cluster number
+    @retval     0               No free cluster
+
+*/
+uint32_t fat32FindFreeCluster(uint32_t start) {
+
+    uint32_t end = BS->PAR_Max_Cluster;
+    uint32_t mapEnd = end < FREE_MAP_CLUSTERS ? end : FREE_MAP_CLUSTERS;
+
+    if (start < 2 || start >= end) start = 2;
+
+    // Two passes, from start to the end of the partition and then from cluster 2 to start
+    for (uint8_t pass = 0; pass < 2; pass++) {
+
+        uint32_t from = pass ? 2 : start;
+        uint32_t to = pass ? start : end;
+        uint32_t cluster = from;
+
+        // Search the map a word at a time. Full words are skipped without looking at each bit
+        while (cluster < to && cluster < mapEnd) {
+
+            uint32_t word = FreeMap[cluster / 32] | ((1UL << (cluster % 32)) - 1);
+
+            if (word != 0xFFFFFFFF) {
+#ifdef __GNUC__
+                uint32_t found = (cluster & ~31UL) + __builtin_ctzl(~word);
+#else
+                uint32_t found = cluster & ~31UL;
+                while (word & 1) {word >>= 1; found++;}
+#endif
+                if (found < to && found < mapEnd) return found;
+            }
+
+            cluster = (cluster & ~31UL) + 32;
+        }
+
+        // Clusters beyond the map are searched in the FAT a sector at a time
+        while (cluster < to) {
+
+            Block buf;
+            uint32_t base = cluster - cluster % (SECTOR_SIZE/4);
+            uint16_t last = to - base < SECTOR_SIZE/4 ? to - base : SECTOR_SIZE/4;
+            uint16_t valid = end - base < SECTOR_SIZE/4 ? end - base : SECTOR_SIZE/4;
+            uint32_t bit = fat32FullMapBit(base);
+
+            if (bit < FULL_MAP_SECTORS && (FullMap[bit / 32] & (1UL << (bit % 32)))) {
+                cluster = base + last;
+                continue;
+            }
+
+            if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + base/(SECTOR_SIZE/4), 0, SECTOR_SIZE)) {
+                return 0;
+            }
+
+            uint16_t i = fat32FindFreeEntry(&buf, cluster - base, last);
+            if (i < last) return base + i;
+
+            if (bit < FULL_MAP_SECTORS && fat32FindFreeEntry(&buf, 0, valid) == valid) FullMap[bit / 32] |= 1UL << (bit % 32);
+
+            cluster = base + last;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    Check if a cluster is free, using the free cluster map if the cluster is in it,
+    or the map of full FAT sectors if its FAT sector is known to be full.
+
+    @param      cluster         Cluster to check
+
+    @retval     TRUE            Cluster is free
+    @retval     FALSE           Cluster is in use or invalid
+
+*/
+bool fat32IsFreeCluster(uint32_t cluster) {
+
+    if (cluster < 2 || cluster >= BS->PAR_Max_Cluster) return FALSE;
+
+    if (cluster < FREE_MAP_CLUSTERS) return !(FreeMap[cluster / 32] & (1UL << (cluster % 32)));
+
+    uint32_t bit = fat32FullMapBit(cluster);
+    if (bit < FULL_MAP_SECTORS && (FullMap[bit / 32] & (1UL << (bit % 32)))) return FALSE;
+
+    return (FSGetFatTableEntry(cluster) & FAT_MASK) == FAT_FREE;
+}
+
+
+/*
+    Check if a cluster is in the headroom kept for a file other than owner.
+
+    @param      cluster         Cluster to check
+    @param      owner           First cluster of the file which can use its own headroom, or 0
+
+    @retval     > 0             Cluster after the end of the headroom the cluster is in
+    @retval     0               Cluster is not in another file's headroom
+
+*/
+uint32_t fat32HeadroomEnd(uint32_t cluster, uint32_t owner) {
+
+    for (uint8_t i = 0; i < ALLOC_WRITERS; i++) {
+
+        if (Headrooms[i].owner == 0 || Headrooms[i].owner == owner) continue;
+
+        if (cluster >= Headrooms[i].cluster && cluster < Headrooms[i].cluster + ALLOC_HEADROOM) {
+            return Headrooms[i].cluster + ALLOC_HEADROOM;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    Keep headroom for a file after the end of its chain. The file's slot is reused
+    if it has one, otherwise a free slot or the oldest slot is taken. Files are
+    known by their first cluster, so a file which is never closed holds a slot
+    only until it is the oldest.
+
+    @param      owner           First cluster of the file being written
+    @param      cluster         Cluster after the file's last cluster
+
+*/
+void fat32KeepHeadroom(uint32_t owner, uint32_t cluster) {
+
+    uint8_t slot = ALLOC_WRITERS;
+
+    for (uint8_t i = 0; i < ALLOC_WRITERS; i++) {
+        if (Headrooms[i].owner == owner) {
+            slot = i;
+            break;
+        }
+        if (Headrooms[i].owner == 0 && slot == ALLOC_WRITERS) slot = i;
+    }
+
+    if (slot == ALLOC_WRITERS) {
+        slot = HeadroomNext;
+        HeadroomNext = (HeadroomNext + 1) % ALLOC_WRITERS;
+    }
+
+    Headrooms[slot].owner = owner;
+    Headrooms[slot].cluster = cluster;
+}
+
+
+/*
+    Release the headroom kept for a file. Called when the file is closed or removed.
+
+    @param      owner           First cluster of the file to release headroom for, or 0
+
+*/
+void fat32ReleaseHeadroom(uint32_t owner) {
+
+    if (owner == 0) return;
+
+    for (uint8_t i = 0; i < ALLOC_WRITERS; i++) {
+        if (Headrooms[i].owner == owner) Headrooms[i].owner = 0;
+    }
+}
+
+
+/*
+    Find where to start looking for the first clusters of a file. Files are placed
+    in the allocation group of their parent directory, near the directory itself.
+    New directories are placed in the group after their parent's group, so the
+    files of different directories are kept apart.
+
+    @param      file            File (or directory) without clusters. Its dir must be set
+
+    @return     Cluster to start searching at
+
+*/
+uint32_t fat32GroupGoal(FILE *file) {
+
+    if (file == NULL || file->dir == NULL) return BS->FSI_Nxt_Free;
+
+    uint32_t goal = fat32GetFirstCluster(file->dir);
+    if (goal < 2 || goal >= BS->PAR_Max_Cluster) return BS->FSI_Nxt_Free;
+
+    if (file->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) {
+        goal = (goal / ALLOC_GROUP_CLUSTERS + 1) * ALLOC_GROUP_CLUSTERS;
+        if (goal >= BS->PAR_Max_Cluster) goal = 2;
+    }
+
+    return goal;
+}
+
+
+/*
+    Find a run of free clusters. The first run of count clusters at or after start
+    is used (wrapping around to cluster 2). If there is no run that long, the
+    longest run found is used, once the whole volume or ALLOC_SEARCH_RUNS runs
+    have been looked at. Headroom kept for files other than owner can be skipped.
+
+    @param      IN  start           Cluster to start searching at
+    @param      IN  count           Amount of clusters wanted
+    @param      OUT first           First cluster of the run found
+    @param      IN  owner           First cluster of the file the run is for, or 0
+    @param      IN  keepHeadroom    TRUE to skip headroom kept for other files
+
+    @retval     > 0                 Length of the run found, at most count
+    @retval     0                   No free cluster
+
+*/
+uint32_t fat32FindFreeRun(uint32_t start, uint32_t count, uint32_t *first, uint32_t owner, bool keepHeadroom) {
+
+    uint32_t best = 0;
+    uint32_t cluster = fat32FindFreeCluster(start);
+    uint32_t firstFound = cluster;
+    uint16_t runs = 0;
+    bool wrapped = FALSE;
+
+    while (cluster != 0) {
+
+        uint32_t end = keepHeadroom ? fat32HeadroomEnd(cluster, owner) : 0;
+
+        // Measure the run of free clusters starting here, unless it is another file's headroom
+        if (end == 0) {
+
+            uint32_t len = 1;
+            while (len < count && fat32IsFreeCluster(cluster + len) &&
+                  (!keepHeadroom || fat32HeadroomEnd(cluster + len, owner) == 0)) len++;
+
+            if (len > best) {
+                best = len;
+                *first = cluster;
+                if (len == count) break;
+            }
+
+            // Settle for the longest run so far rather than looking at the whole volume
+            if (++runs == ALLOC_SEARCH_RUNS) break;
+
+            end = cluster + len;
+        }
+
+        // Move on to the next run, stopping once the search is back where it started
+        uint32_t next = fat32FindFreeCluster(end);
+        if (next < end) wrapped = TRUE;
+        if (next == 0 || (wrapped && next >= firstFound)) break;
+        cluster = next;
+    }
+
+    return best;
+}
+
+
+/*
+    Get the amount of FAT tables which are written on each FAT change, and record
+    the changed FAT sector if only the first FAT is written.
+
+    @param      index               Sector within the FAT being changed
+
+    @return     Amount of FAT tables to write, starting at the first
+
+*/
+uint8_t fat32FatCopies(uint32_t index) {
+
+    if (!(flg & FS_SINGLE_FAT)) return BS->BPB_NumFATs;
+
+    if (index < FatChangedFirst) FatChangedFirst = index;
+    if (index > FatChangedLast) FatChangedLast = index;
+
+    return 1;
+}
+
+
+/*
+    Copy a range of sectors of the active FAT to the other FAT tables, a sector at
+    a time through one sector buffer. The range of each copy is hinted as one run,
+    so the device can prepare all of it. A device which ends a run of writes when
+    it is read from writes the rest of the run a sector at a time.
+
+    @param      first               First sector within the FAT to copy
+    @param      last                Last sector within the FAT to copy
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          Active FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32SyncFatCopies(uint32_t first, uint32_t last) {
+
+    Block buf;
+    uint32_t fatStart = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt;
+    uint8_t active = (BS->BPB_ExtFlags & FAT_NO_MIRROR) ? BS->BPB_ExtFlags & FAT_ACTIVE_MASK : 0;
+
+    if (last >= BS->BPB_FATSz32) last = BS->BPB_FATSz32 - 1;
+    if (first > last) return EXIT_SUCCESS;
+
+    for (uint8_t FATTable = 0; FATTable < BS->BPB_NumFATs; FATTable++) {
+
+        if (FATTable == active) continue;
+
+        write_hint(fatStart + FATTable*BS->BPB_FATSz32 + first, last - first + 1);
+
+        for (uint32_t index = first; index <= last; index++) {
+
+            if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, fatStart + active*BS->BPB_FATSz32 + index, 0, SECTOR_SIZE)) {
+                return EXIT_READ_FAIL;
+            }
+            if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, fatStart + FATTable*BS->BPB_FATSz32 + index, 0, SECTOR_SIZE)) {
+                return EXIT_MEMORY_TABLE_FAIL;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Bring the FAT copies up to date with the FAT sectors changed while mirroring is
+    disabled. Does nothing if mirroring is enabled.
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          Active FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32FlushFatCopies() {
+
+    if (!(flg & FS_SINGLE_FAT) || FatChangedFirst > FatChangedLast) return EXIT_SUCCESS;
+
+    EXIT_STATUS status = fat32SyncFatCopies(FatChangedFirst, FatChangedLast);
+    if (status != EXIT_SUCCESS) return status;
+
+    FatChangedFirst = 0xFFFFFFFF;
+    FatChangedLast = 0;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Write a sector of the FAT to every FAT table (or only the first, if mirroring
+    is disabled).
+
+    @param      index               Sector number within the FAT
+    @param      buf                 Sector contents
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32WriteFatSector(uint32_t index, Block *buf) {
+
+    if (EXIT_SUCCESS != fat32SetDirty(TRUE)) return EXIT_MEMORY_TABLE_FAIL;
+
+    uint8_t copies = fat32FatCopies(index);
+
+    for (uint8_t FATTable = 0; FATTable < copies; FATTable++) {
+
+        uint32_t sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + index + FATTable*BS->BPB_FATSz32;
+
+        if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)buf, sector, 0, SECTOR_SIZE)) {
+            return EXIT_MEMORY_TABLE_FAIL;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Link a run of contiguous clusters into a chain, each cluster pointing to the
+    next and the last pointing to tail. Each FAT sector touched is read and written
+    once instead of once per entry.
+
+    @param      first               First cluster of the run
+    @param      count               Amount of clusters in the run
+    @param      tail                FAT entry for the last cluster (FAT_EOC or the next cluster)
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32LinkRun(uint32_t first, uint32_t count, uint32_t tail) {
+
+    Block buf;
+    uint32_t cluster = first;
+    uint32_t end = first + count;
+
+    if (first < 2 || end > BS->PAR_Max_Cluster) return EXIT_INVALID_PARAMETER;
+
+    while (cluster < end) {
+
+        uint32_t index = cluster / (SECTOR_SIZE/4);
+
+        if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + index, 0, SECTOR_SIZE)) {
+            return EXIT_READ_FAIL;
+        }
+
+        // Fill in every entry of the run within this sector. The upper four bits are kept
+        for (; cluster < end && cluster / (SECTOR_SIZE/4) == index; cluster++) {
+
+            uint32_t next = (cluster + 1 == end) ? tail : cluster + 1;
+            uint16_t i = cluster % (SECTOR_SIZE/4);
+
+            buf.FAT[i] = (buf.FAT[i] & ~FAT_MASK) | (next & FAT_MASK);
+            fat32FreeMapSet(cluster, next);
+        }
+
+        EXIT_STATUS status = fat32WriteFatSector(index, &buf);
+        if (status != EXIT_SUCCESS) return status;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Free a cluster chain. The chain is walked and its entries are grouped by FAT
+    sector, so each FAT sector is read once and rewritten once per FAT table for
+    each stretch of the chain within it, instead of once per cluster. The free
+    count and free cluster map are updated with the clusters freed.
+
+    @param      cluster         First cluster of the chain
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
+    @retval     EXIT_READ_FAIL          FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32FreeChain(uint32_t cluster) {
+
+    Block buf;
+    uint32_t freed = 0;
+    EXIT_STATUS status = EXIT_SUCCESS;
+
+    if (cluster < 2 || cluster >= BS->PAR_Max_Cluster) return EXIT_INVALID_PARAMETER;
+
+    while (cluster >= 2 && cluster < BS->PAR_Max_Cluster) {
+
+        uint32_t index = cluster / (SECTOR_SIZE/4);
+
+        if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + index, 0, SECTOR_SIZE)) {
+            status = EXIT_READ_FAIL;
+            break;
+        }
+
+        // Free every cluster of the chain while it stays within this sector. The upper four bits are kept
+        while (cluster / (SECTOR_SIZE/4) == index) {
+
+            uint16_t i = cluster % (SECTOR_SIZE/4);
+            uint32_t next = buf.FAT[i] & FAT_MASK;
+
+            // A free entry means the chain is broken, stop here
+            if (next == FAT_FREE) {
+                cluster = 0;
+                break;
+            }
+
+            buf.FAT[i] &= ~FAT_MASK;
+            fat32FreeMapSet(cluster, FAT_FREE);
+            freed++;
+
+            cluster = next;
+            if (cluster < 2 || cluster >= BS->PAR_Max_Cluster) break;
+        }
+
+        status = fat32WriteFatSector(index, &buf);
+        if (status != EXIT_SUCCESS) break;
+    }
+
+    BS->FSI_Free_Count += freed;
+
+    return status;
+}
+
+
+/*
+    Move a cluster of a file to a free cluster. The data is copied, the new cluster
+    takes the old cluster's place in the chain and the old cluster is freed. The
+    chain is valid after each step, so a move can be interrupted safely.
+
+    @param      file            File the cluster belongs to
+    @param      prev            Cluster before cluster in the chain, 0 if it is the first cluster
+    @param      cluster         Cluster to move
+    @param      to              Free cluster to move it to
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
+    @retval     EXIT_READ_FAIL          Cluster could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+    @retval     EXIT_WRITE_FAIL         Directory entry could not be written
+
+*/
+EXIT_STATUS fat32MoveCluster(FILE *file, uint32_t prev, uint32_t cluster, uint32_t to) {
+
+    Block buf;
+    uint32_t from = FSGetSector(cluster);
+    uint32_t dest = FSGetSector(to);
+    EXIT_STATUS status;
+
+    if (from == 0 || dest == 0 || !fat32IsFreeCluster(to)) return EXIT_INVALID_PARAMETER;
+
+    // Copy the data to the new cluster
+    write_hint(dest, BS->BPB_SecPerClus);
+
+    for (uint8_t i = 0; i < BS->BPB_SecPerClus; i++) {
+        if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, from + i, 0, SECTOR_SIZE)) return EXIT_READ_FAIL;
+        if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, dest + i, 0, SECTOR_SIZE)) return EXIT_MEMORY_TABLE_FAIL;
+    }
+
+    // The new cluster points to the rest of the chain before anything points to it
+    status = FSFatTableUpdate(to, FSGetFatTableEntry(cluster));
+    if (status != EXIT_SUCCESS) return status;
+
+    if (prev == 0) {
+        file->file.ShortEntry.DIR_FstClusHI = to >> 16;
+        file->file.ShortEntry.DIR_FstClusLO = to & 0xFFFF;
+        status = fat32FileToDisk(file);
+    } else {
+        status = FSFatTableUpdate(prev, to);
+    }
+    if (status != EXIT_SUCCESS) return status;
+
+    return FSFatTableUpdate(cluster, FAT_FREE);
+}
+
+
+/*
+    Get the first cluster of the directory that a file is in.
+
+    @param      file            File to write back to disk
+
+    @retval    EXIT_SUCCUSS     Succussful
+    @retval    EXIT_WRITE_FAIL  Disk write failed.
+
+*/
+uint32_t fat32GetDirCluster(FILE *file) {
+
+    return (file->dir->file.ShortEntry.DIR_FstClusHI << 16) + file->dir->file.ShortEntry.DIR_FstClusLO;
+}
+
+
+/*
+    Get the first cluster of a file.
+
+    @param      file            File to get the first cluster of
+
+    @retval     > 0             First cluster
+    @retval     0               File has no clusters allocated
+
+*/
+uint32_t fat32GetFirstCluster(FILE *file) {
+
+    return ((uint32_t)file->file.ShortEntry.DIR_FstClusHI << 16) + file->file.ShortEntry.DIR_FstClusLO;
+}
+
+
+/*
+    Get the cluster after a given cluster in a file's chain. The file's extent cache
+    is used if it has the cluster, and is filled in when the FAT is read. If the chain
+    ends and count is not 0, an extent of up to count clusters is allocated and linked
+    to the end of the chain.
+
+    @param      IN  file            File the chain belongs to
+    @param      IN  index           Cluster index within the file of cluster
+    @param      IN  cluster         Current cluster in the chain
+    @param      IN  count           Clusters to allocate if the chain ends
+    @param      OUT allocated       Amount of clusters allocated, 0 if none were
+
+    @retval     > 0                 Next cluster
+    @retval     0                   End of chain or fail
+
+*/
+uint32_t fat32NextCluster(FILE *file, uint32_t index, uint32_t cluster, uint32_t count, uint32_t *allocated) {
+
+    *allocated = 0;
+
+    uint32_t next = fat32CachedCluster(file, index + 1);
+    if (next != 0) return next;
+
+    // The FAT does not have to be read for the known last cluster
+    if (file->lastCluster != 0 && file->lastIndex == index && file->lastCluster == cluster) next = FAT_EOC;
+    else next = FSGetFatTableEntry(cluster) & FAT_MASK;
+
+    if (next >= FAT_EOC) {
+
+        file->lastIndex = index;
+        file->lastCluster = cluster;
+
+        if (count == 0) return 0;
+        next = FSAllocateExtent(file, cluster, count, allocated);
+        if (next == 0) return 0;
+
+        file->lastIndex = index + *allocated;
+        file->lastCluster = next + *allocated - 1;
+
+    } else if (next < 2 || next == FAT_DEFECTIVE) {
+        return 0;
+    }
+
+    fat32CacheCluster(file, index + 1, next);
+    file->cursorIndex = index + 1;
+    file->cursorCluster = next;
+
+    return next;
+}
+
+
+/*
+    Clear the cached cluster positions of a file (extents, cursor and last cluster).
+    Called when a file is opened or its chain is replaced.
+
+    @param      file            File to clear
+
+*/
+void fat32ResetCache(FILE *file) {
+
+    file->extentCount = 0;
+    file->cursorIndex = 0;
+    file->cursorCluster = 0;
+    file->lastIndex = 0;
+    file->lastCluster = 0;
+}
+
+
+/*
+    Look up a cluster of a file in its extent cache with a binary search. The
+    cache is cleared if it does not match the file's first cluster.
+
+    @param      file            File to look up
+    @param      index           Cluster index within the file
+
+    @retval     > 0             Cluster number
+    @retval     0               Cluster is not in the cache
+
+*/
+uint32_t fat32CachedCluster(FILE *file, uint32_t index) {
+
+    if (file->extentCount > FILE_EXTENTS ||
+        (file->extentCount && file->extents[0].cluster != fat32GetFirstCluster(file))) {
+        fat32ResetCache(file);
+    }
+
+    uint8_t low = 0;
+    uint8_t high = file->extentCount;
+
+    while (low < high) {
+
+        uint8_t mid = (low + high) / 2;
+        Extent *extent = &file->extents[mid];
+
+        if (index < extent->index) high = mid;
+        else if (index >= extent->index + extent->len) low = mid + 1;
+        else return extent->cluster + (index - extent->index);
+
+    }
 
-            // Search within a sector
-            for (uint16_t off = 0; off < SECTOR_SIZE; off += sizeof(FileEntry)) {
+    return 0;
+}
 
-                // Read the file entry
-                if (0 != MT_DeviceRead((char*)&(File.file), sector, off, sizeof(FileEntry))) {
-                    return EXIT_MEMORY_TABLE_FAIL;
-                }
 
-                // If LDEntry is 0, the file has been found. Return the File entry
-                // in the corresponding short entry
-                if (LDEntry == 0) {
-
-                    if (new != NULL) {
-                        memcpy(&(new->file), &File, sizeof(FileEntry));
-                        new->len = len;
-                        new->dir = directory;
-                        new->dirCluster = directory->file.ShortEntry.DIR_FstClusHI << 16 +
-                        directory->file.ShortEntry.DIR_FstClusLO;
-                        new->dirOffset = byteOffset; 
-                    }
-                    
-                    return EXIT_SUCCESS;
-                }
+/*
+    Add a cluster of a file to its extent cache. Only the cluster right after the
+    cached part of the chain is added. It extends the last extent if it is
+    contiguous, or starts a new extent if there is room.
 
-                // If attr is 0, then no need to search anymore, file is not present
-                if (File.file.LongEntry.LDIR_Ord == 0) return EXIT_NOT_FOUND;
-
-                // Short name checks if possible - if it matches the short name, then this is 
-                // a short entry and this can be used
-                if (MaxLDEntry == LAST_LONG_ENTRY + 1) {
-                    if (fat32IsValidShortEntry(name, len, &File)) {
-                        LDEntry = 0;
-                        byteOffset += 32;
-                        continue;
-                    }
-                }
+    @param      file            File the cluster belongs to
+    @param      index           Cluster index within the file
+    @param      cluster         Cluster number
 
-                // If attr is not as expected, then we are going down the wrong path
-                // Reset to look for beggining LDR entry and continue search
-                if (File.file.LongEntry.LDIR_Ord != LDEntry) {
-                    LDEntry = MaxLDEntry;
-                    byteOffset += 32;
-                    continue;
-                }
+*/
+void fat32CacheCluster(FILE *file, uint32_t index, uint32_t cluster) {
 
-                // If attr matches, see if this could be the valid file. If not, then reset
-                // the LDEntry to look for beggining again and continue
-                if (!fat32IsValidLongEntry(name, len, &File)) {
-                    LDEntry = MaxLDEntry;
-                    byteOffset += 32;
-                    continue; 
-                }
+    if (file->extentCount == 0) {
+
+        if (index != 0) return;
+
+        file->extents[0].index = 0;
+        file->extents[0].cluster = cluster;
+        file->extents[0].len = 1;
+        file->extentCount = 1;
+        return;
+    }
+
+    Extent *last = &file->extents[file->extentCount - 1];
+
+    if (index != last->index + last->len) return;
+
+    if (cluster == last->cluster + last->len) {
+        last->len++;
+        return;
+    }
+
+    if (file->extentCount == FILE_EXTENTS) return;
+
+    last++;
+    last->index = index;
+    last->cluster = cluster;
+    last->len = 1;
+    file->extentCount++;
+}
+
+
+/*
+    Get the cluster at a cluster index within a file. Cached clusters are found
+    with a binary search, otherwise the chain is walked from the end of the cache
+    or from the file's cursor, whichever is further along.
+
+    @param      file            File to look up
+    @param      index           Cluster index within the file (offset / bytes per cluster)
+
+    @retval     > 0             Cluster number
+    @retval     0               File is not that long, or the chain is invalid
+
+*/
+uint32_t fat32ClusterAt(FILE *file, uint32_t index) {
+
+    uint32_t cluster = fat32CachedCluster(file, index);
+    uint32_t allocated;
+    uint32_t i = 0;
+
+    if (cluster != 0) return cluster;
+
+    // The end of the chain may already be known
+    if (file->lastCluster != 0) {
+        if (index == file->lastIndex) return file->lastCluster;
+        if (index > file->lastIndex) return 0;
+    }
+
+    // Start walking from the last cached cluster, or the first cluster
+    if (file->extentCount == 0) {
+
+        cluster = fat32GetFirstCluster(file);
+        if (cluster == 0) return 0;
+        fat32CacheCluster(file, 0, cluster);
+
+    } else {
+
+        Extent *last = &file->extents[file->extentCount - 1];
+        i = last->index + last->len - 1;
+        cluster = last->cluster + last->len - 1;
+
+    }
+
+    // Reading a file in order leaves the cursor just before the next access
+    if (file->cursorCluster != 0 && file->cursorIndex > i && file->cursorIndex <= index) {
+        i = file->cursorIndex;
+        cluster = file->cursorCluster;
+    }
+
+    while (i < index) {
+        cluster = fat32NextCluster(file, i++, cluster, 0, &allocated);
+        if (cluster == 0) return 0;
+    }
+
+    return cluster;
+}
+
+
+/*
+    Add newly allocated clusters to the allocated length of a file, if it is known.
+
+    @param      file            File which had clusters allocated
+    @param      clusters        Amount of clusters allocated
+
+*/
+void fat32AddAllocated(FILE *file, uint32_t clusters) {
+
+    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+
+    if (file->allocLen == 0 || clusters == 0) return;
+
+    if (clusters > (MAX_FILE_SIZE - file->allocLen) / bytesPerCluster) file->allocLen = MAX_FILE_SIZE;
+    else file->allocLen += clusters * bytesPerCluster;
+}
+
+///////////////////  FILE SYSTEM FUNCTIONS //////////////////////////////
+
+
+
+/*
+    Allocate a new cluster to the end of a file. The search starts after from, so
+    a growing directory stays together.
+
+    @param      from                File End Of Cluster file, or zero, if there is not a cluster allocated
+    for a file.
+
+    @retval    > 0                      New Cluster Number
+    @retval    0                        Fail   
+
+*/
+uint32_t FSAllocateCluster(uint32_t from) {
+
+    uint32_t allocated;
+
+    return FSAllocateExtent(NULL, from, 1, &allocated);
+}
+
+
+/*
+    Allocate a contiguous extent of clusters to the end of a file. The extent is
+    linked into a chain in one pass over the FAT. If there is no run of free clusters
+    long enough, a shorter extent is allocated.
+    The search starts after from, or in the allocation group of the file's directory
+    if the file has no clusters. Headroom kept for other files being written is only
+    used if there is no other free cluster, and headroom is kept after the extent.
+
+    @param      IN  file                File the extent is for, or NULL
+    @param      IN  from                File End Of Cluster file, or zero, if there is not a cluster
+                                        allocated for a file.
+    @param      IN  count               Amount of clusters wanted
+    @param      OUT allocated           Amount of clusters allocated
+
+    @retval    > 0                      First cluster of the extent
+    @retval    0                        Fail
+
+*/
+uint32_t FSAllocateExtent(FILE *file, uint32_t from, uint32_t count, uint32_t *allocated) {
+
+    uint32_t first;
+    uint32_t goal = from != 0 ? from + 1 : fat32GroupGoal(file);
+    uint32_t owner = file != NULL ? fat32GetFirstCluster(file) : 0;
+
+    *allocated = 0;
+
+    // Full disk is error
+    if (BS->FSI_Free_Count == 0) return 0;
+
+    if (count == 0) count = 1;
+    if (count > BS->FSI_Free_Count) count = BS->FSI_Free_Count;
+
+    uint32_t len = fat32FindFreeRun(goal, count, &first, owner, TRUE);
+    if (len == 0) len = fat32FindFreeRun(goal, count, &first, owner, FALSE);
+    if (len == 0) return 0;
+
+    // Link the extent before attaching it to the file, so the file never points to a free cluster
+    if (fat32LinkRun(first, len, FAT_EOC) != EXIT_SUCCESS) return 0;
+    if (from != 0 && FSFatTableUpdate(from, first) != EXIT_SUCCESS) return 0;
+
+    BS->FSI_Free_Count -= len;
+    BS->FSI_Nxt_Free = first + len;
+    *allocated = len;
+
+    // The extent of a file without clusters becomes its first cluster
+    if (file != NULL) fat32KeepHeadroom(owner != 0 ? owner : first, first + len);
+
+    return first;
+}
+
+
+/*
+    Update a FAT table entry with a given status
+
+    @param      cluster     Cluster which is to have FAT value updated
+    @param      status      New FAT table entry. The first four bits will be unchanged
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS FSFatTableUpdate(uint32_t cluster, uint32_t status) {
+
+    if ((cluster & FAT_MASK) >= BS->PAR_Max_Cluster) return EXIT_INVALID_PARAMETER;
+    if (cluster < 2) return EXIT_INVALID_PARAMETER;
+    if (EXIT_SUCCESS != fat32SetDirty(TRUE)) return EXIT_MEMORY_TABLE_FAIL;
+
+    uint8_t copies = fat32FatCopies((4*cluster)/SECTOR_SIZE);
+
+    // Iterate through all FAT tables and update all of the fat tables
+    for (uint8_t FATTable = 0; FATTable < copies; FATTable++) {
+        
+        uint32_t sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + 
+        (4*cluster)/SECTOR_SIZE + FATTable*BS->BPB_FATSz32;
+
+        uint16_t offset = 4 * (cluster % (SECTOR_SIZE/4));
+
+        if (sizeof(uint32_t) != MT_DeviceWrite((char*)&status, sector , offset & FAT_MASK, sizeof(uint32_t))) {
+            return EXIT_MEMORY_TABLE_FAIL;
+        }
+    }
+
+    fat32FreeMapSet(cluster, status);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Get the first physcial sector of a cluster given the cluster
+
+    @param      cluster     Cluster which is to have FAT value updated
+    @param      status      New FAT table entry. The first four bits will be unchanged
+
+    @retval     sector number       On Success
+    @retval     0                   Fail - Not valid cluster                       
+
+*/
+uint32_t FSGetSector(uint32_t cluster) {
+
+    if (cluster > BS->PAR_Max_Cluster) return 0;
+    if (cluster < 2) return 0;
+
+    // Sector of cluster 2
+    uint32_t first_sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + 
+    BS->BPB_FATSz32 * BS->BPB_NumFATs;
+
+    return first_sector + (cluster - 2) * BS->BPB_SecPerClus;
+
+}
+
+
+/*
+    Get the cluster that a physical sector is in. It is possible to get a cluster
+    value equal to MAX_CLUSTER because of the final incomplete cluster on a partition.
+
+    @param      cluster     Cluster which is to have FAT value updated
+    @param      status      New FAT table entry. The first four bits will be unchanged
+
+    @retval     cluster number    On Success
+    @retval     0                 Fail - Sector not in partition data area                       
+
+*/
+uint32_t FSGetCluster(uint32_t sector) {
+
+
+    // Sector of cluster 2
+    uint32_t first_cluster = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + 
+    BS->BPB_FATSz32 * BS->BPB_NumFATs;
+
+    if (sector < first_cluster) return 0;
+    if (sector >= BS->MBR_Part.StartingLBA + BS->MBR_Part.SizeInLBA) return 0;
+
+    return ((sector - first_cluster) / BS->BPB_SecPerClus) + 2;
+
+}
+
+
+/*
+    Get a value in the FAT table given a cluster entry
+
+    @param      cluster     Cluster which is to have FAT value updated
+
+    @retval     0           Fail or invalid
+    @retval     > 0         Sector number in table                       
+
+*/
+uint32_t FSGetFatTableEntry(uint32_t cluster) {
+
+    if ((cluster & FAT_MASK) >= BS->PAR_Max_Cluster) return 0;
+    if ((cluster & FAT_MASK) < 2) return 0;
+
+    uint32_t sector = BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + 
+    (4*cluster)/SECTOR_SIZE;
+
+    uint16_t offset = 4 * (cluster % (SECTOR_SIZE/4));
+
+    uint32_t status;
+    if (sizeof(uint32_t) != MT_DeviceRead((char*)&status, sector, offset, sizeof(uint32_t))) {
+        return 0;
+    }
+
+    return status;
+
+}
+
+
+/*
+    Search a directory for a file name and return it if found. Names are compared
+    without case, against both the long and the short name of each file. The
+    directory's hash index is used if it can be, so only files with a matching
+    name hash are read. The hash index only holds the first files of a large
+    directory (see fat32DirIndexGet), so a name which is not among them is looked
+    for by reading the rest of the directory. FSIndexDirectory gives a large
+    directory an index file of every name, so a file in it is found by reading a
+    few sectors, even after a mount. The first name after a mount which is not in
+    the index file reads the directory once, to check another OS did not change it.
+
+    @param      IN  name            File/directory to search for
+    @param      IN  directory       Directory which is to be searched
+    @param      OUT new             File/directory to be returned
+
+    @retval     EXIT_SUCCESS            Directory succussfully found
+    @retval     EXIT_NOT_FOUND          Directory not found
+    @retval     EXIT_INVALID_PARAMETER  Device Error
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table driver failed
+*/
+EXIT_STATUS FSDirectorySearch(char *name, FILE *directory, FILE *new) {
+
+    FileEntry entry;
+    char entryName[NAME_BUF_LEN];
+    char shortName[13];
+    uint32_t start;
+    EXIT_STATUS status;
+    bool found = FALSE;
+    DIR it;
+
+    if (fat32GetFirstCluster(directory) < 2) return EXIT_INVALID_PARAMETER;
+    fat32DirStart(directory, &it);
+
+    // A directory with an index file is searched through it. A name not found is only not in the
+    // directory once it is checked that another OS did not change files the keys have
+    IndexFile *indexFile = fat32IndexFileGet(directory);
+    if (indexFile != NULL) {
+        status = fat32IndexFileSearch(indexFile, name, &it, &entry, entryName);
+        if (status == EXIT_NOT_FOUND && fat32IndexFileCheck(indexFile, directory)) return EXIT_NOT_FOUND;
+        found = status == EXIT_SUCCESS;
+    }
+
+    DirIndex *index = found ? NULL : fat32DirIndexGet(directory);
+
+    // Only the files in the index with the same name hash have to be read
+    if (index != NULL) {
 
-                // If we have gotten to here, the path is consistant with the file needed,
-                // reduce LDEntry to indicate this and continue.
-                LDEntry = (LDEntry & 0x3F) - 1;
-                byteOffset += 32;
+        uint16_t hash = fat32NameHash(name);
+        uint16_t slot = hash & (DIR_INDEX_SLOTS - 1);
 
+        for (uint16_t probes = 0; probes < DIR_INDEX_SLOTS && index->slots[slot].entry != DIR_INDEX_EMPTY; probes++) {
+
+            if (index->slots[slot].hash == hash && index->slots[slot].entry != DIR_INDEX_REMOVED) {
+
+                it.offset = (uint32_t) index->slots[slot].entry * 32;
+                if (fat32DirRead(&it, &entry, &start, entryName) == EXIT_SUCCESS) {
+                    fat32ShortName(&entry.ShortEntry, shortName);
+                    found = fat32NameMatch(name, entryName) || fat32NameMatch(name, shortName);
+                    if (found) break;
+                }
             }
 
+            slot = (slot + 1) & (DIR_INDEX_SLOTS - 1);
         }
 
-        // When the end of a cluster has been reached, then load the next.
-        cluster = FSGetFatTableEntry(cluster);
-        if (cluster == 0) return EXIT_INVALID_PARAMETER;
+        if (!found && index->complete) return EXIT_NOT_FOUND;
     }
 
-    // Will only get here if the loaded fat value indicates end of directory was reached
-    return EXIT_NOT_FOUND;
+    // Otherwise the files which are not in the index are read, and the name of the file found is read again
+    if (!found) {
+
+        it.offset = index != NULL ? index->end : 0;
+        if (fat32DirFind(&it, name, &entry, &start) != EXIT_SUCCESS) return EXIT_NOT_FOUND;
+
+        it.offset = start;
+        if (fat32DirRead(&it, &entry, &start, entryName) != EXIT_SUCCESS) return EXIT_NOT_FOUND;
+    }
+
+    if (new != NULL) {
+        memcpy(&(new->file), &entry, sizeof(FileEntry));
+        new->len = strlen(entryName);
+        new->dir = directory;
+        new->dirCluster = fat32GetFirstCluster(directory);
+        new->dirOffset = it.offset - sizeof(FileEntry);
+        new->allocLen = 0;
+        fat32ResetCache(new);
+    }
+
+    return EXIT_SUCCESS;
 }
 
 
@@ -703,18 +3695,43 @@ EXIT_STATUS FSInit(uint8_t partition, void *args) {
 
 /*
     Eject a FAT32 File System. This method should be called to ensure that all
-    sectors are written back to the device and that hardware is deinitilized
+    sectors are written back to the device and that hardware is deinitilized.
+    Every changed sector is written back and stored by the device before the
+    volume is marked clean, so a failure before then leaves it marked dirty.
 
     @param      args            Hardware eject arguments. Varies based on implementation
 
     @retval     EXIT_SUCCESS            Succuss
     @retval     EXIT_HARDWARE_FAIL      Hardware Driver Failed
     @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
+    @retval     EXIT_READ_FAIL          FSInfo sector could not be read
+    @retval     EXIT_WRITE_FAIL         FSInfo sector could not be written
     @retval     Others                  Fail    
 
 */
 EXIT_STATUS FSEject(void *args) {
 
+    if (flg & FS_ACTIVE) {
+
+        EXIT_STATUS status = fat32WriteFSInfo();
+        if (status == EXIT_SUCCESS) status = fat32FlushFatCopies();
+        if (status != EXIT_SUCCESS) return status;
+
+        if (0 != MT_TableFlush()) return EXIT_MEMORY_TABLE_FAIL;
+        if (0 != write_flush()) return EXIT_HARDWARE_FAIL;
+
+        // The FAT copies on the device match again, so mirroring is turned back on
+        if (flg & FS_SINGLE_FAT) {
+            BS->BPB_ExtFlags &= ~(FAT_NO_MIRROR | FAT_ACTIVE_MASK);
+            status = fat32WriteThrough((uint8_t*)BS, BS->MBR_Part.StartingLBA, 0, SECTOR_SIZE);
+            if (status != EXIT_SUCCESS) return status;
+            flg &= ~FS_SINGLE_FAT;
+        }
+
+        status = fat32SetDirty(FALSE);
+        if (status != EXIT_SUCCESS) return status;
+    }
+
     if (0 != MT_TableUnload()) {
         return EXIT_MEMORY_TABLE_FAIL;
     }
@@ -730,11 +3747,40 @@ EXIT_STATUS FSEject(void *args) {
 }
 
 
+/*
+    Write everything changed in memory back to the device without ejecting it. The
+    free cluster count and next free cluster hint are written to the FSInfo sector,
+    the FAT copies are updated if mirroring is disabled, then every changed sector
+    in the memory table is written back. Once the device has stored every write, any
+    write which failed after write_block returned is reported.
+
+    @retval     EXIT_SUCCESS            Succuss
+    @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
+    @retval     EXIT_READ_FAIL          FSInfo sector could not be read
+    @retval     EXIT_WRITE_FAIL         FSInfo sector could not be written
+    @retval     EXIT_HARDWARE_FAIL      A write failed on the device
+
+*/
+EXIT_STATUS FSSync() {
+
+    EXIT_STATUS status = fat32WriteFSInfo();
+    if (status == EXIT_SUCCESS) status = fat32FlushFatCopies();
+    if (status != EXIT_SUCCESS) return status;
+
+    if (0 != MT_TableFlush()) return EXIT_MEMORY_TABLE_FAIL;
+    if (0 != write_flush()) return EXIT_HARDWARE_FAIL;
+
+    return EXIT_SUCCESS;
+
+}
+
+
 /*
     Mount a FAT32 File System. This is also reformat a partition if set
 
     @param      partition           Physical MBR partition number which is to be used. Set REFORMAT
-                                    flag to reformat the partition
+                                    flag to reformat the partition. Set SINGLE_FAT to only write
+                                    the first FAT until FSEject. FSSync updates the copies
 
     @retval    EXIT_SUCCESS             Succuss
     @retval    EXIT_INCORRECT_FORMAT    Partition is not FAT32
@@ -745,14 +3791,20 @@ EXIT_STATUS FSEject(void *args) {
     @retval    EXIT_INVALID_DEVICE      Device is unrecknoizable
     @retval    others                   Fail      
 
+    If the volume was not cleanly ejected (or has a hard error set), FS_UNCLEAN is set
+    in flg and the free clusters are recounted.
+
 */
 EXIT_STATUS FSMount(uint8_t partition) {
 
     Block buf;
+    flg &= ~(FS_DIRTY | FS_UNCLEAN | FS_SINGLE_FAT);
+    FatChangedFirst = 0xFFFFFFFF;
+    FatChangedLast = 0;
     for (uint16_t i = 0; i < sizeof(Block); i++) buf.data[i] = 0;
     
     // Read the Master Boot Record
-    if (MT_DeviceRead((uint8_t*)&buf, 0, 0, SECTOR_SIZE) != 0) {
+    if (MT_DeviceRead((uint8_t*)&buf, 0, 0, SECTOR_SIZE) != SECTOR_SIZE) {
         return EXIT_READ_FAIL;
     }
 
@@ -761,25 +3813,25 @@ EXIT_STATUS FSMount(uint8_t partition) {
 
     // Check if the partition number points to a valid partition
     for (uint8_t i = 0; i < 16; i++) {
-        if (((char*)&buf.MBR.PartitionRecord[partition])[i]) break;
+        if (((char*)&buf.MBR.PartitionRecord[partition & PARTITION_MASK])[i]) break;
         if (i == 15) return EXIT_INCORRECT_FORMAT;
     }
 
     // Check if valid partition is FAT32 (if REFORMAT is not set)
     if (!(partition & REFORMAT)) {
 
-        if (buf.MBR.PartitionRecord[partition].OSType != MBR_FAT32_CHS &&
-            buf.MBR.PartitionRecord[partition].OSType != MBR_FAT32_LBA) {
+        if (buf.MBR.PartitionRecord[partition & PARTITION_MASK].OSType != MBR_FAT32_CHS &&
+            buf.MBR.PartitionRecord[partition & PARTITION_MASK].OSType != MBR_FAT32_LBA) {
             return EXIT_INCORRECT_FORMAT;
         }
 
     } else {
-        buf.MBR.PartitionRecord[partition].OSType = MBR_FAT32_LBA;
+        buf.MBR.PartitionRecord[partition & PARTITION_MASK].OSType = MBR_FAT32_LBA;
     }
 
 
     // If REFORMAT is set, write the PBS
-    BS = (BootSector*) MT_SetPermanent(buf.MBR.PartitionRecord[partition].StartingLBA);
+    BS = (BootSector*) MT_SetPermanent(buf.MBR.PartitionRecord[partition & PARTITION_MASK].StartingLBA);
     if (BS == NULL) return EXIT_MEMORY_TABLE_FAIL;
 
     if (partition & REFORMAT) {
@@ -789,7 +3841,7 @@ EXIT_STATUS FSMount(uint8_t partition) {
         BS->BS_jmpBoot[2] = 0x90;
         strcpy(BS->BS_OEMName, "MSWIN4.1");
         BS->BPB_BytesPerSec = SECTOR_SIZE;
-        uint32_t size_MB = (buf.MBR.PartitionRecord[partition].SizeInLBA * SECTOR_SIZE) / (1024 * 1024);
+        uint32_t size_MB = (buf.MBR.PartitionRecord[partition & PARTITION_MASK].SizeInLBA * SECTOR_SIZE) / (1024 * 1024);
         
         if (size_MB < 9) BS->BPB_SecPerClus = 16;
         else if (size_MB < 1025) BS->BPB_SecPerClus = 32;
@@ -812,8 +3864,8 @@ EXIT_STATUS FSMount(uint8_t partition) {
         if (size_MB < 129) BS->BPB_NumHeads = 128;
         else BS->BPB_NumHeads = 255;
 
-        BS->BPB_HiddSec = buf.MBR.PartitionRecord[partition].StartingLBA;
-        BS->BPB_TotSec32 = buf.MBR.PartitionRecord[partition].SizeInLBA;
+        BS->BPB_HiddSec = buf.MBR.PartitionRecord[partition & PARTITION_MASK].StartingLBA;
+        BS->BPB_TotSec32 = buf.MBR.PartitionRecord[partition & PARTITION_MASK].SizeInLBA;
 
         BS->BPB_FATSz32 = 1 + (BS->BPB_TotSec32 / BS->BPB_SecPerClus) / (SECTOR_SIZE / 4);
         BS->BPB_ExtFlags = 0;
@@ -833,15 +3885,30 @@ EXIT_STATUS FSMount(uint8_t partition) {
     }
 
     // General PBS setting
-    BS->MBR_Part = buf.MBR.PartitionRecord[partition];
-    BS->MBR_Part_No = partition;
+    BS->MBR_Part = buf.MBR.PartitionRecord[partition & PARTITION_MASK];
+    BS->MBR_Part_No = partition & PARTITION_MASK;
     BS->PAR_Max_Cluster = (BS->BPB_TotSec32 - (BS->BPB_NumFATs * BS->BPB_FATSz32) - BS->BPB_RsvdSecCnt) / BS->BPB_SecPerClus;
-    if (SECTOR_SIZE != MT_DeviceWrite((char*)BS, buf.MBR.PartitionRecord[partition].StartingLBA, 0, SECTOR_SIZE)) {
+
+    // A volume left with mirroring disabled can have stale FAT copies. Update them from the active FAT
+    if (!(partition & REFORMAT) && (BS->BPB_ExtFlags & FAT_NO_MIRROR)) {
+        if (EXIT_SUCCESS != fat32SyncFatCopies(0, BS->BPB_FATSz32 - 1)) return EXIT_WRITE_FAIL;
+        BS->BPB_ExtFlags &= ~(FAT_NO_MIRROR | FAT_ACTIVE_MASK);
+    }
+
+    if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)BS, buf.MBR.PartitionRecord[partition & PARTITION_MASK].StartingLBA, 0, SECTOR_SIZE)) {
         return EXIT_WRITE_FAIL;
     }
 
+    // Only the first FAT is written until the eject. The boot sector is written through, so the
+    // device says mirroring is off before the copies can differ, and they are rebuilt after a crash
+    if ((partition & SINGLE_FAT) && BS->BPB_NumFATs > 1) {
+        BS->BPB_ExtFlags |= FAT_NO_MIRROR;
+        if (EXIT_SUCCESS != fat32WriteThrough((uint8_t*)BS, BS->MBR_Part.StartingLBA, 0, SECTOR_SIZE)) return EXIT_WRITE_FAIL;
+        flg |= FS_SINGLE_FAT;
+    }
+
     // REFORMAT FSInfo setting
-    if (SECTOR_SIZE != MT_DeviceRead((char*)&buf, buf.MBR.PartitionRecord[partition].StartingLBA + BS->BPB_FSInfo, 0, SECTOR_SIZE)) {
+    if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, buf.MBR.PartitionRecord[partition & PARTITION_MASK].StartingLBA + BS->BPB_FSInfo, 0, SECTOR_SIZE)) {
         return EXIT_READ_FAIL;
     }
 
@@ -852,12 +3919,17 @@ EXIT_STATUS FSMount(uint8_t partition) {
         buf.File.FSI_Free_Count = BS->PAR_Max_Cluster - 3;
         buf.File.FSI_Nxt_Free = 3;
         buf.File.FSI_TrailSig = FSI_TRAIL_SIG;
-        if (SECTOR_SIZE != MT_DeviceWrite((char*)&buf, buf.MBR.PartitionRecord[partition].StartingLBA + BS->BPB_FSInfo, 0, SECTOR_SIZE)) {
+        if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, buf.MBR.PartitionRecord[partition & PARTITION_MASK].StartingLBA + BS->BPB_FSInfo, 0, SECTOR_SIZE)) {
             return EXIT_WRITE_FAIL;
         }
     }
 
-    
+
+    // The FSInfo hints can be trusted if the sector is valid and the values are in range.
+    // Otherwise the free clusters are counted when the free cluster map is built
+    bool countFree = buf.File.FSI_LeadSig != FSI_LEAD_SIG || buf.File.FSI_StrucSig != FSI_STR_SIG ||
+                     buf.File.FSI_TrailSig != FSI_TRAIL_SIG || buf.File.FSI_Free_Count > BS->PAR_Max_Cluster;
+
     BS->FSI_Free_Count = buf.File.FSI_Free_Count;
     BS->FSI_Nxt_Free = buf.File.FSI_Nxt_Free;
     
@@ -871,7 +3943,7 @@ EXIT_STATUS FSMount(uint8_t partition) {
         sec < BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + BS->BPB_FATSz32 * BS->BPB_NumFATs;
         sec++) {
 
-            if (SECTOR_SIZE != MT_DeviceWrite((char*)&buf, sec, 0, SECTOR_SIZE)) {
+            if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, sec, 0, SECTOR_SIZE)) {
                 return EXIT_WRITE_FAIL;
             }
 
@@ -883,7 +3955,7 @@ EXIT_STATUS FSMount(uint8_t partition) {
 
         // Write to the first sector of each FAT
         for (uint8_t i = 0; i < BS->BPB_NumFATs; i++) {
-            if (SECTOR_SIZE != MT_DeviceWrite((char*)&buf, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + i * BS->BPB_FATSz32, 0, SECTOR_SIZE)) {
+            if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + i * BS->BPB_FATSz32, 0, SECTOR_SIZE)) {
                 return EXIT_WRITE_FAIL;
             }
         }
@@ -896,7 +3968,7 @@ EXIT_STATUS FSMount(uint8_t partition) {
         sec < BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + BS->BPB_FATSz32 * BS->BPB_NumFATs + BS->BPB_SecPerClus;
         sec++) {
 
-            if (SECTOR_SIZE != MT_DeviceWrite((char*)&buf, sec, 0, SECTOR_SIZE)) {
+            if (SECTOR_SIZE != MT_DeviceWrite((uint8_t*)&buf, sec, 0, SECTOR_SIZE)) {
                 return EXIT_WRITE_FAIL;
             }
 
@@ -904,6 +3976,26 @@ EXIT_STATUS FSMount(uint8_t partition) {
 
     }
 
+    // Check if the volume was cleanly ejected. If not, it stays dirty until it is
+    uint32_t entry;
+    if (sizeof(uint32_t) != MT_DeviceRead((uint8_t*)&entry, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt, 4, sizeof(uint32_t))) {
+        return EXIT_READ_FAIL;
+    }
+
+    if ((entry & (FAT_CLEAN_SHUTDOWN | FAT_NO_HARD_ERROR)) != (FAT_CLEAN_SHUTDOWN | FAT_NO_HARD_ERROR)) {
+        flg |= FS_UNCLEAN;
+        if (!(entry & FAT_CLEAN_SHUTDOWN)) flg |= FS_DIRTY;
+        countFree = TRUE;
+    }
+
+    // Find which clusters are free
+    if (EXIT_SUCCESS != fat32BuildFreeMap(countFree)) return EXIT_READ_FAIL;
+    for (uint8_t i = 0; i < ALLOC_WRITERS; i++) Headrooms[i].owner = 0;
+    for (uint8_t i = 0; i < DIR_INDEXES; i++) DirIndexes[i].cluster = 0;
+    for (uint8_t i = 0; i < DIR_SLOT_HINTS; i++) DirSlotHints[i].cluster = 0;
+    for (uint8_t i = 0; i < INDEX_FILES; i++) IndexFiles[i].dirCluster = 0;
+    for (uint8_t i = 0; i < DENTRY_CACHE; i++) Dentries[i].parent = 0;
+
     return EXIT_SUCCESS;
 }
 
@@ -921,164 +4013,420 @@ EXIT_STATUS FSMount(uint8_t partition) {
 */
 uint32_t FSReadFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file) {
 
-
     uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
-    uint32_t bytes = 0;
-    uint64_t currOffset = offset;
     uint32_t fileSize = file->file.ShortEntry.DIR_FileSize;
-    uint32_t currCluster = file->file.ShortEntry.DIR_FstClusHI << 16 + file->file.ShortEntry.DIR_FstClusLO;
+    uint32_t index = offset / bytesPerCluster;
+    uint32_t clusterOffset = offset % bytesPerCluster;
+    uint32_t bytesRead = 0;
+    uint32_t allocated;
 
-    if (offset > fileSize) return 0;
+    // Directories have no size and are read up to the end of their chain
+    if (file->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) fileSize = MAX_FILE_SIZE;
 
-    // Traverse to the starting cluster
-    for (uint32_t i = 0; i < offset/bytesPerCluster; i++) {
+    if (offset >= fileSize) return 0;
+    if (len > fileSize - offset) len = fileSize - offset;
 
-        currCluster = FSGetFatTableEntry(currCluster) & FAT_MASK;
-        if ((currCluster & FAT_MASK) > FAT_DEFECTIVE) return 0;
+    // Find the starting cluster
+    uint32_t currCluster = fat32ClusterAt(file, index);
+    if (currCluster == 0) return 0;
 
-    }
+    // Keep reading clusters until the end of the chain or length is reached
+    while (bytesRead < len) {
 
-    if (len < bytesPerCluster - (offset % bytesPerCluster)) {
+        uint32_t chunk = bytesPerCluster - clusterOffset;
+        if (chunk > len - bytesRead) chunk = len - bytesRead;
 
-        if (fileSize - offset < len) {
-            currOffset += fat32ReadCluster(data, currCluster, offset % bytesPerCluster, fileSize - offset);
-            return currOffset - offset;
+        if (chunk != fat32ReadCluster(&data[bytesRead], currCluster, clusterOffset, chunk)) break;
+        bytesRead += chunk;
+        clusterOffset = 0;
+
+        if (bytesRead < len) {
+            currCluster = fat32NextCluster(file, index++, currCluster, 0, &allocated);
+            if (currCluster == 0) break;
         }
+    }
 
-        currOffset += fat32ReadCluster(data, currCluster, offset % bytesPerCluster, len);
-        return currOffset - offset;
+    return bytesRead;
 
-    } else {
-        
-        if (fileSize - offset < bytesPerCluster - (offset % bytesPerCluster)) {
-            currOffset += fat32ReadCluster(data, currCluster, offset % bytesPerCluster, fileSize - offset);
-            return currOffset - offset;  
-        }
+}
+
+
+/*
+    Write to a file and place the contents in a buffer
+
+    @param          data                Buffer to read data from
+    @param          offset              File offset to begin writing
+    @param          len                 Length to write file
+    @param          file                FAT File entry to write
+
+    @return         bytes               Amount of bytes read
 
-        currOffset += fat32ReadCluster(data, currCluster, offset % bytesPerCluster, bytesPerCluster - (offset % bytesPerCluster));
+*/
+uint32_t FSWriteFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file) {
+
+    bool isDir = (file->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) != 0;
+
+    // Directories have no size, so they can be written anywhere in their chain
+    if (!isDir && offset > file->file.ShortEntry.DIR_FileSize) return 0;
+    if (len > MAX_FILE_SIZE - offset) len = MAX_FILE_SIZE - offset;
+    if (len == 0) return 0;
+
+    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+    uint32_t currCluster = fat32GetFirstCluster(file);
+    uint32_t index = offset / bytesPerCluster;
+    uint32_t clusterOffset = offset % bytesPerCluster;
+    uint32_t bytesWritten = 0;
+    uint32_t allocated = 0;     // Clusters in an extent that was just allocated
+    uint32_t hinted = 0;        // Clusters left in the last run passed to write_hint
+
+    // Clusters from the starting cluster to the end of the write. Used to size
+    // extents when the write goes past the end of the chain
+    uint32_t clusters = (clusterOffset + len - 1) / bytesPerCluster + 1;
+
+    // A file without clusters gets its first extent
+    if (currCluster == 0) {
+
+        currCluster = FSAllocateExtent(file, 0, index + clusters, &allocated);
+        if (currCluster == 0) return 0;
+
+        file->file.ShortEntry.DIR_FstClusHI = currCluster >> 16;
+        file->file.ShortEntry.DIR_FstClusLO = currCluster & 0xFFFF;
+        file->allocLen = bytesPerCluster;
+        fat32ResetCache(file);
+        file->lastIndex = allocated - 1;
+        file->lastCluster = currCluster + allocated - 1;
+        fat32AddAllocated(file, allocated - 1);
     }
 
-    currCluster = FSGetFatTableEntry(currCluster);
+    // Find the starting cluster. Writing at the end of the chain allocates
+    if (index > 0) {
 
-    // Keep reading clusters until the EOC cluster is reached or length reached OR end of file reached
-    while ((currOffset - offset) < len && currCluster < FAT_DEFECTIVE && currOffset < fileSize) {
+        currCluster = fat32ClusterAt(file, index - 1);
+        if (currCluster == 0) return 0;
 
-        if (len - (currOffset - offset) < bytesPerCluster) {
+        currCluster = fat32NextCluster(file, index - 1, currCluster, clusters, &allocated);
+        if (currCluster == 0) return 0;
+        fat32AddAllocated(file, allocated);
 
-            if (fileSize - currOffset < len - (currOffset - offset)) {
-                currOffset += fat32ReadCluster(&data[(currOffset - offset)], currCluster, 0, fileSize - currOffset);
-                return currOffset - offset;
-            }
+    }
 
-            currOffset += fat32ReadCluster(&data[(currOffset - offset)], currCluster, 0, len - (currOffset - offset));
-            return currOffset - offset;
+    while (bytesWritten < len) {
 
-        } else {
+        uint32_t chunk = bytesPerCluster - clusterOffset;
+        if (chunk > len - bytesWritten) chunk = len - bytesWritten;
 
-            if (fileSize - currOffset < bytesPerCluster) {
-                bytes = fat32ReadCluster(&data[(currOffset - offset)], currCluster, 0, fileSize - currOffset);
-                return bytes + (currOffset - offset);
-            }
+        // Let the device prepare for the sectors which are written whole. A new
+        // extent is contiguous so it is passed as one run
+        if (allocated && clusterOffset == 0 && len - bytesWritten >= SECTOR_SIZE) {
 
-            currOffset += fat32ReadCluster(&data[(currOffset - offset)], currCluster, 0, bytesPerCluster);
+            uint32_t sectors = (len - bytesWritten) / SECTOR_SIZE;
+            if (sectors > allocated * BS->BPB_SecPerClus) sectors = allocated * BS->BPB_SecPerClus;
 
+            write_hint(FSGetSector(currCluster), sectors);
+            hinted = allocated;
+
+        } else if (hinted == 0 && chunk == bytesPerCluster) {
+            write_hint(FSGetSector(currCluster), BS->BPB_SecPerClus);
         }
 
-        currCluster = FSGetFatTableEntry(currCluster);
+        allocated = 0;
+        if (hinted) hinted--;
+
+        if (chunk != fat32WriteCluster(&data[bytesWritten], currCluster, clusterOffset, chunk)) break;
+        bytesWritten += chunk;
+        clusterOffset = 0;
 
+        // Get next cluster or allocate an extent for the rest of the write, if nessesary
+        if (bytesWritten < len) {
+            currCluster = fat32NextCluster(file, index++, currCluster, (len - bytesWritten - 1) / bytesPerCluster + 1, &allocated);
+            if (currCluster == 0) break;
+            fat32AddAllocated(file, allocated);
+        }
     }
 
-    return (currOffset - offset); // should always equal len if the function exits here
+    // If the file size was increased, update the file size
+    if (!isDir && offset + bytesWritten > file->file.ShortEntry.DIR_FileSize) {
+        file->file.ShortEntry.DIR_FileSize = offset + bytesWritten;
+    }
 
+    return bytesWritten;
 
 }
 
 
 /*
-    Write to a file and place the contents in a buffer
+    Reserve space for a file without writing to it. Clusters are allocated to the
+    end of the file as contiguous extents until the file has at least the given
+    amount of bytes allocated. The file size (the valid length) is not changed, so
+    later writes up to the reserved length only transfer data.
+    The new first cluster of an empty file is written back by FSClose.
 
-    @param          data                Buffer to read data from
-    @param          offset              File offset to begin writing
-    @param          len                 Length to write file
-    @param          file                FAT File entry to write
+    @param      file                File to reserve space for
+    @param      bytes               Amount of bytes the file should have allocated
 
-    @return         bytes               Amount of bytes read
+    @return     EXIT_SUCCESS        Space was reserved
+    @return     EXIT_FAIL           Not enough free space, or the cluster chain is invalid
 
 */
-uint32_t FSWriteFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file) {
-
-    if (offset > file->file.ShortEntry.DIR_FileSize) return 0;
+EXIT_STATUS FSReserve(FILE *file, uint32_t bytes) {
 
-    uint32_t fileSize = file->file.ShortEntry.DIR_FileSize;
-    uint64_t currOffset = offset;
-    uint32_t currCluster = file->file.ShortEntry.DIR_FstClusHI << 16 + file->file.ShortEntry.DIR_FstClusLO;
     uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
-    uint32_t bytesWritten = 0;
+    uint32_t wanted = bytes == 0 ? 0 : (bytes - 1) / bytesPerCluster + 1;
+    uint32_t cluster = fat32GetFirstCluster(file);
+    uint32_t clusters = 0;
+    uint32_t allocated;
+
+    if (file->allocLen >= bytes) return EXIT_SUCCESS;
+
+    // Count the clusters the file has, stopping at the end of the chain. If the
+    // last cluster is known, the chain does not have to be walked
+    if (cluster != 0 && file->lastCluster != 0) {
+
+        clusters = file->lastIndex + 1;
+        cluster = file->lastCluster;
+
+    } else if (cluster != 0) {
+
+        clusters = 1;
+
+        while (clusters < wanted) {
 
-    // Traverse to the starting cluster
-    for (uint32_t i = 0; i < offset/bytesPerCluster; i++) {
+            uint32_t next = FSGetFatTableEntry(cluster) & FAT_MASK;
 
-        currCluster = FSGetFatTableEntry(currCluster) & FAT_MASK;
-        if ((currCluster & FAT_MASK) > FAT_DEFECTIVE) return 0;
+            if (next >= FAT_EOC) {
+                file->lastIndex = clusters - 1;
+                file->lastCluster = cluster;
+                break;
+            }
+            if (next < 2 || next >= FAT_DEFECTIVE) return EXIT_FAIL;
 
+            cluster = next;
+            clusters++;
+        }
     }
 
-    if (len <= bytesPerCluster - (offset % bytesPerCluster) || 
-        MAX_FILE_SIZE - offset < bytesPerCluster - (offset % bytesPerCluster)) {
+    // Allocate the rest as extents, as contiguous as free space allows
+    while (clusters < wanted) {
+
+        uint32_t first = FSAllocateExtent(file, cluster, wanted - clusters, &allocated);
+        if (first == 0) return EXIT_FAIL;
 
-        if (MAX_FILE_SIZE - offset < bytesPerCluster - (offset % bytesPerCluster)) {
-            currOffset += fat32WriteCluster(data, currCluster, offset % bytesPerCluster, MAX_FILE_SIZE - offset);
+        if (cluster == 0) {
+            file->file.ShortEntry.DIR_FstClusHI = first >> 16;
+            file->file.ShortEntry.DIR_FstClusLO = first & 0xFFFF;
         }
-        
-        currOffset += fat32WriteCluster(data, currCluster, offset % bytesPerCluster, len);
-       
-        // If the file size was increased, update the file size
-        if (currOffset > fileSize) {
-            file->file.ShortEntry.DIR_FileSize = currOffset;
+
+        cluster = first + allocated - 1;
+        clusters += allocated;
+        file->lastIndex = clusters - 1;
+        file->lastCluster = cluster;
+    }
+
+    if (clusters > MAX_FILE_SIZE / bytesPerCluster) file->allocLen = MAX_FILE_SIZE;
+    else file->allocLen = clusters * bytesPerCluster;
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Find how fragmented a file is. The cluster chain is walked and split into runs
+    of contiguous clusters.
+
+    @param      IN  file            File to check
+    @param      OUT info            Clusters, fragments and longest fragment of the file
+
+    @return     EXIT_SUCCESS        Succuss
+    @return     EXIT_FAIL           The cluster chain is invalid or loops
+
+*/
+EXIT_STATUS FSFileFragments(FILE *file, FragInfo *info) {
+
+    uint32_t cluster = fat32GetFirstCluster(file);
+    uint32_t index = 0;
+    uint32_t run = 0;
+    uint32_t allocated;
+
+    info->clusters = 0;
+    info->fragments = 0;
+    info->largest = 0;
+
+    while (cluster != 0) {
+
+        // A chain longer than the volume has clusters loops
+        if (cluster < 2 || cluster >= BS->PAR_Max_Cluster || index >= BS->PAR_Max_Cluster) return EXIT_FAIL;
+
+        uint32_t next = fat32NextCluster(file, index, cluster, 0, &allocated);
+
+        info->clusters++;
+        run++;
+
+        if (next != cluster + 1) {
+            info->fragments++;
+            if (run > info->largest) info->largest = run;
+            run = 0;
         }
-        return currOffset - offset;
 
-    } else {
-        currOffset += fat32WriteCluster(data, currCluster, offset % bytesPerCluster, bytesPerCluster - (offset % bytesPerCluster));
+        cluster = next;
+        index++;
     }
 
+    return EXIT_SUCCESS;
+}
+
 
-    while (currOffset - offset < len && currOffset < MAX_FILE_SIZE) {
+/*
+    Find how fragmented the free space is. The whole FAT is read a sector at a time
+    and the free clusters are split into runs of contiguous clusters.
 
-        // Get next cluster or allocate a cluster, if nessesary
-        if (FSGetFatTableEntry(currCluster) >= FAT_DEFECTIVE) {
-            currCluster = FSAllocateCluster(currCluster);
-        } else {
-            currCluster = FSGetFatTableEntry(currCluster);
+    @param      OUT info            Free clusters, free runs and longest free run
+
+    @return     EXIT_SUCCESS        Succuss
+    @return     EXIT_READ_FAIL      FAT could not be read
+
+*/
+EXIT_STATUS FSFreeFragments(FragInfo *info) {
+
+    Block buf;
+    uint32_t end = BS->PAR_Max_Cluster;
+    uint32_t run = 0;
+
+    info->clusters = 0;
+    info->fragments = 0;
+    info->largest = 0;
+
+    for (uint32_t cluster = 0; cluster < end; cluster += SECTOR_SIZE/4) {
+
+        uint16_t to = end - cluster < SECTOR_SIZE/4 ? end - cluster : SECTOR_SIZE/4;
+
+        if (SECTOR_SIZE != MT_DeviceRead((uint8_t*)&buf, BS->BPB_HiddSec + BS->BPB_RsvdSecCnt + cluster/(SECTOR_SIZE/4), 0, SECTOR_SIZE)) {
+            return EXIT_READ_FAIL;
         }
 
-        if (len - (currOffset - offset) < bytesPerCluster) {
+        for (uint16_t i = cluster == 0 ? 2 : 0; i < to; i++) {
 
-            currOffset += fat32WriteCluster(&data[currOffset - offset], currCluster, 0, len - (currOffset - offset));
-            if (currOffset > fileSize) {
-                file->file.ShortEntry.DIR_FileSize = currOffset;
+            if ((buf.FAT[i] & FAT_MASK) == FAT_FREE) {
+                if (run == 0) info->fragments++;
+                run++;
+                info->clusters++;
+                continue;
             }
-            return currOffset - offset;
 
-        } else {
+            if (run > info->largest) info->largest = run;
+            run = 0;
+        }
+    }
 
-            currOffset += fat32WriteCluster(&data[currOffset - offset], currCluster, 0, bytesPerCluster);
+    if (run > info->largest) info->largest = run;
 
-        }
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Defragment a file, moving at most a given amount of clusters per call so it can
+    be run in bounded time slices. The file is moved into one contiguous run of
+    clusters: the rest of the file is placed directly after its first fragment if
+    that space is free, otherwise the whole file is moved to a free run large enough
+    to hold it. Every cluster move leaves a valid chain, and each call starts again
+    from the chain on the disk, so other file operations can be done between calls.
+    Directories are not moved.
+
+    The driver does not keep track of open files, so other handles to the file must
+    be passed in to be given its new first cluster and have their cached clusters
+    cleared.
+
+    @param      file                File to defragment
+    @param      open                Other handles to the file, may be NULL if openCount is 0
+    @param      openCount           Amount of handles in open
+    @param      maxMoves            Most clusters to move in this call
+
+    @return     EXIT_SUCCESS        The file is contiguous
+    @return     EXIT_INCOMPLETE     maxMoves clusters were moved, call again to continue
+    @return     EXIT_INVALID_PARAMETER  File is a directory
+    @return     EXIT_FAIL           There is no free run large enough, or the chain is invalid
+    @return     others              A cluster move failed
+
+*/
+EXIT_STATUS FSDefragFile(FILE *file, FILE **open, uint8_t openCount, uint32_t maxMoves) {
+
+    FragInfo info;
+    uint32_t first = fat32GetFirstCluster(file);
+    uint32_t cluster = first;
+    uint32_t index = 0;
+    uint32_t moves = 0;
+    uint32_t allocated;
+    uint32_t prev, dest, runFirst;
+    EXIT_STATUS status;
+
+    if (file->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) return EXIT_INVALID_PARAMETER;
+
+    fat32ResetCache(file);
+
+    status = FSFileFragments(file, &info);
+    if (status != EXIT_SUCCESS) return status;
+    if (info.fragments <= 1) return EXIT_SUCCESS;
+
+    // Find the end of the first fragment
+    while (fat32NextCluster(file, index, cluster, 0, &allocated) == cluster + 1) {
+        cluster++;
+        index++;
+    }
+
+    // Place the rest directly after the first fragment if there is room, otherwise move
+    // the whole file to a free run
+    if (fat32FindFreeRun(cluster + 1, info.clusters - index - 1, &runFirst, first, TRUE) == info.clusters - index - 1 &&
+        runFirst == cluster + 1) {
+
+        prev = cluster;
+        dest = cluster + 1;
+        cluster = fat32ClusterAt(file, index + 1);
+
+    } else if (fat32FindFreeRun(first, info.clusters, &runFirst, first, TRUE) == info.clusters) {
+
+        prev = 0;
+        dest = runFirst;
+        cluster = first;
+
+    } else {
+        return EXIT_FAIL;
     }
 
-    if (currOffset > fileSize) {
-        file->file.ShortEntry.DIR_FileSize = currOffset;
+    fat32ResetCache(file);
+
+    while (cluster >= 2 && cluster < BS->PAR_Max_Cluster) {
+
+        uint32_t next = FSGetFatTableEntry(cluster) & FAT_MASK;
+
+        if (cluster != dest) {
+
+            if (moves == maxMoves) {
+                status = EXIT_INCOMPLETE;
+                break;
+            }
+
+            status = fat32MoveCluster(file, prev, cluster, dest);
+            if (status != EXIT_SUCCESS) break;
+            moves++;
+        }
+
+        prev = dest++;
+        cluster = next;
     }
 
-    // If MAX_SIZE is reached
-    if (currOffset > MAX_FILE_SIZE) {
-        file->file.ShortEntry.DIR_FileSize = MAX_FILE_SIZE;
-        currOffset -= 1;
+    // The moved clusters were freed, so the handles read the chain again. Headroom kept by the old first cluster is released
+    if (fat32GetFirstCluster(file) != first) fat32ReleaseHeadroom(first);
+    fat32ResetCache(file);
+
+    for (uint8_t i = 0; i < openCount; i++) {
+        if (open[i] != file && open[i]->dirCluster == file->dirCluster && open[i]->dirOffset == file->dirOffset) {
+            open[i]->file.ShortEntry.DIR_FstClusHI = file->file.ShortEntry.DIR_FstClusHI;
+            open[i]->file.ShortEntry.DIR_FstClusLO = file->file.ShortEntry.DIR_FstClusLO;
+            fat32ResetCache(open[i]);
+        }
     }
-    
-    return currOffset - offset;
 
+    return status;
 }
 
 
@@ -1094,162 +4442,371 @@ uint32_t FSWriteFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file) {
 */
 EXIT_STATUS FSCreateFile(FILE *file, FILE *dir, uint8_t *name, uint8_t flags, FileTime *time) {
 
-    uint32_t cluster = dir->file.ShortEntry.DIR_FstClusHI << 16 + dir->file.ShortEntry.DIR_FstClusLO;
-    uint32_t oldCluster = cluster;
-    uint32_t totalOffset = 0;
-    uint16_t off = 0;
-    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+    uint32_t oldCluster;
+    uint32_t offset;
     uint16_t longEntries = 0;
+    uint8_t shortFlags;
+    FileEntry longEntry;
     EXIT_STATUS status;
     
-    if (name != NULL) {
-        longEntries = ((strlen(name) - 1) / 13) + 1;
+    if (name == NULL || !name[0] || strlen((char*)name) > LONG_NAME_ENTRIES * 13) return EXIT_INVALID_PARAMETER;
+
+    // Create the short directory entry with FILE WRITE
+    memset(&file->file, 0, sizeof(FileEntry));
+    status = fat32MakeShortName(dir, (char*)name, file->file.ShortEntry.DIR_Name, &shortFlags);
+    if (status != EXIT_SUCCESS) return status;
+
+    file->file.ShortEntry.DIR_Attr = flags;
+    file->file.ShortEntry.DIR_CrtDate = 0b000000000100001; // 1/1/1980
+    file->file.ShortEntry.DIR_LstAccDate = 0b000000000100001;
+    file->file.ShortEntry.Dir_WrtDate = 0b000000000100001;
+
+    // Long entries are only needed if the short name does not show the name
+    if ((shortFlags & (SHORT_NAME_FITS | SHORT_NAME_MIXED)) == SHORT_NAME_FITS) {
+        file->file.ShortEntry.DIR_NTRes = shortFlags & (NTRES_LOWER_BASE | NTRES_LOWER_EXT);
+    } else {
+        longEntries = ((strlen((char*)name) - 1) / 13) + 1;
+    }
+
+    // Find free entries for the long entries and the short entry
+    status = fat32IndexFileStale(dir);
+    if (status != EXIT_SUCCESS) return status;
+    offset = fat32DirTakeSlots(dir, longEntries + 1);
+    if (offset == DIR_NO_SLOT) return EXIT_WRITE_FAIL;
+
+    // Create the long directory entries, from the last part of the name to the first
+    longEntry.LongEntry.LDIR_Attr = ATTR_LONG_NAME;
+    longEntry.LongEntry.LDIR_Checksum = fat32ChkSum((uint8_t*)file->file.ShortEntry.DIR_Name);
+    longEntry.LongEntry.LDIR_FstClusLO = 0;
+    longEntry.LongEntry.LDIR_Type = 0;
+
+    for (uint16_t i = 0; i < longEntries; i++) {
+
+        uint8_t ord = longEntries - i;
+
+        longEntry.LongEntry.LDIR_Ord = ord | (i == 0 ? LAST_LONG_ENTRY : 0);
+        fat32StrCpy((char*)&name[13 * (ord - 1)], &longEntry);
+
+        if (sizeof(FileEntry) != FSWriteFile((uint8_t*)&longEntry, offset + i * sizeof(FileEntry), sizeof(FileEntry), dir)) {
+            return EXIT_WRITE_FAIL;
+        }
+    }
+
+    file->dirOffset = offset + longEntries * sizeof(FileEntry);
+    if (sizeof(FileEntry) != FSWriteFile((uint8_t*)&file->file, file->dirOffset, sizeof(FileEntry), dir)) {
+        return EXIT_WRITE_FAIL;
     }
     
-    // Iterate through directory and see where the first free entry is
-    while (cluster & FAT_MASK != FAT_EOC) {
+    file->dir = dir;
+    file->dirCluster = fat32GetFirstCluster(dir);
+    file->len = strlen((char*)name);
+    file->allocLen = 0;
+    fat32ResetCache(file);
 
-        oldCluster = cluster;
+    fat32DirIndexAdd(dir, (char*)name, &file->file, offset);
+    fat32DentryDrop(fat32GetFirstCluster(dir));
 
-        for (off = 0; off < bytesPerCluster; off+=32) {
-            uint8_t stat = 1;
-            status = fat32ReadCluster(&stat, cluster, off, 1);
-            if (status != EXIT_SUCCESS) return status;
-            if (stat == REST_FREE_ENTRY) goto endFound;
-            totalOffset += 32;
+    // Update the time
+    FSChangeAttribues(file, flags, time, NULL);
+
+    // If DIR is set, create the '.' and '..' entries
+    if (flags & ATTR_DIRECTORY) {
+
+        // Allocate a cluster to the directory, in the group after its parent's
+        uint32_t allocated;
+        oldCluster = FSAllocateExtent(file, 0, 1, &allocated);
+        if (oldCluster == 0) return EXIT_WRITE_FAIL;
+        fat32ReleaseHeadroom(oldCluster);
+        file->file.ShortEntry.DIR_FstClusHI = oldCluster >> 16;
+        file->file.ShortEntry.DIR_FstClusLO = oldCluster & 0xFFFF;
+        if (sizeof(FileEntry) != FSWriteFile((uint8_t*)&file->file, file->dirOffset, sizeof(FileEntry), dir)) {
+            return EXIT_WRITE_FAIL;
+        }
+
+        status = fat32DirClear(file, 0);
+        if (status != EXIT_SUCCESS) return status;
+
+        // Create '.' entry and write it to new file
+        FILE entry;
+        memset(&entry, 0, sizeof(FILE));
+        entry.dir = file;
+        entry.dirOffset = 0;
+        entry.len = 1;
+        entry.file.ShortEntry.DIR_Attr = flags | ATTR_HIDDEN;
+        entry.file.ShortEntry.DIR_CrtDate = 0b000000000100001;
+        entry.file.ShortEntry.DIR_CrtTime = 0;
+        entry.file.ShortEntry.DIR_CrtTimeTenth = 0;
+        entry.file.ShortEntry.DIR_FileSize = 0;
+        entry.file.ShortEntry.DIR_FstClusHI = oldCluster >> 16;
+        entry.file.ShortEntry.DIR_FstClusLO = oldCluster & 0xFFFF;
+        entry.file.ShortEntry.DIR_LstAccDate = 0b000000000100001;
+        memcpy(entry.file.ShortEntry.DIR_Name, ".          ", 11);
+        entry.file.ShortEntry.DIR_NTRes = 0;
+        entry.file.ShortEntry.Dir_WrtDate = 0b000000000100001;
+        entry.file.ShortEntry.DIR_WrtTime = 0;
+        status = FSChangeAttribues(&entry, flags, time, NULL);
+        if (status != EXIT_SUCCESS) return status;
+        
+        if (sizeof(FileEntry) != fat32WriteCluster((uint8_t*)&entry.file, oldCluster, 0, sizeof(FileEntry))) {
+            return EXIT_WRITE_FAIL;
+        }
+
+        // Create '..' Entry and write it to new file. It points to cluster 0 if the parent is the root
+        uint32_t parent = fat32GetFirstCluster(dir);
+        if (parent == BS->BPB_RootClus) parent = 0;
+        entry.dirOffset = 32;
+        entry.len = 2;
+        entry.file.ShortEntry.DIR_FstClusHI = parent >> 16;
+        entry.file.ShortEntry.DIR_FstClusLO = parent & 0xFFFF;
+        memcpy(entry.file.ShortEntry.DIR_Name, "..         ", 11);
+
+        status = FSChangeAttribues(&entry, flags, time, NULL);
+        if (status != EXIT_SUCCESS) return status;
+
+        if (sizeof(FileEntry) != fat32WriteCluster((uint8_t*)&entry.file, oldCluster, 32, sizeof(FileEntry))) {
+            return EXIT_WRITE_FAIL;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Free the clusters allocated to files FSCreateFiles was creating.
+
+    @param      files           Files being created
+    @param      count           Amount of files
+
+*/
+void fat32CreateUndo(FileSpec *files, uint16_t count) {
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (files[i].cluster != 0) fat32FreeChain(files[i].cluster);
+        files[i].cluster = 0;
+    }
+}
+
+
+/*
+    Create many files in one directory. The names are checked against each other and
+    against the directory with one read of it. The entries of all of the files are
+    placed one after another and written a sector at a time, and each file is
+    allocated its size in contiguous extents, one file after another. The file sizes
+    (the valid lengths) are left at 0, as with FSReserve. The short name tails taken
+    in the directory are found during the same read.
+    Nothing is created unless every name can be used and there is enough free space.
+    The clusters are allocated before any entry is taken. If an entry cannot be
+    written, the entries taken are marked removed and the clusters are freed. If the
+    entries cannot be marked either, the clusters are left to them.
+
+    @param      dir                 Directory to add the files to
+    @param      files               Files to create. Their hash and cluster are set
+    @param      count               Amount of files
+    @param      time                Time to give the files. NULL means 1/1/1980
+
+    @return     EXIT_SUCCUSS            Files were created
+    @return     EXIT_INVALID_PARAMETER  A name is empty, too long, a directory, or used twice
+    @return     EXIT_ALREADY_EXIST      A name is already in the directory, or a short name could not be made
+    @return     EXIT_INVALID_TIME       Time passed was not valid
+    @return     EXIT_FAIL               Not enough free entries or clusters
+    @return     EXIT_WRITE_FAIL         An entry could not be written
+
+*/
+EXIT_STATUS FSCreateFiles(FILE *dir, FileSpec *files, uint16_t count, FileTime *time) {
+
+    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+    uint32_t entries = 0;
+    uint32_t clusters = 0;
+    uint8_t shortFlags;
+    uint32_t pos;
+    uint32_t from;
+    uint32_t start;
+    uint32_t taken;
+    FileEntry entry;
+    FileEntry longEntry;
+    char name[NAME_BUF_LEN];
+    char shortName[13];
+    EXIT_STATUS status = EXIT_SUCCESS;
+    DIR it;
+
+    if (fat32GetFirstCluster(dir) < 2) return EXIT_INVALID_PARAMETER;
+    if (time != NULL && fat32CheckTime(time) != EXIT_SUCCESS) return EXIT_INVALID_TIME;
+
+    // Check the names against each other and count the entries and clusters needed
+    for (uint16_t i = 0; i < count; i++) {
+
+        if (files[i].name == NULL || !files[i].name[0]) return EXIT_INVALID_PARAMETER;
+        if (strlen(files[i].name) > LONG_NAME_ENTRIES * 13) return EXIT_INVALID_PARAMETER;
+        if (files[i].attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID)) return EXIT_INVALID_PARAMETER;
+
+        files[i].hash = fat32NameHash(files[i].name);
+        files[i].tails = 0;
+        shortFlags = fat32ShortBasis(files[i].name, files[i].shortName);
+
+        for (uint16_t j = 0; j < i; j++) {
+            if (files[j].hash == files[i].hash && fat32NameMatch(files[j].name, files[i].name)) {
+                return EXIT_INVALID_PARAMETER;
+            }
+        }
+
+        entries += 1;
+        if ((shortFlags & (SHORT_NAME_FITS | SHORT_NAME_MIXED)) != SHORT_NAME_FITS) {
+            entries += (strlen(files[i].name) - 1) / 13 + 1;
+        }
+        clusters += files[i].size / bytesPerCluster + (files[i].size % bytesPerCluster != 0);
+    }
+
+    // Names which fit are their own short names, so their tails cannot be used by the others
+    for (uint16_t i = 0; i < count; i++) {
+
+        if (!(fat32ShortBasis(files[i].name, shortName) & SHORT_NAME_FITS)) continue;
+
+        for (uint16_t j = 0; j < count; j++) {
+            uint8_t tail = fat32ShortTailOf(shortName, files[j].shortName, files[j].hash);
+            if (tail) files[j].tails |= 1 << (tail - 1);
+        }
+    }
+
+    if (clusters > BS->FSI_Free_Count) return EXIT_FAIL;
+
+    // Check the names against the directory
+    fat32DirStart(dir, &it);
+
+    while (fat32DirRead(&it, &entry, &start, name) == EXIT_SUCCESS) {
+
+        uint16_t hash = fat32NameHash(name);
+
+        fat32ShortName(&entry.ShortEntry, shortName);
+        uint16_t shortHash = fat32NameHash(shortName);
+
+        for (uint16_t i = 0; i < count; i++) {
+
+            if ((files[i].hash == hash && fat32NameMatch(files[i].name, name)) ||
+                (files[i].hash == shortHash && fat32NameMatch(files[i].name, shortName))) {
+                return EXIT_ALREADY_EXIST;
+            }
+
+            uint8_t tail = fat32ShortTailOf(entry.ShortEntry.DIR_Name, files[i].shortName, files[i].hash);
+            if (tail) files[i].tails |= 1 << (tail - 1);
         }
+    }
+
+    // Give each file the first free tail, and take it from the files after it
+    for (uint16_t i = 0; i < count; i++) {
 
-        cluster = FSGetFatTableEntry(cluster);
-    }
+        uint8_t tail = 1;
 
-    // If reached the end of dir and need a new cluster allocated
-    cluster = FSAllocateCluster(oldCluster);
-    oldCluster = cluster;
+        if (fat32ShortBasis(files[i].name, shortName) & SHORT_NAME_FITS) continue;
 
-  endFound:
+        while (tail <= SHORT_TAILS && (files[i].tails & (1 << (tail - 1)))) tail++;
+        if (tail > SHORT_TAILS) return EXIT_ALREADY_EXIST;
 
-    // Create the long directory entries
-    file->file.LongEntry.LDIR_Attr = ATTR_LONG_NAME;
-    file->file.LongEntry.LDIR_Checksum = 0xFF;
-    file->file.LongEntry.LDIR_FstClusLO = 0;
-    file->file.LongEntry.LDIR_Ord = longEntries | LAST_LONG_ENTRY;
-    file->file.LongEntry.LDIR_Type = 0;
-    fat32StrCpy(&name[13 * longEntries], &file->file);
+        fat32ShortTail(files[i].shortName, files[i].hash, tail, shortName);
+        memcpy(files[i].shortName, shortName, 11);
 
-    if (off == 0) {
-        cluster = FSGetFatTableEntry(cluster);
-        if (cluster == FAT_EOC) {
-            cluster = FSAllocateCluster(oldCluster);
-            oldCluster = cluster;
+        for (uint16_t j = i + 1; j < count; j++) {
+            tail = fat32ShortTailOf(files[i].shortName, files[j].shortName, files[j].hash);
+            if (tail) files[j].tails |= 1 << (tail - 1);
         }
     }
-    off += 32;
-    if (off == bytesPerCluster) off = 0;
 
-    status = fat32WriteCluster((char*)&file->file, cluster, off, sizeof(FileEntry));
+    status = fat32IndexFileStale(dir);
     if (status != EXIT_SUCCESS) return status;
 
-    while (--longEntries) {
+    // Allocate each file's clusters after the previous file's, before any entry is taken
+    for (uint16_t i = 0; i < count; i++) {
+
+        uint32_t need = files[i].size / bytesPerCluster + (files[i].size % bytesPerCluster != 0);
+        uint32_t last = 0;
 
-        file->file.LongEntry.LDIR_Ord = longEntries;
-        fat32StrCpy(&name[13 * longEntries], &file->file);
+        files[i].cluster = 0;
+        while (need) {
 
-        if (off == 0) {
-            cluster = FSGetFatTableEntry(cluster);
-            if (cluster == FAT_EOC) {
-                cluster = FSAllocateCluster(oldCluster);
-                oldCluster = cluster;
+            uint32_t allocated;
+            uint32_t first = FSAllocateExtent(NULL, last, need, &allocated);
+            if (first == 0) {
+                fat32CreateUndo(files, i + 1);
+                return EXIT_FAIL;
             }
+
+            if (files[i].cluster == 0) files[i].cluster = first;
+            last = first + allocated - 1;
+            need -= allocated;
         }
-        off += 32;
-        if (off == bytesPerCluster) off = 0;
+    }
 
-        status = fat32WriteCluster((char*)&file->file, cluster, off, sizeof(FileEntry));
-        if (status != EXIT_SUCCESS) return status;
+    pos = fat32DirTakeSlots(dir, entries);
+    if (pos == DIR_NO_SLOT) {
+        fat32CreateUndo(files, count);
+        return EXIT_FAIL;
     }
-    
+    from = pos;
+    taken = pos;
 
-    // Create the short directory entry with FILE WRITE
-    file->file.ShortEntry.DIR_Attr = flags;
-    file->file.ShortEntry.DIR_CrtDate = 0b000000000100001; // 1/1/1980
-    file->file.ShortEntry.DIR_CrtTime = 0;
-    file->file.ShortEntry.DIR_CrtTimeTenth = 0;
-    file->file.ShortEntry.DIR_FileSize = 0;
-    file->file.ShortEntry.DIR_FstClusHI = 0;
-    file->file.ShortEntry.DIR_FstClusLO = 0;
-    file->file.ShortEntry.DIR_LstAccDate = 0b000000000100001;
-    strcpy((char*)&file->file.ShortEntry.DIR_Name, "ABCDEFGHIJK");
-    file->file.ShortEntry.DIR_NTRes = 0;
-    file->file.ShortEntry.Dir_WrtDate = 0b000000000100001;
-    file->file.ShortEntry.DIR_WrtTime = 0;
+    // The directory has been read, so its sector buffer is used to fill the new entries
+    longEntry.LongEntry.LDIR_Attr = ATTR_LONG_NAME;
+    longEntry.LongEntry.LDIR_FstClusLO = 0;
+    longEntry.LongEntry.LDIR_Type = 0;
+
+    for (uint16_t i = 0; i < count; i++) {
+
+        uint16_t longEntries = (strlen(files[i].name) - 1) / 13 + 1;
+
+        shortFlags = fat32ShortBasis(files[i].name, shortName);
+
+        memset(&entry, 0, sizeof(FileEntry));
+        entry.ShortEntry.DIR_Attr = files[i].attr;
+        entry.ShortEntry.DIR_CrtDate = 0b000000000100001; // 1/1/1980
+        entry.ShortEntry.DIR_LstAccDate = 0b000000000100001;
+        entry.ShortEntry.Dir_WrtDate = 0b000000000100001;
+        entry.ShortEntry.DIR_FstClusHI = files[i].cluster >> 16;
+        entry.ShortEntry.DIR_FstClusLO = files[i].cluster & 0xFFFF;
+        memcpy(entry.ShortEntry.DIR_Name, files[i].shortName, 11);
+        if (time != NULL) fat32SetTime(&entry.ShortEntry, time);
 
-    if (off == 0) {
-        cluster = FSGetFatTableEntry(cluster);
-        if (cluster == FAT_EOC) {
-            cluster = FSAllocateCluster(oldCluster);
-            oldCluster = cluster;
+        if ((shortFlags & (SHORT_NAME_FITS | SHORT_NAME_MIXED)) == SHORT_NAME_FITS) {
+            entry.ShortEntry.DIR_NTRes = shortFlags & (NTRES_LOWER_BASE | NTRES_LOWER_EXT);
+            longEntries = 0;
         }
-    }
-    off += 32;
-    if (off == bytesPerCluster) off = 0;
 
-    status = fat32WriteCluster((char*)&file->file, cluster, off, sizeof(FileEntry));
-    if (status != EXIT_SUCCESS) return status;
-    
-    file->dirOffset = totalOffset;
-    file->dir = dir;
-    file->len = strlen(name);
+        longEntry.LongEntry.LDIR_Checksum = fat32ChkSum((uint8_t*)entry.ShortEntry.DIR_Name);
+        start = pos;
 
-    // Update the time
-    FSChangeAttribues(file, flags, time, NULL);
+        for (uint16_t j = 0; j < longEntries; j++) {
 
-    // If DIR is set, create the '.' and '..' entries
-    if (flags & ATTR_DIRECTORY) {
+            uint8_t ord = longEntries - j;
 
-        // Allocate a cluster to the directory
-        oldCluster = FSAllocateCluster(0);
-        file->file.ShortEntry.DIR_FstClusHI = oldCluster >> 16;
-        file->file.ShortEntry.DIR_FstClusLO = oldCluster & 0xFFFF;
-        status = fat32WriteCluster((char*)&file->file, cluster, off, sizeof(FileEntry));
-        if (status != EXIT_SUCCESS) return status;
+            longEntry.LongEntry.LDIR_Ord = ord | (j == 0 ? LAST_LONG_ENTRY : 0);
+            fat32StrCpy(&files[i].name[13 * (ord - 1)], &longEntry);
 
-        // Create '.' entry and write it to new file
-        FILE entry;
-        entry.dir = file;
-        entry.dirOffset = 0;
-        entry.len = 1;
-        entry.file.ShortEntry.DIR_Attr = flags | ATTR_HIDDEN;
-        entry.file.ShortEntry.DIR_CrtDate = 0b000000000100001;
-        entry.file.ShortEntry.DIR_CrtTime = 0;
-        entry.file.ShortEntry.DIR_CrtTimeTenth = 0;
-        entry.file.ShortEntry.DIR_FileSize = 0;
-        entry.file.ShortEntry.DIR_FstClusHI = oldCluster >> 16;
-        entry.file.ShortEntry.DIR_FstClusLO = oldCluster & 0xFFFF;
-        entry.file.ShortEntry.DIR_LstAccDate = 0b000000000100001;
-        strcpy(entry.file.ShortEntry.DIR_Name, ".          ");
-        entry.file.ShortEntry.DIR_NTRes = 0;
-        entry.file.ShortEntry.Dir_WrtDate = 0b000000000100001;
-        entry.file.ShortEntry.DIR_WrtTime = 0;
-        status = FSChangeAttribues(&entry, flags, time, NULL);
-        if (status != EXIT_SUCCESS) return status;
-        
-        status = fat32WriteCluster((char*)&entry.file, oldCluster, 0, sizeof(FileEntry));
-        if (status != EXIT_SUCCESS) return status;
+            status = fat32DirPut(dir, &it.buf, &pos, &from, &longEntry);
+            if (status != EXIT_SUCCESS) break;
+        }
+        if (status != EXIT_SUCCESS) break;
 
-        // Create '..' Entry and write it to new file
-        entry.dirOffset = 32;
-        entry.len = 2;
-        entry.file.ShortEntry.DIR_FstClusHI = entry.dir->file.ShortEntry.DIR_FstClusHI;
-        entry.file.ShortEntry.DIR_FstClusLO = entry.dir->file.ShortEntry.DIR_FstClusLO;
-        strcpy(entry.file.ShortEntry.DIR_Name, "..         ");
+        status = fat32DirPut(dir, &it.buf, &pos, &from, &entry);
+        if (status != EXIT_SUCCESS) break;
 
-        status = FSChangeAttribues(&entry, flags, time, NULL);
-        if (status != EXIT_SUCCESS) return status;
+        fat32DirIndexAdd(dir, files[i].name, &entry, start);
+    }
 
-        status = fat32WriteCluster((char*)&entry.file, oldCluster, 32, sizeof(FileEntry));
-        if (status != EXIT_SUCCESS) return status;
+    if (status == EXIT_SUCCESS) status = fat32DirFlush(dir, &it.buf, pos, &from);
+
+    // Mark every entry taken removed, then the clusters are no longer referenced and can be freed.
+    // The directory's hints and index are rebuilt from the disk
+    if (status != EXIT_SUCCESS) {
+        fat32DirForget(fat32GetFirstCluster(dir));
+        from = taken;
+        pos = taken;
+        if (fat32DirFill(dir, &it.buf, &pos, &from, taken + entries * sizeof(FileEntry), FREE_ENTRY) == EXIT_SUCCESS) {
+            fat32CreateUndo(files, count);
+        }
+        return status;
     }
 
+    fat32DentryDrop(fat32GetFirstCluster(dir));
+
     return EXIT_SUCCESS;
 }
 
@@ -1267,84 +4824,281 @@ EXIT_STATUS FSCreateFile(FILE *file, FILE *dir, uint8_t *name, uint8_t flags, Fi
 */
 EXIT_STATUS FSRemoveFile(FILE *file) {
 
-    char entry;
-    char attr = ATTR_LONG_NAME;
-    char off = 32;
-    char freeEntry = FREE_ENTRY;
-    EXIT_STATUS status;
-    uint32_t bytesPerCluster = BS->BPB_SecPerClus * SECTOR_SIZE;
+    uint8_t entry;
+    uint8_t attr = ATTR_LONG_NAME;
+    uint8_t freeEntry = FREE_ENTRY;
     uint32_t cluster = 0;
 
-    status = FSReadFile(
+    if (1 != FSReadFile(
         &entry,
         file->dirOffset,
         1,
         file->dir
-    );
-
-    if (status != EXIT_SUCCESS) return status;
+    )) return EXIT_READ_FAIL;
 
     if (entry == FREE_ENTRY || entry == REST_FREE_ENTRY) return EXIT_NOT_EXIST;
 
-    status = FSWriteFile(
+    if (fat32IndexFileStale(file->dir) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+
+    if (1 != FSWriteFile(
         &freeEntry,
         file->dirOffset,
         1,
         file->dir
-    );
-
-    if (status != EXIT_SUCCESS) return status;
-
-    if (file->dirOffset == 0) return EXIT_SUCCESS;
+    )) return EXIT_WRITE_FAIL;
 
-    // Read previous long entry names until a short name is found
-    status = FSReadFile(
-        &attr,
-        file->dirOffset - off + 11,
-        1,
-        file->dir
-    );
+    // Free previous long entry names until a short name is found
+    uint32_t start = file->dirOffset;
+    for (uint32_t off = file->dirOffset; off >= 32; off -= 32) {
 
-    if (status != EXIT_SUCCESS) return status;
+        if (1 != FSReadFile(
+            &attr,
+            off - 32 + 11,
+            1,
+            file->dir
+        )) return EXIT_READ_FAIL;
 
-    while (attr == ATTR_LONG_NAME) {
+        if (attr != ATTR_LONG_NAME) break;
 
-        status = FSWriteFile(
+        if (1 != FSWriteFile(
             &freeEntry,
-            file->dirOffset,
+            off - 32,
             1,
             file->dir
-        );
+        )) return EXIT_WRITE_FAIL;
 
-        status = FSReadFile(
-            &attr,
-            file->dirOffset + 11,
-            1,
-            file->dir
-        );
+        start = off - 32;
+    }
 
-        if (status != EXIT_SUCCESS) return status;
+    fat32DirIndexRemove(file->dir, start);
+    fat32DirSlotsRelease(file->dir, start, (file->dirOffset - start) / sizeof(FileEntry) + 1);
+    fat32DentryDrop(fat32GetFirstCluster(file->dir));
+    fat32ReleaseHeadroom(fat32GetFirstCluster(file));
 
-        off -= 32;
-        if (file->dirOffset == 0) return EXIT_SUCCESS;
+    // The index file is read again when next used, so its header is not written to freed clusters
+    for (uint8_t i = 0; i < INDEX_FILES; i++) {
+        if (IndexFiles[i].dirCluster == fat32GetFirstCluster(file->dir) && IndexFiles[i].offset == file->dirOffset) {
+            IndexFiles[i].dirCluster = 0;
+        }
     }
 
     // Remove the FAT cluster chain
-    if (fat32GetDirCluster(file) == 0) return EXIT_SUCCESS;
-    cluster = fat32GetDirCluster(file);
+    cluster = fat32GetFirstCluster(file);
+    if (cluster == 0) return EXIT_SUCCESS;
+
+    // A new directory can be given the clusters, so what is remembered about this one is dropped
+    if (file->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) {
+        fat32DirForget(cluster);
+        fat32IndexFileDrop(cluster);
+    }
+
+    fat32ResetCache(file);
+
+    return fat32FreeChain(cluster);
+}
+
+
+/*
+    Compact a directory, moving files down over removed entries so the live entries
+    are contiguous. Once every file has been moved, the end marker is placed after
+    the last file and the clusters after it are freed. At most maxFiles files are
+    moved per call so it can be run in bounded time slices. The entries left behind
+    by a call are marked removed, and each call starts again from the directory on
+    the disk, so other file operations can be done between calls. Long entries
+    which do not belong to a short entry are dropped.
+
+    The driver does not keep track of open files, so files open in the directory
+    must be passed in to have their entry offsets updated.
+
+    @param      dir                 Directory to compact
+    @param      open                Files open in the directory, may be NULL if openCount is 0
+    @param      openCount           Amount of files in open
+    @param      maxFiles            Most files to move in this call
+
+    @return     EXIT_SUCCESS            The directory is compacted
+    @return     EXIT_INCOMPLETE         maxFiles files were moved, call again to continue
+    @return     EXIT_INVALID_PARAMETER  dir is not a directory
+    @return     EXIT_WRITE_FAIL         Entries could not be written
+    @return     others                  Trailing clusters could not be freed
+
+*/
+EXIT_STATUS FSCompactDirectory(FILE *dir, FILE **open, uint8_t openCount, uint32_t maxFiles) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    uint32_t bytesPerCluster = SECTOR_SIZE * BS->BPB_SecPerClus;
+    uint32_t pos = 0;           // Offset the next file is moved to
+    uint32_t from = 0;          // Offset of the first entry in buf which was not written
+    uint32_t start = 0;         // Offset of the first entry of the file being read
+    uint32_t moved = 0;
+    uint8_t ord = 0;            // Long entry expected next, 0 if none
+    uint8_t chkSum = 0;
+    FileEntry *e;
+    Block buf;
+    DIR it;
+
+    if (!(dir->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) || cluster < 2) return EXIT_INVALID_PARAMETER;
+
+    // Entries are moved, so the index, free entry hint and remembered lookups of the directory are dropped
+    fat32DirForget(cluster);
+
+    fat32DirStart(dir, &it);
+
+    while ((e = fat32DirEntry(&it)) != NULL) {
+
+        uint8_t first = e->ShortEntry.DIR_Name[0];
+
+        if (first == REST_FREE_ENTRY) break;
+
+        it.offset += sizeof(FileEntry);
+
+        if (first == FREE_ENTRY) {
+            ord = 0;
+            continue;
+        }
+
+        if ((e->ShortEntry.DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
+
+            uint8_t n = e->LongEntry.LDIR_Ord & 0x3F;
+
+            if (e->LongEntry.LDIR_Ord & LAST_LONG_ENTRY) {
+                if (n == 0 || n > LONG_NAME_ENTRIES) {
+                    ord = 0;
+                    continue;
+                }
+                start = it.offset - sizeof(FileEntry);
+                chkSum = e->LongEntry.LDIR_Checksum;
+            } else if (ord == 0 || n != ord - 1 || e->LongEntry.LDIR_Checksum != chkSum) {
+                ord = 0;
+                continue;
+            }
+
+            ord = n;
+            continue;
+        }
+
+        // A short entry (or volume label) ends a file. Long entries before it are kept only if they belong to it
+        if (ord != 1 || chkSum != fat32ChkSum((uint8_t*)e->ShortEntry.DIR_Name)) start = it.offset - sizeof(FileEntry);
+        ord = 0;
+
+        uint32_t next = it.offset;
+
+        if (start == pos) {
+            pos = from = next;
+            continue;
+        }
+
+        // Stop before the next move, marking the entries between the moved files and this one removed
+        if (fat32IndexFileStale(dir) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+
+        if (moved == maxFiles) {
+            if (fat32DirFill(dir, &buf, &pos, &from, start, FREE_ENTRY) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+            return EXIT_INCOMPLETE;
+        }
+
+        // The file is copied an entry at a time. Its new place is before its old one, so no entry is
+        // written over before it has been read
+        for (it.offset = start; it.offset < next; it.offset += sizeof(FileEntry)) {
+            e = fat32DirEntry(&it);
+            if (e == NULL || fat32DirPut(dir, &buf, &pos, &from, e) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+        }
+
+        for (uint8_t i = 0; i < openCount; i++) {
+            if (open[i]->dirCluster == cluster && open[i]->dirOffset == next - sizeof(FileEntry)) {
+                open[i]->dirOffset = pos - sizeof(FileEntry);
+            }
+        }
 
-    // Free the cluster chain
-    while (cluster & FAT_MASK != FAT_EOC) {
+        for (uint8_t i = 0; i < INDEX_FILES; i++) {
+            if (IndexFiles[i].dirCluster == cluster && IndexFiles[i].offset == next - sizeof(FileEntry)) {
+                IndexFiles[i].offset = IndexFiles[i].file.dirOffset = pos - sizeof(FileEntry);
+            }
+        }
+
+        moved++;
+    }
+
+    // The directory ends after the last file. Entries up to the end of its cluster are cleared
+    uint32_t keep = (pos + bytesPerCluster - 1) / bytesPerCluster;
+    if (keep == 0) keep = 1;
+
+    uint32_t end = it.offset;
+    if (end > keep * bytesPerCluster) end = keep * bytesPerCluster;
+    if (pos < end && fat32IndexFileStale(dir) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+
+    if (fat32DirFill(dir, &buf, &pos, &from, end, REST_FREE_ENTRY) != EXIT_SUCCESS) return EXIT_WRITE_FAIL;
+
+    // Free the clusters after the last one holding entries
+    uint32_t last = fat32ClusterAt(dir, keep - 1);
+    uint32_t next = last ? FSGetFatTableEntry(last) & FAT_MASK : 0;
+
+    fat32ResetCache(dir);
+    if (next < 2 || next >= BS->PAR_Max_Cluster) return EXIT_SUCCESS;
+
+    EXIT_STATUS status = fat32LinkRun(last, 1, FAT_EOC);
+    if (status != EXIT_SUCCESS) return status;
+
+    return fat32FreeChain(next);
+}
+
+
+/*
+    Build an index file for a directory, so a lookup in it reads a few sectors
+    instead of the whole directory, even the first lookup after a mount. The index
+    file (DIRINDEX.SYS, hidden and system) holds a B-tree of the hashes of the
+    names in the directory. It is kept in the directory's first sector so it is
+    found without reading the rest of the directory; if that sector is full, its
+    first file is moved to the end of the directory. The directory is compacted
+    first, so files another OS adds go at its end, where they are noticed. Another
+    OS can also remove or rename files, so the first name the keys do not have after
+    the index file is read makes the directory be read and checked against them.
+
+    Changing the directory, or another OS changing it, makes the keys stale, and
+    lookups read the directory until this function is called again. Lookups never
+    build the keys, as that writes the whole index file.
+
+    @param      dir                 Directory to index
+    @param      open                Files open in the directory, may be NULL if openCount is 0
+    @param      openCount           Amount of files in open
+
+    @return     EXIT_SUCCESS            Index file was built
+    @return     EXIT_INVALID_PARAMETER  dir is not a directory
+    @return     EXIT_FAIL               No room could be made for the index file
+    @return     others                  Directory could not be compacted, or the index file written
 
-        uint32_t tempCluster = FSGetFatTableEntry(cluster);
-        FSFatTableUpdate(cluster, FAT_FREE);
-        cluster = tempCluster;
-        BS->FSI_Free_Count += 1;
+*/
+EXIT_STATUS FSIndexDirectory(FILE *dir, FILE **open, uint8_t openCount) {
+
+    uint32_t cluster = fat32GetFirstCluster(dir);
+    IndexFile *index;
+    EXIT_STATUS status;
+    FILE old;
+
+    if (!(dir->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY) || cluster < 2) return EXIT_INVALID_PARAMETER;
 
+    fat32IndexFileDrop(cluster);
+    index = fat32IndexFileLoad(dir);
+
+    // An index file outside of the first sector is never found, so it is removed
+    if (index == NULL && FSDirectorySearch("DIRINDEX.SYS", dir, &old) == EXIT_SUCCESS &&
+        !memcmp(old.file.ShortEntry.DIR_Name, INDEX_FILE_NAME, 11)) {
+        status = FSRemoveFile(&old);
+        if (status != EXIT_SUCCESS) return status;
     }
-    
 
-    return EXIT_SUCCESS;
+    status = FSCompactDirectory(dir, open, openCount, 0xFFFFFFFF);
+    if (status != EXIT_SUCCESS) return status;
+
+    if (index == NULL) {
+
+        status = fat32IndexFileCreate(dir, open, openCount);
+        if (status != EXIT_SUCCESS) return status;
+
+        fat32IndexFileDrop(cluster);
+        index = fat32IndexFileLoad(dir);
+        if (index == NULL) return EXIT_FAIL;
+    }
+
+    return fat32IndexBuild(index, dir);
 }
 
 
@@ -1377,75 +5131,7 @@ EXIT_STATUS FSChangeAttribues(FILE *file, uint8_t flags, FileTime *time, uint8_t
     }
 
     // Check for valid date/time values
-    if (time != NULL) {
-
-        if (time->createYear < 1979 || time->createYear > 2107) return EXIT_INVALID_TIME;
-        if (time->wrtYear < 1979 || time->wrtYear > 2107) return EXIT_INVALID_TIME;
-        if (time->lstAccYear < 1979 || time->lstAccYear > 2107) return EXIT_INVALID_TIME;
-        if (time->createMonth < 1 || time->createMonth > 12) return EXIT_INVALID_TIME;
-        if (time->wrtMonth < 1 || time->wrtMonth > 12) return EXIT_INVALID_TIME;
-        if (time->lstAccMonth < 1 || time->lstAccMonth > 12) return EXIT_INVALID_TIME;
-        if (time->createDay < 1 || time->createDay > 31) return EXIT_INVALID_TIME;
-        if (time->wrtDay < 1 || time->wrtDay > 31) return EXIT_INVALID_TIME;
-        if (time->lstAccDay < 1 || time->lstAccDay > 31) return EXIT_INVALID_TIME;
-        if (time->createHour > 23) return EXIT_INVALID_TIME;
-        if (time->wrtHour > 23) return EXIT_INVALID_TIME;
-        if (time->createMinute > 59) return EXIT_INVALID_TIME;
-        if (time->wrtMinute > 59) return EXIT_INVALID_TIME;
-        if (time->createSecond > 59) return EXIT_INVALID_TIME;
-        if (time->wrtSecond > 59) return EXIT_INVALID_TIME;
-        if (time->createTenthSec > 9) return EXIT_INVALID_TIME;
-
-        // 30 Day Months
-        if (time->createMonth == 4 || time->createMonth == 6 || time->createMonth == 9 ||
-            time->createMonth == 11) {
-
-            if (time->createDay == 31) return EXIT_INVALID_TIME;
-        }
-
-        if (time->wrtMonth == 4 || time->wrtMonth == 6 || time->wrtMonth == 9 ||
-            time->wrtMonth == 11) {
-
-            if (time->wrtDay == 31) return EXIT_INVALID_TIME;
-        }
-
-        if (time->lstAccMonth == 4 || time->lstAccMonth == 6 || time->lstAccMonth == 9 ||
-            time->lstAccMonth == 11) {
-
-            if (time->lstAccMonth == 31) return EXIT_INVALID_TIME;
-        }
-
-        if (time->createMonth == 2) {
-
-            if (time->createYear % 4 && time->createYear != 2100) {
-                if (time->createDay > 29) return EXIT_INVALID_TIME;
-            } else {
-                if (time->createDay > 28) return EXIT_INVALID_TIME;
-            }
-
-        }
-
-        // February
-        if (time->wrtMonth == 2) {
-
-            if (time->wrtMonth % 4 && time->wrtMonth != 2100) {
-                if (time->wrtMonth > 29) return EXIT_INVALID_TIME;
-            } else {
-                if (time->wrtMonth > 28) return EXIT_INVALID_TIME;
-            }
-
-        }
-
-        if (time->lstAccMonth == 2) {
-
-            if (time->lstAccMonth % 4 && time->lstAccMonth != 2100) {
-                if (time->lstAccMonth > 29) return EXIT_INVALID_TIME;
-            } else {
-                if (time->lstAccMonth > 28) return EXIT_INVALID_TIME;
-            }
-
-        }
-    }
+    if (time != NULL && fat32CheckTime(time) != EXIT_SUCCESS) return EXIT_INVALID_TIME;
 
     // 1. Change name if nessesary
     if (name != NULL) {
@@ -1468,30 +5154,7 @@ EXIT_STATUS FSChangeAttribues(FILE *file, uint8_t flags, FileTime *time, uint8_t
     }
 
     // 2. Change date/time if nessesary
-    if (time != NULL) {
-
-        file->file.ShortEntry.DIR_CrtDate = time->createDay;
-        file->file.ShortEntry.DIR_CrtDate += time->createMonth << 5;
-        file->file.ShortEntry.DIR_CrtDate += (time->createYear - 1980) << 9;
-
-        file->file.ShortEntry.Dir_WrtDate = time->wrtDay;
-        file->file.ShortEntry.Dir_WrtDate += time->wrtMonth << 5;
-        file->file.ShortEntry.Dir_WrtDate += (time->wrtYear - 1980) << 9;
-
-        file->file.ShortEntry.DIR_LstAccDate = time->lstAccDay;
-        file->file.ShortEntry.DIR_LstAccDate += time->lstAccMonth << 5;
-        file->file.ShortEntry.DIR_LstAccDate += (time->lstAccYear - 1980) << 9;
-
-        file->file.ShortEntry.DIR_CrtTime = time->createSecond / 2;
-        file->file.ShortEntry.DIR_CrtTime = time->createMinute << 5;
-        file->file.ShortEntry.DIR_CrtTime = time->createHour << 11;
-
-        file->file.ShortEntry.DIR_WrtTime = time->wrtSecond / 2;
-        file->file.ShortEntry.DIR_WrtTime = time->wrtMinute << 5;
-        file->file.ShortEntry.DIR_WrtTime = time->wrtHour << 11;
-
-        file->file.ShortEntry.DIR_CrtTimeTenth = time->createTenthSec + 10 * (time->createSecond % 2);
-    }
+    if (time != NULL) fat32SetTime(&file->file.ShortEntry, time);
 
 
     // 3. Change flags
@@ -1533,6 +5196,138 @@ EXIT_STATUS FSOpen(uint8_t *name, FILE *dir, FILE *file) {
 }
 
 
+/*
+    Open the root directory.
+
+    @param      root                Empty file for the root directory
+
+    @return     EXIT_SUCCESS        Root directory was opened
+    @return     EXIT_NOT_EXIST      No file system is mounted
+
+*/
+EXIT_STATUS FSOpenRoot(FILE *root) {
+
+    if (!(flg & FS_ACTIVE) || BS == NULL) return EXIT_NOT_EXIST;
+
+    memset(root, 0, sizeof(FILE));
+    memset(root->file.ShortEntry.DIR_Name, ' ', 11);
+    root->file.ShortEntry.DIR_Attr = ATTR_DIRECTORY;
+    root->file.ShortEntry.DIR_FstClusHI = BS->BPB_RootClus >> 16;
+    root->file.ShortEntry.DIR_FstClusLO = BS->BPB_RootClus & 0xFFFF;
+    fat32ResetCache(root);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Open a file or directory from its full path, such as "/logs/2026/run.bin".
+    Each component is looked up through a cache of recent lookups, which also
+    remembers names that were not found, so opening deep paths again does not
+    search every directory on the way.
+    OPEN FILES MUST BE CLOSED TO AVOID UNDEFINED BEHAVIOUR
+
+    @param      IN  path            Path from the root directory, separated by '/'
+    @param      OUT dir             Directory which file is in. It must be kept while the file
+                                    is open, and has no parent directory of its own
+    @param      OUT file            Empty file for the file
+
+    @return     EXIT_SUCCESS        File was opened
+    @return     EXIT_NOT_FOUND      A component of the path did not exist, or was not a directory
+    @return     EXIT_INVALID_PARAMETER  Path is empty or a component is too long
+    @return     others              Other failure
+
+*/
+EXIT_STATUS FSOpenPath(uint8_t *path, FILE *dir, FILE *file) {
+
+    char name[NAME_BUF_LEN];
+    EXIT_STATUS status = FSOpenRoot(dir);
+    if (status != EXIT_SUCCESS) return status;
+
+    while (*path == '/') path++;
+    if (*path == 0) return EXIT_INVALID_PARAMETER;
+
+    while (1) {
+
+        // Take the next component of the path
+        uint16_t len = 0;
+        while (*path && *path != '/') {
+            if (len == NAME_BUF_LEN - 1) return EXIT_INVALID_PARAMETER;
+            name[len++] = *path++;
+        }
+        name[len] = 0;
+        while (*path == '/') path++;
+
+        status = fat32Lookup(name, dir, file);
+        if (status != EXIT_SUCCESS) return status;
+        if (*path == 0) return EXIT_SUCCESS;
+
+        // Every component before the last must be a directory, which is searched next
+        if (!(file->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY)) return EXIT_NOT_FOUND;
+
+        if (fat32GetFirstCluster(file) == 0) {
+            FSOpenRoot(dir);    // '..' of a directory in the root directory
+        } else {
+            memcpy(dir, file, sizeof(FILE));
+            dir->dir = NULL;
+        }
+    }
+}
+
+
+/*
+    Start reading the files of a directory.
+
+    @param      IN  dir             Directory to read. It must be kept while it is being read
+    @param      OUT it              Position within the directory, set to its first file
+
+    @return     EXIT_SUCCESS            Directory can be read
+    @return     EXIT_INVALID_PARAMETER  File is not a directory
+
+*/
+EXIT_STATUS FSDirOpen(FILE *dir, DIR *it) {
+
+    if (!(dir->file.ShortEntry.DIR_Attr & ATTR_DIRECTORY)) return EXIT_INVALID_PARAMETER;
+
+    fat32DirStart(dir, it);
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+    Read the next files of a directory. Long names are put together and each file
+    is returned as one record. Up to count files are read per call, and each
+    directory sector is only read once.
+
+    @param      IN  it              Position within the directory, from FSDirOpen
+    @param      OUT records         Where to place the files read
+    @param      IN  count           Most files to read
+
+    @return     Amount of files read. Less than count once the end of the directory is reached
+
+*/
+uint16_t FSDirNext(DIR *it, DirRecord *records, uint16_t count) {
+
+    FileEntry entry;
+    uint32_t start;
+    uint16_t read = 0;
+
+    while (read < count && fat32DirRead(it, &entry, &start, records[read].name) == EXIT_SUCCESS) {
+
+        DirRecord *record = &records[read++];
+
+        fat32ShortName(&entry.ShortEntry, record->shortName);
+        record->attr = entry.ShortEntry.DIR_Attr;
+        record->size = entry.ShortEntry.DIR_FileSize;
+        record->cluster = ((uint32_t)entry.ShortEntry.DIR_FstClusHI << 16) + entry.ShortEntry.DIR_FstClusLO;
+        record->offset = it->offset - sizeof(FileEntry);
+    }
+
+    return read;
+}
+
+
 /*
     Close a file (or directory) and write it back to the disk.
 
@@ -1543,5 +5338,7 @@ EXIT_STATUS FSOpen(uint8_t *name, FILE *dir, FILE *file) {
 */
 EXIT_STATUS FSClose(FILE *file) {
 
+    fat32ReleaseHeadroom(fat32GetFirstCluster(file));
+
     return fat32FileToDisk(file);
 }
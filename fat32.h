@@ -15,6 +15,9 @@ typedef int8_t bool;
 // Status Register
 //
 #define FS_ACTIVE 0x0001
+#define FS_DIRTY 0x0002     // Volume is marked dirty in FAT[1] on the device
+#define FS_UNCLEAN 0x0004   // Volume was not cleanly ejected before it was mounted
+#define FS_SINGLE_FAT 0x0008    // Only the first FAT is written, the other copies are updated on sync
 uint16_t flg;
 
 
@@ -22,6 +25,8 @@ uint16_t flg;
 // Master Boot Record
 //
 #define REFORMAT 8
+#define SINGLE_FAT 16       // Mount with FAT mirroring disabled until eject
+#define PARTITION_MASK 0x03
 #define MBR_SIGNATURE 0x55AA
 #define MBR_FAT32_CHS 0x0B
 #define MBR_FAT32_LBA 0x0C
@@ -41,6 +46,59 @@ uint16_t flg;
 #define FAT_EOC 0x0FFFFFF8
 #define FAT_MASK 0x0FFFFFFF
 #define FAT_FREE 0x00000000
+#define FAT_CLEAN_SHUTDOWN 0x08000000   // FAT[1] bit, cleared while the volume is mounted and changed
+#define FAT_NO_HARD_ERROR 0x04000000    // FAT[1] bit, cleared if a disk I/O error was found
+#define FAT_NO_MIRROR 0x0080            // BPB_ExtFlags bit, only the active FAT is in use
+#define FAT_ACTIVE_MASK 0x000F          // BPB_ExtFlags bits, number of the active FAT
+
+//
+// Free Cluster Map
+//
+#define FREE_MAP_BYTES 512                      // Bytes of memory reserved for the free cluster map
+#define FREE_MAP_CLUSTERS (FREE_MAP_BYTES * 8)  // Clusters covered by the map, starting at cluster 0
+#define FULL_MAP_BYTES 128                      // Bytes of memory reserved for the map of full FAT sectors
+#define FULL_MAP_SECTORS (FULL_MAP_BYTES * 8)   // FAT sectors covered by it, starting after the free cluster map
+
+//
+// Allocation Groups
+//
+#define ALLOC_GROUP_CLUSTERS 1024   // Clusters in an allocation group, whose FAT entries fill 8 FAT sectors
+#define ALLOC_HEADROOM 32           // Free clusters kept after the end of a file being written
+#define ALLOC_WRITERS 4             // Files which can have headroom kept at once
+#define ALLOC_SEARCH_RUNS 32        // Free runs looked at before the longest is used
+
+//
+// Directory Index
+//
+#define DIR_INDEX_SLOTS 128         // Slots in a directory's index (4 bytes each), must be a power of 2
+#define DIR_INDEXES 2               // Directories which can be indexed at once
+#define DIR_INDEX_EMPTY 0xFFFF      // Slot was never used
+#define DIR_INDEX_REMOVED 0xFFFE    // Slot was used by a removed file
+
+//
+// Free Directory Entries
+//
+#define DIR_SLOT_HINTS 2            // Directories whose free entries are tracked at once
+#define DIR_FREE_RUNS 6             // Runs of removed entries tracked per directory
+#define DIR_MAX_ENTRIES 65536       // Most entries in a directory
+#define DIR_NO_SLOT 0xFFFFFFFF      // No free entries could be found
+
+//
+// Path Cache
+//
+#define DENTRY_CACHE 8              // Path components remembered by FSOpenPath
+#define DENTRY_NAME_LEN 24          // Longest name which is remembered
+#define DENTRY_NEGATIVE 0xFFFFFFFF  // Offset of a name which does not exist
+
+//
+// Directory Index Files
+//
+#define INDEX_FILE_NAME "DIRINDEXSYS"   // Short name of the index file kept in a directory (DIRINDEX.SYS)
+#define INDEX_FILE_ATTR (ATTR_HIDDEN|ATTR_SYSTEM)
+#define INDEX_FILE_MAGIC 0x58444946UL   // "FIDX"
+#define INDEX_FILE_VERSION 2
+#define INDEX_KEYS 63                   // Keys in an index file node (8 bytes each, after an 8 byte node header)
+#define INDEX_FILES 2                   // Directories whose index file is remembered at once
 
 //
 // Files & Directories
@@ -51,13 +109,24 @@ uint16_t flg;
 #define ATTR_VOLUME_ID 0x08
 #define ATTR_DIRECTORY 0x10
 #define ATTR_ARCHIVE 0x20
-#define ATTR_LONG_NAME ATTR_READ_ONLY|ATTR_HIDDEN|ATTR_SYSTEM|ATTR_VOLUME_ID
+#define ATTR_LONG_NAME (ATTR_READ_ONLY|ATTR_HIDDEN|ATTR_SYSTEM|ATTR_VOLUME_ID)
+#define ATTR_LONG_NAME_MASK (ATTR_LONG_NAME|ATTR_DIRECTORY|ATTR_ARCHIVE)
 #define FREE_ENTRY 0xE5
 #define REST_FREE_ENTRY 0x00
 #define FREE_ENTRY_JP 0x05
 #define LAST_LONG_ENTRY 0x40
+#define LONG_NAME_ENTRIES 20        // Most long entries in a name (255 chars)
+#define NAME_BUF_LEN (LONG_NAME_ENTRIES*13 + 1)     // Bytes needed to hold any name
+#define NTRES_LOWER_BASE 0x08       // DIR_NTRes bit, short name base is shown in lower case
+#define NTRES_LOWER_EXT 0x10        // DIR_NTRes bit, short name extension is shown in lower case
+#define SHORT_NAME_FITS 0x01        // Long name can be stored as its short name without changes
+#define SHORT_NAME_MIXED 0x02       // Short name base or extension has both cases, so long entries are needed
+#define SHORT_NUM_TAILS 4           // Tails ~1 to ~4 are added to the basis before hashed tails are used
+#define SHORT_TAILS 13              // Numeric tails, then hashed tails ~1 to ~9
+#define DIR_NO_SECTOR 0xFFFFFFFF    // No directory sector is loaded in a DIR
 
 #define MAX_FILE_SIZE 0xFFFFFFFFU   // 4 GB Max file size
+#define FILE_EXTENTS 8              // Cluster extents cached per open file
 
 //
 // Struct for Partition within Master Boot Record
@@ -185,7 +254,7 @@ typedef struct LongDirEntry_t {
     uint16_t    LDIR_FstClusLO;     // Always 0
     uint16_t    LDIR_Name3[2];      // Chars 12-13
 
-} LongDirEntry;
+} __attribute__((packed)) LongDirEntry;
 
 //
 // File Entry
@@ -197,6 +266,51 @@ typedef union FileEntry_t {
 
 } FileEntry;
 
+//
+// Key of a directory index file. In a leaf it is a name and the file it belongs to.
+// In other nodes it is the first hash under a child node and the child's sector
+//
+typedef struct IndexKey_t {
+
+    uint32_t            hash;           // Hash of the case folded name
+    uint32_t            entry;          // First directory entry of the file (byte offset / 32), or sector of the child
+
+} __attribute__((packed)) IndexKey;
+
+//
+// Node of a directory index file, one sector
+//
+typedef struct IndexNode_t {
+
+    uint16_t            count;          // Keys in the node
+    uint16_t            level;          // 0 for a leaf
+    uint32_t            reserved;
+    IndexKey            keys[INDEX_KEYS];   // Sorted by hash
+
+} __attribute__((packed)) IndexNode;
+
+//
+// First sector of a directory index file
+//
+typedef struct IndexHeader_t {
+
+    uint32_t            magic;          // INDEX_FILE_MAGIC
+    uint16_t            version;        // INDEX_FILE_VERSION
+    uint16_t            height;         // Levels of nodes, 1 if the root is a leaf
+    uint32_t            generation;     // Incremented when the directory is changed or the index is built
+    uint32_t            built;          // Generation the keys were built for. The keys are stale if it differs
+    uint32_t            dirCluster;     // First cluster of the directory
+    uint32_t            dirEnd;         // Offset of the end of the directory when the keys were built
+    uint16_t            freeMap;        // Free entries in the directory's first sector, one bit each
+    uint16_t            reserved;
+    uint32_t            keys;           // Keys in the leaves
+    uint32_t            firstLeaf;      // Sector of the first leaf. The leaves follow it in key order
+    uint32_t            leaves;         // Amount of leaves
+    uint32_t            root;           // Sector of the root node
+    uint32_t            dirSum;         // Sum of the names in the directory up to dirEnd, see fat32IndexDirSum
+
+} __attribute__((packed)) IndexHeader;
+
 //
 // Working Block
 //
@@ -207,6 +321,8 @@ typedef union Working_Block_t {
     FSInfo                  File;
     FileEntry               Entry[SECTOR_SIZE/32];
     uint32_t                FAT[SECTOR_SIZE/4];
+    IndexHeader             Index;
+    IndexNode               Node;
     char                    data[SECTOR_SIZE];
 
 } Block;
@@ -215,6 +331,29 @@ typedef union Working_Block_t {
 BootSector *BS;
 
 
+/*
+    Free cluster map. One bit per cluster, set if the cluster is in use. Clusters
+    at or beyond FREE_MAP_CLUSTERS are not in the map and are found through the FAT.
+*/
+uint32_t FreeMap[FREE_MAP_BYTES/4];
+
+
+/*
+    Map of full FAT sectors past the free cluster map. One bit per FAT sector, set
+    once the sector is known to have no free entry, so searches skip it without
+    reading it. A bit is cleared when a cluster in the sector is freed.
+*/
+uint32_t FullMap[FULL_MAP_BYTES/4];
+
+
+/*
+    Range of FAT sectors changed since the FAT copies were last updated, when
+    mirroring is disabled. There are no changes if FatChangedFirst > FatChangedLast.
+*/
+uint32_t FatChangedFirst;
+uint32_t FatChangedLast;
+
+
 // File Name Rules
 // 1. DIR_Name[0] = 0xE5 is illegal and this is free
 // 2. DIR_Name[0] = 0x00 means that this and the whole rest of dir is free
@@ -228,6 +367,18 @@ char ShortNameIllegal[16] = {'"', '*', '+', ',', '.', '/', ':',
 
 char LongNameIllegal[11] = {'"', '*', '.', '/', ':', '<', '>', '?', '\\', '|'};
 
+// Upper case of each ASCII character, used to compare names without case
+const char FoldTable[128] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
+    0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F
+};
+
 
 //
 //    Struct for File Date and Time Creation
@@ -277,6 +428,30 @@ FileTime DefaultTime = {
 };
 
 
+//
+// Run of contiguous clusters within a file
+//
+typedef struct Extent_t {
+
+    uint32_t            index;          // Cluster index within the file of the first cluster
+    uint32_t            cluster;        // First cluster of the extent
+    uint32_t            len;            // Amount of clusters in the extent
+
+} Extent;
+
+
+//
+// Fragmentation of a file's cluster chain or of the free space
+//
+typedef struct FragInfo_t {
+
+    uint32_t            clusters;       // Clusters counted
+    uint32_t            fragments;      // Runs of contiguous clusters. The average run is clusters/fragments
+    uint32_t            largest;        // Clusters in the longest run
+
+} FragInfo;
+
+
 //
 // Struct which holds file information
 //
@@ -287,10 +462,172 @@ typedef struct FILE_t {
     struct FILE_t       *dir;           // Dir that file is in
     uint32_t            dirCluster;     // Cluster directory is in
     uint32_t            dirOffset;      // Dir Entry Offset 
+    uint32_t            allocLen;       // Bytes allocated to the file, 0 if not known
+    Extent              extents[FILE_EXTENTS];  // Cached extents of the cluster chain, in file order
+    uint8_t             extentCount;    // Amount of cached extents
+    uint32_t            cursorIndex;    // Cluster index of cursorCluster
+    uint32_t            cursorCluster;  // Last cluster reached in the chain, 0 if none
+    uint32_t            lastIndex;      // Cluster index of lastCluster
+    uint32_t            lastCluster;    // Last cluster of the chain, 0 if not known
 
 } FILE;
 
 
+//
+// Free clusters kept after the end of a file being written, so the file can grow
+// contiguously while other files are written
+//
+typedef struct Headroom_t {
+
+    uint32_t            owner;          // First cluster of the file the headroom is kept for, 0 if unused
+    uint32_t            cluster;        // First cluster of the headroom
+
+} Headroom;
+
+Headroom Headrooms[ALLOC_WRITERS];
+uint8_t HeadroomNext;                   // Slot to replace when every slot is used
+
+
+//
+// Slot of a directory index. A file with a long name has a slot for its long name
+// and one for its short name
+//
+typedef struct DirIndexSlot_t {
+
+    uint16_t            hash;           // Hash of the case folded name
+    uint16_t            entry;          // First directory entry of the file (byte offset / 32)
+
+} DirIndexSlot;
+
+
+//
+// Hash index of the names in a directory. A directory with more files than fit
+// has its first files indexed
+//
+typedef struct DirIndex_t {
+
+    uint32_t            cluster;        // First cluster of the directory, 0 if unused
+    uint16_t            used;           // Slots which are not empty
+    uint16_t            stamp;          // Last time the index was used, for replacement
+    bool                complete;       // Every file in the directory is in the index
+    uint32_t            end;            // Offset of the first file which is not in the index, if not complete
+    DirIndexSlot        slots[DIR_INDEX_SLOTS];
+
+} DirIndex;
+
+DirIndex DirIndexes[DIR_INDEXES];
+uint16_t DirIndexClock;                 // Incremented on each use of an index
+
+
+//
+// Run of removed (FREE_ENTRY) entries in a directory
+//
+typedef struct FreeRun_t {
+
+    uint16_t            entry;          // First entry of the run (byte offset / 32)
+    uint16_t            count;          // Entries in the run, 0 if unused
+
+} FreeRun;
+
+
+//
+// Where new entries can be placed in a directory, so files can be created without
+// reading the directory
+//
+typedef struct DirSlots_t {
+
+    uint32_t            cluster;        // First cluster of the directory, 0 if unused
+    uint32_t            end;            // Offset of the end marker, or of the end of the chain
+    uint16_t            stamp;          // Last time the hint was used, for replacement
+    bool                missed;         // Some runs were not recorded because every run was used
+    FreeRun             runs[DIR_FREE_RUNS];
+
+} DirSlots;
+
+DirSlots DirSlotHints[DIR_SLOT_HINTS];
+uint16_t DirSlotClock;                  // Incremented on each use of a hint
+
+
+//
+// Result of looking up a name in a directory
+//
+typedef struct Dentry_t {
+
+    uint32_t            parent;         // First cluster of the directory, 0 if unused
+    uint32_t            offset;         // Offset of the file's short entry, DENTRY_NEGATIVE if not found
+    uint16_t            stamp;          // Last time the entry was used, for replacement
+    char                name[DENTRY_NAME_LEN + 1];
+
+} Dentry;
+
+Dentry Dentries[DENTRY_CACHE];
+uint16_t DentryClock;                   // Incremented on each use of an entry
+
+
+//
+// Index file of a directory, as read from the disk
+//
+typedef struct IndexFile_t {
+
+    uint32_t            dirCluster;     // First cluster of the directory, 0 if unused
+    uint32_t            offset;         // Offset of the index file's short entry, DIR_NO_SLOT if the directory has none
+    uint16_t            stamp;          // Last time the index file was used, for replacement
+    bool                valid;          // The keys match the directory, so lookups can use them
+    bool                checked;        // The directory matches the keys, so a name they do not have is not in it
+    IndexHeader         header;
+    FILE                file;           // Index file, with its cluster positions cached
+
+} IndexFile;
+
+IndexFile IndexFiles[INDEX_FILES];
+uint16_t IndexFileClock;                // Incremented on each use of an index file
+
+
+//
+// Position within a directory being read. Each directory sector is read once into buf
+// and its entries are decoded from there
+//
+typedef struct DIR_t {
+
+    FILE                *dir;           // Directory being read
+    uint32_t            offset;         // Offset of the next entry to read
+    uint32_t            bufOffset;      // Directory offset of the sector in buf, DIR_NO_SECTOR if none
+    Block               buf;            // Directory sector being read
+
+} DIR;
+
+
+//
+// File read from a directory by FSDirNext
+//
+typedef struct DirRecord_t {
+
+    char                name[NAME_BUF_LEN];     // Long name, or the short name if there is none
+    char                shortName[13];          // Short name, as NAME.EXT
+    uint8_t             attr;           // File attributes
+    uint32_t            size;           // File size in bytes
+    uint32_t            cluster;        // First cluster of the file
+    uint32_t            offset;         // Offset of the file's short entry in the directory
+
+} DirRecord;
+
+
+//
+// File to create with FSCreateFiles
+//
+typedef struct FileSpec_t {
+
+    char                *name;          // Name of the file
+    uint8_t             attr;           // File attributes, not ATTR_DIRECTORY
+    uint32_t            size;           // Bytes to allocate to the file
+    uint16_t            hash;           // Set by FSCreateFiles, hash of the name
+    uint32_t            cluster;        // Set by FSCreateFiles, first cluster of the file (0 if none)
+    char                shortName[11];  // Set by FSCreateFiles, short name of the file
+    uint16_t            tails;          // Used by FSCreateFiles, short name tails which are taken
+
+} FileSpec;
+
+
 
 //
 //  Exit Status Codes
@@ -308,7 +645,9 @@ typedef enum {
     EXIT_INVALID_PARAMETER,     // Invalid parameter passed
     EXIT_FAIL,                  // Unknown failure
     EXIT_INVALID_TIME,          // Date/Time is invalid
-    EXIT_NOT_EXIST              // Struct does not exist
+    EXIT_NOT_EXIST,             // Struct does not exist
+    EXIT_INCOMPLETE,            // Work was stopped early and can be continued
+    EXIT_ALREADY_EXIST          // A file with the name already exists
 
 } EXIT_STATUS;
 
@@ -317,42 +656,160 @@ typedef enum {
 ///////////////////  FAT32 HELPER FUNCTIONS /////////////////////////////
 
 /*
-    Check if a string is compliant with a long directory entry.
+    Fold a name character so that names are compared without case. ASCII
+    characters are looked up in FoldTable.
 
-    @param      IN  name            File/directory name
-    @param      IN  len             Length of name
-    @param      OUT new             File/directory to be returned
+    @param      c               Character
 
-    @retval     TRUE                File and name are matching
-    @retval     FALSE               File and name do not match
+    @return     Folded character
 */
-bool fat32IsValidLongEntry(char *name, uint16_t len, FILE *file);
+char fat32FoldChar(char c);
 
 
 /*
-    Check if a string is compliant with a short directory entry.
+    Compare two names without case.
 
-    @param      IN  name            File/directory name
-    @param      IN  len             Length of name
-    @param      OUT new             File/directory to be returned
+    @param      IN  a               Name
+    @param      IN  b               Name
+
+    @retval     TRUE                Names match
+    @retval     FALSE               Names do not match
+*/
+bool fat32NameMatch(char *a, char *b);
+
+
+/*
+    Hash a case folded name (FNV-1a).
+
+    @param      IN  name            Name
+
+    @return     Hash of the name
+*/
+uint32_t fat32NameHash32(char *name);
+
+
+/*
+    Hash a case folded name (FNV-1a, folded to 16 bits).
+
+    @param      IN  name            Name
+
+    @return     Hash of the name
+*/
+uint16_t fat32NameHash(char *name);
+
+
+/*
+    Turn a short directory entry's name into a string, as NAME.EXT. Trailing spaces
+    are removed, and the lower case flags in DIR_NTRes are used.
+
+    @param      IN  entry           Short directory entry
+    @param      OUT name            Name, at least 13 bytes
+
+*/
+void fat32ShortName(DirEntry *entry, char *name);
+
+
+/*
+    Convert part of a long name (its base or extension) to short name characters.
+    Spaces and periods are left out, characters which cannot be in a short name
+    become '_', and letters are made upper case.
+
+    @param      IN  from            First character of the part
+    @param      IN  to              Character after the part
+    @param      OUT out             Where the characters go
+    @param      IN  max             Most characters to store
+    @param      IN/OUT flags        SHORT_NAME_FITS is cleared if the part was changed or cut short.
+                                    SHORT_NAME_MIXED is set if it has both cases, and lower is set
+                                    if it is all lower case
+    @param      IN  lower           DIR_NTRes bit for the part being in lower case
+
+    @return     Amount of characters stored
+*/
+uint8_t fat32ShortPart(char *from, char *to, char *out, uint8_t max, uint8_t *flags, uint8_t lower);
+
+
+/*
+    Make the basis of a short name from a long name: up to 8 characters before the
+    last period and 3 after it, converted with fat32ShortPart.
+
+    @param      IN  name            Long name
+    @param      OUT basis           11 character short name basis, padded with spaces
+
+    @return     SHORT_NAME_FITS if the basis is the long name unchanged, SHORT_NAME_MIXED,
+                and the DIR_NTRes lower case bits of the parts
+*/
+uint8_t fat32ShortBasis(char *name, char *basis);
+
+
+/*
+    Make the short name to use for a tail. Tails 1 to SHORT_NUM_TAILS are added to
+    the basis (BASIS~1). Later tails use the first two characters of the basis, the
+    hash of the long name in hex and ~1 to ~9 (BA1F2C~1), as Windows does once many
+    names share a basis.
+
+    @param      IN  basis           Short name basis
+    @param      IN  hash            Hash of the long name
+    @param      IN  tail            Tail, 1 to SHORT_TAILS
+    @param      OUT shortName       11 character short name
+
+*/
+void fat32ShortTail(char *basis, uint16_t hash, uint8_t tail, char *shortName);
+
+
+/*
+    Find the tail an existing short name has, if it is a short name basis with a tail.
+
+    @param      shortName       11 character short name in the directory
+    @param      basis           Short name basis
+    @param      hash            Hash of the long name the basis is for
+
+    @retval     1 to SHORT_TAILS    Tail of the short name
+    @retval     0                   Short name is not the basis with a tail
+*/
+uint8_t fat32ShortTailOf(char *shortName, char *basis, uint16_t hash);
+
+
+/*
+    Make the short name for a new file in a directory. A long name which fits is its
+    own short name. Otherwise the directory is read once to find which tails of the
+    basis are taken, and the first free one is used.
+
+    @param      IN  dir             Directory the file is created in
+    @param      IN  name            Long name of the file
+    @param      OUT shortName       11 character short name
+    @param      OUT flags           Flags from fat32ShortBasis
+
+    @retval     EXIT_SUCCESS        Short name was made
+    @retval     EXIT_ALREADY_EXIST  Every tail of the basis is taken
+*/
+EXIT_STATUS fat32MakeShortName(FILE *dir, char *name, char *shortName, uint8_t *flags);
+
+
+/*
+    Copy the 13 characters of a long directory entry into a name. Characters
+    outside of ASCII are replaced with '_'.
+
+    @param      IN  entry           Long directory entry
+    @param      OUT name            Where the characters go
 
-    @retval     TRUE                File and name are matching
-    @retval     FALSE               File and name do not match
 */
-bool fat32IsValidShortEntry(char *name, uint16_t len, FILE *file);
+void fat32LongNameChars(LongDirEntry *entry, char *name);
 
 
 /*
-    Check if a string matches a long directory entry
+    Compare the 13 characters of a long directory entry with the part of a name
+    they should hold, without case. The characters are gathered into one buffer
+    and compared until the first difference. Characters outside of ASCII match
+    '_', as fat32LongNameChars shows them.
 
-    @param      IN  file            File/directory entry
-    @param      IN  str             ASCII Name to compare
-    @param      IN  len             Length of string
+    @param      entry           Long directory entry
+    @param      part            Part of the name the entry should hold
+    @param      remain          Characters left in the name from part
 
-    @retval     0                   Match
-    @retval     1                   No Match
+    @retval     TRUE            Entry holds that part of the name
+    @retval     FALSE           Entry holds something else
 */
-uint8_t fat32StrCmp(char *str, uint16_t len, FILE *file);
+bool fat32LongNameMatch(LongDirEntry *entry, char *part, uint16_t remain);
 
 /*
     Read from a cluster and put it in a buffer.
@@ -412,144 +869,1213 @@ EXIT_STATUS fat32FileToDisk(FILE *file);
 
 
 /*
-    Get the first cluster of the directory that a file is in.
-
-    @param      file            File to write back to disk
+    Check that the dates and times of a FileTime can be stored in a directory entry.
 
-    @retval    EXIT_SUCCUSS     Succussful
-    @retval    EXIT_WRITE_FAIL  Disk write failed.
+    @param      time                Time to check
 
+    @return     EXIT_SUCCUSS            Time is valid
+    @return     EXIT_INVALID_TIME       Time is not valid
 */
-uint32_t fat32GetDirCluster(FILE *file);
-
-///////////////////  FILE SYSTEM FUNCTIONS //////////////////////////////
-
+EXIT_STATUS fat32CheckTime(FileTime *time);
 
 
 /*
-    Allocate a new cluster to the end of a file
+    Set the creation, write and last access dates and times of a short directory entry.
 
-    @param      from                File End Of Cluster file, or zero, if there is not a cluster allocated
-    for a file.
-    @param      args                Hardware Initilization arguments. Varies based on implementation
+    @param      entry               Short directory entry
+    @param      time                Time to set. It must have been checked with fat32CheckTime
+*/
+void fat32SetTime(DirEntry *entry, FileTime *time);
 
-    @retval    > 0                      New Cluster Number
-    @retval    0                        Fail   
 
-*/
-uint32_t FSAllocateCluster(uint32_t from);
+/*
+    Set a DIR to read a directory from its first entry.
 
+    @param      dir             Directory to read
+    @param      it              DIR to set
+*/
+void fat32DirStart(FILE *dir, DIR *it);
 
 
 /*
-    Update a FAT table entry with a given status
-
-    @param      cluster     Cluster which is to have FAT value updated
-    @param      status      New FAT table entry. The first four bits will be unchanged
+    Tell the device a directory is about to be read from a sector of one of its
+    clusters up to the end of the next cluster, if the next cluster follows it on
+    the device. Finding the next cluster here also means the FAT is not read in the
+    middle of the run.
 
-    @retval     EXIT_SUCCUSS            On Success
-    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
-    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+    @param      dir             Directory being read
+    @param      index           Cluster index within the directory
+    @param      cluster         Cluster being read
+    @param      sector          First sector within the cluster to be read
 
 */
-EXIT_STATUS FSFatTableUpdate(uint32_t cluster, uint32_t status);
+void fat32DirPrefetch(FILE *dir, uint32_t index, uint32_t cluster, uint32_t sector);
 
 
 /*
-    Get the first physcial sector of a cluster given the cluster
-
-    @param      cluster     Cluster which is to have FAT value updated
-    @param      status      New FAT table entry. The first four bits will be unchanged
+    Get the directory entry at a directory's read offset. The sector holding it is
+    read into the DIR if it is not already there. Whole sectors are read straight
+    from the device, and the entries in them are decoded in place.
 
-    @retval     sector number       On Success
-    @retval     0                   Fail - Not valid cluster                       
+    @param      it              Directory being read
 
+    @retval     != NULL         Directory entry
+    @retval     NULL            Offset is past the end of the directory's clusters
 */
-uint32_t FSGetSector(uint32_t cluster);
+FileEntry *fat32DirEntry(DIR *it);
 
 
 /*
-    Get the cluster that a physical sector is in. It is possible to get a cluster
-    value equal to MAX_CLUSTER because of the final incomplete cluster on a partition.
-
-    @param      cluster     Cluster which is to have FAT value updated
-    @param      status      New FAT table entry. The first four bits will be unchanged
+    Read the next file of a directory. Free entries, volume labels and long entries
+    which do not belong to the short entry after them are skipped.
+
+    @param      IN  it              Directory being read. Its offset is where reading starts, and
+                                    is set to the offset after the short entry, or of the end of
+                                    the directory
+    @param      OUT entry           Short entry of the file
+    @param      OUT start           Offset of the file's first entry (its first long entry, if it has any)
+    @param      OUT name            Long name of the file, or its short name if it has none.
+                                    NAME_BUF_LEN bytes
+
+    @retval     EXIT_SUCCESS        A file was read
+    @retval     EXIT_NOT_FOUND      The end of the directory was reached
+*/
+EXIT_STATUS fat32DirRead(DIR *it, FileEntry *entry, uint32_t *start, char *name);
 
-    @retval     cluster number    On Success
-    @retval     0                 Fail - Sector not in partition data area                       
 
+/*
+    Find a file by name in a directory. Long entries are compared with the part of
+    the name they hold as they are read, so long names are never put together. A
+    file is passed over as soon as its long entry count shows its name has another
+    length, or one of its long entries differs. The short entry checksum is only
+    worked out for a file whose long entries all matched. Short names are compared
+    with the 8.3 form of the name, if it has one.
+
+    @param      IN  it              Directory being read. Its offset is where reading starts,
+                                    and is set to the offset after the short entry found
+    @param      IN  name            Name to find, compared without case
+    @param      OUT entry           Short entry of the file
+    @param      OUT start           Offset of the file's first entry (its first long entry, if it has any)
+
+    @retval     EXIT_SUCCESS        File was found
+    @retval     EXIT_NOT_FOUND      The end of the directory was reached
 */
-uint32_t FSGetCluster(uint32_t sector);
+EXIT_STATUS fat32DirFind(DIR *it, char *name, FileEntry *entry, uint32_t *start);
 
 
 /*
-    Get a value in the FAT table given a cluster entry
+    Insert a name into a directory index, unless the index is too full.
 
-    @param      cluster     Cluster which is to have FAT value updated
-
-    @retval     0           Fail or invalid
-    @retval     > 0         Sector number in table                       
+    @param      index           Directory index
+    @param      name            Name of the file
+    @param      start           Offset of the file's first directory entry
 
+    @retval     TRUE            Name was inserted
+    @retval     FALSE           Index is too full
 */
-uint32_t FSGetFatTableEntry(uint32_t cluster);
+bool fat32DirIndexInsert(DirIndex *index, char *name, uint32_t start);
 
 
 /*
-    Search a directory for a file name and return it if found.
+    Get the index of a directory. If the directory is not indexed, it is read and
+    indexed, replacing the least recently used index. An index holds about
+    DIR_INDEX_SLOTS * 3/8 files, so only the first files of a larger directory are
+    indexed, up to the index's end. The rest of the directory is not read.
 
-    @param      IN  name            File/directory to search for
-    @param      IN  directory       Directory which is to be searched
-    @param      OUT new             File/directory to be returned
+    @param      dir             Directory
 
-    @retval     EXIT_SUCCESS            Directory succussfully found
-    @retval     EXIT_NOT_FOUND          Directory not found
-    @retval     EXIT_INVALID_PARAMETER  Device Error
-    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table driver failed
+    @retval     != NULL         Index of the directory
+    @retval     NULL            Directory could not be indexed
 */
-EXIT_STATUS FSDirectorySearch(char *name, FILE *directory, FILE *new);
-
+DirIndex *fat32DirIndexGet(FILE *dir);
 
 
 /*
-    Initializes the drive and memory table for which the hardware driver is configured.
+    Add a new file to the index of its directory, if the directory is indexed. A file
+    after the end of a partial index is not added, as lookups read that part of the
+    directory. If the index is too full for the file, the index is dropped and built
+    again by the next lookup.
 
-    @param      partition       Physical MBR partition number which is to be formatted with 
-    corresponding flags (usually 0)
-    @param      args            Hardware Init. arguments. Varies based on implementation
+    @param      dir             Directory the file is in
+    @param      name            Long name of the file, or NULL
+    @param      entry           Short entry of the file
+    @param      start           Offset of the file's first directory entry
 
-    @retval     EXIT_SUCCESS            Succuss
-    @retval     EXIT_HARDWARE_FAIL      Hardware Driver Failed
-    @retval     EXIT_INCORRECT_FORMAT   Partition was not formatted because its not FAT32
-    @retval     EXIT_ALREADY_INIT       Drive is already initilized
-    @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
-    @retval     EXIT_READ_FAIL          Device Read Failed
-    @retval     EXIT_WRITE_FAIL         Device Write Failed
-    @retval     EXIT_INVALID_DEVICE     Device is unrecognizable
-    @retval     Others                  Fail
 */
-EXIT_STATUS FSInit(uint8_t partition, void *args);
+void fat32DirIndexAdd(FILE *dir, char *name, FileEntry *entry, uint32_t start);
 
 
 /*
-    Eject a FAT32 File System. This method should be called to ensure that all
-    sectors are written back to the device and that hardware is deinitilized
-
-    @param      args            Hardware eject arguments. Varies based on implementation
+    Remove a file from the index of its directory, if the directory is indexed.
 
-    @retval     EXIT_SUCCESS            Succuss
-    @retval     EXIT_HARDWARE_FAIL      Hardware Driver Failed
-    @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
-    @retval     Others                  Fail    
+    @param      dir             Directory the file was in
+    @param      start           Offset of the file's first directory entry
 
 */
-EXIT_STATUS FSEject(void *args);
+void fat32DirIndexRemove(FILE *dir, uint32_t start);
+
+
+/*
+    Record a run of removed entries in a directory's free entry hint. The run is
+    joined to the runs it borders on either side. Otherwise it takes an unused run, or replaces the
+    smallest run if it is larger. The hint is marked if a run is dropped.
+
+    @param      slots           Free entry hint of the directory
+    @param      entry           First removed entry (byte offset / 32)
+    @param      count           Amount of removed entries
+
+*/
+void fat32DirSlotsFree(DirSlots *slots, uint16_t entry, uint16_t count);
+
+
+/*
+    Get the free entry hint of a directory. If the directory does not have one, the
+    least recently used hint is replaced and the directory is read once to find its
+    end marker and runs of removed entries.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Free entry hint of the directory
+    @retval     NULL            Directory has no clusters
+
+*/
+DirSlots *fat32DirSlotsGet(FILE *dir);
+
+
+/*
+    Fill a cluster of a directory with end markers. A cluster past the end of the
+    directory's chain is allocated.
+
+    @param      dir             Directory
+    @param      index           Cluster index within the directory
+
+    @retval     EXIT_SUCCESS        Cluster was cleared
+    @retval     EXIT_WRITE_FAIL     Cluster could not be allocated or written
+
+*/
+EXIT_STATUS fat32DirClear(FILE *dir, uint32_t index);
+
+
+/*
+    Find free entries in a directory for a new file. The smallest run of removed
+    entries which is large enough is used. If none is and some runs were dropped
+    from the hint, the directory is read again to find them. Otherwise the entries
+    are placed at the end marker and the directory is grown if it is full.
+
+    @param      dir             Directory
+    @param      count           Amount of entries needed
+
+    @retval     != DIR_NO_SLOT  Offset of the first entry
+    @retval     DIR_NO_SLOT     The directory is full or could not be grown
+
+*/
+uint32_t fat32DirTakeSlots(FILE *dir, uint32_t count);
+
+
+/*
+    Record entries of a removed file in the free entry hint of its directory, if
+    the directory has one.
+
+    @param      dir             Directory the file was in
+    @param      start           Offset of the file's first entry
+    @param      count           Amount of entries the file had
+
+*/
+void fat32DirSlotsRelease(FILE *dir, uint32_t start, uint16_t count);
+
+
+/*
+    Write the entries of a directory sector being filled which were not written.
+
+    @param      dir             Directory
+    @param      buf             Sector being filled
+    @param      pos             Offset after the last entry added
+    @param      from            Offset of the first entry in buf which was not written. Set to pos
+
+    @retval     EXIT_SUCCESS        Entries were written
+    @retval     EXIT_WRITE_FAIL     Sector could not be written
+
+*/
+EXIT_STATUS fat32DirFlush(FILE *dir, Block *buf, uint32_t pos, uint32_t *from);
+
+
+/*
+    Add an entry to a directory sector being filled. The sector is written once it
+    is full, so a run of new entries is written a sector at a time.
+
+    @param      dir             Directory
+    @param      buf             Sector being filled
+    @param      pos             Offset of the entry. Set to the offset of the next entry
+    @param      from            Offset of the first entry in buf which was not written
+    @param      entry           Entry to add
+
+    @retval     EXIT_SUCCESS        Entry was added
+    @retval     EXIT_WRITE_FAIL     Sector could not be written
+
+*/
+EXIT_STATUS fat32DirPut(FILE *dir, Block *buf, uint32_t *pos, uint32_t *from, FileEntry *entry);
+
+
+/*
+    Fill entries of a directory with an empty entry, through a directory sector
+    being filled. The entries filled are written before returning.
+
+    @param      dir             Directory
+    @param      buf             Sector being filled
+    @param      pos             Offset of the first entry to fill. Set to end
+    @param      from            Offset of the first entry in buf which was not written
+    @param      end             Offset after the last entry to fill
+    @param      mark            First byte of the entries, FREE_ENTRY or REST_FREE_ENTRY
+
+    @retval     EXIT_SUCCESS        Entries were written
+    @retval     EXIT_WRITE_FAIL     Sector could not be written
+
+*/
+EXIT_STATUS fat32DirFill(FILE *dir, Block *buf, uint32_t *pos, uint32_t *from, uint32_t end, uint8_t mark);
+
+
+/*
+    Find the remembered result of looking up a name in a directory.
+
+    @param      parent          First cluster of the directory
+    @param      name            Name looked up
+
+    @retval     != NULL         Remembered result
+    @retval     NULL            Name was not remembered
+*/
+Dentry *fat32DentryFind(uint32_t parent, char *name);
+
+
+/*
+    Remember the result of looking up a name in a directory, replacing the least
+    recently used result. Names longer than DENTRY_NAME_LEN are not remembered.
+
+    @param      parent          First cluster of the directory
+    @param      name            Name looked up
+    @param      offset          Offset of the file's short entry, DENTRY_NEGATIVE if not found
+
+*/
+void fat32DentryStore(uint32_t parent, char *name, uint32_t offset);
+
+
+/*
+    Forget every remembered result for a directory. Called when files are added
+    to or removed from it.
+
+    @param      parent          First cluster of the directory
+
+*/
+void fat32DentryDrop(uint32_t parent);
+
+
+/*
+    Check that a remembered short entry still belongs to the file it was remembered
+    for. The file's long entries are walked back to its first entry, then the file
+    is read again. It must end at the remembered short entry and have the name
+    looked up, as its long or short name.
+
+    @param      IN  dir             Directory the file is in
+    @param      IN  offset          Remembered offset of the file's short entry
+    @param      IN  name            Name the file was looked up by
+    @param      OUT entry           Short entry of the file
+
+    @retval     TRUE                The entry is the file looked up
+    @retval     FALSE               The entry was removed or is another file
+
+*/
+bool fat32DentryCheck(FILE *dir, uint32_t offset, char *name, FileEntry *entry);
+
+
+/*
+    Drop the index, free entry hint and remembered lookups of a directory, after
+    entries in it were moved or the directory was removed.
+
+    @param      cluster         First cluster of the directory
+
+*/
+void fat32DirForget(uint32_t cluster);
+
+
+/*
+    Read the first sector of a directory, finding its index file and which of the
+    sector's entries are free.
+
+    @param      IN  dir             Directory
+    @param      OUT freeMap         Free entries in the sector, one bit each
+
+    @retval     != DIR_NO_SLOT      Offset of the index file's short entry
+    @retval     DIR_NO_SLOT         The first sector has no index file
+*/
+uint32_t fat32IndexFileFind(FILE *dir, uint16_t *freeMap);
+
+
+/*
+    Forget the index file of a directory, so it is read again when next used.
+
+    @param      cluster         First cluster of the directory
+
+*/
+void fat32IndexFileDrop(uint32_t cluster);
+
+
+/*
+    Get the index file of a directory. If it is not remembered, the directory's first
+    sector and the index file's header are read, replacing the least recently used
+    index file. The keys are valid if they were built for the header's generation,
+    the free entries of the first sector have not changed, and nothing was added
+    after the end the directory had when they were built.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Index file of the directory
+    @retval     NULL            The directory has no index file
+*/
+IndexFile *fat32IndexFileLoad(FILE *dir);
+
+
+/*
+    Mark the keys of a directory's index file stale before the directory is changed,
+    by moving the header's generation past the one the keys were built for. The
+    header is only written the first time. The directory must not be changed if the
+    header could not be written.
+
+    @param      dir             Directory about to be changed
+
+    @retval     EXIT_SUCCESS        Keys are stale, or the directory has no index file
+    @retval     EXIT_WRITE_FAIL     Header could not be written
+
+*/
+EXIT_STATUS fat32IndexFileStale(FILE *dir);
+
+
+/*
+    Sort the keys of an index file node by hash. Nodes are small, so an insertion
+    sort is used.
+
+    @param      keys            Keys to sort
+    @param      count           Amount of keys
+
+*/
+void fat32IndexSort(IndexKey *keys, uint16_t count);
+
+
+/*
+    Sort and write the leaf being filled while an index file is built. Leaves are
+    written from the index file's second sector on.
+
+    @param      idx             Index file
+    @param      buf             Leaf being filled
+    @param      keys            Keys added so far, the last of which is in buf
+
+    @retval     EXIT_SUCCESS        Leaf was written
+    @retval     EXIT_WRITE_FAIL     Leaf could not be written
+
+*/
+EXIT_STATUS fat32IndexWriteLeaf(FILE *idx, Block *buf, uint32_t keys);
+
+
+/*
+    Add a key to the leaf being filled while an index file is built. A full leaf is
+    sorted and written, so the leaves start as sorted runs of one sector.
+
+    @param      idx             Index file
+    @param      buf             Leaf being filled
+    @param      keys            Keys added so far. Incremented
+    @param      name            Name of the file
+    @param      entry           First directory entry of the file (byte offset / 32)
+
+    @retval     EXIT_SUCCESS        Key was added
+    @retval     EXIT_WRITE_FAIL     Leaf could not be written
+
+*/
+EXIT_STATUS fat32IndexAddKey(FILE *idx, Block *buf, uint32_t *keys, char *name, uint32_t entry);
+
+
+/*
+    Read a directory and write the keys of its files to an index file as sorted
+    leaves. A file with a long name gets a key for its long name and one for its
+    short name. There is always at least one leaf, even if it has no keys.
+
+    @param      IN  idx             Index file
+    @param      IN  dir             Directory
+    @param      OUT keys            Amount of keys
+    @param      OUT end             Offset of the end of the directory
+
+    @retval     EXIT_SUCCESS        Keys were written
+    @retval     EXIT_WRITE_FAIL     A leaf could not be written
+*/
+EXIT_STATUS fat32IndexRuns(FILE *idx, FILE *dir, uint32_t *keys, uint32_t *end);
+
+
+/*
+    Sum the names in a directory up to an offset, so another OS changing, removing or
+    adding a file there is noticed. Long entries are summed whole, short entries up to
+    their attributes, as sizes, dates and clusters change without a file being renamed.
+
+    @param      IN  dir             Directory
+    @param      IN  end             Offset after the last entry to sum
+    @param      IN  skip            Offset of an entry which is not summed, the index file's
+    @param      OUT sum             Sum of the entries
+
+    @retval     EXIT_SUCCESS        Entries were summed
+    @retval     EXIT_READ_FAIL      Directory could not be read
+*/
+EXIT_STATUS fat32IndexDirSum(FILE *dir, uint32_t end, uint32_t skip, uint32_t *sum);
+
+
+/*
+    Merge pairs of sorted runs of an index file's leaves into runs twice as long,
+    from one area of the file to another. Every leaf but the last is full, so each
+    run starts at the start of a leaf.
+
+    @param      idx             Index file
+    @param      from            Sector of the first leaf to read
+    @param      to              Sector of the first leaf to write
+    @param      keys            Keys in the leaves
+    @param      width           Leaves in each run read
+
+    @retval     EXIT_SUCCESS        Runs were merged
+    @retval     EXIT_READ_FAIL      A leaf could not be read
+    @retval     EXIT_WRITE_FAIL     A leaf could not be written
+
+*/
+EXIT_STATUS fat32IndexMerge(FILE *idx, uint32_t from, uint32_t to, uint32_t keys, uint32_t width);
+
+
+/*
+    Write the level of an index file's nodes above a level. Each node holds the first
+    hash and the sector of up to INDEX_KEYS nodes of the level below.
+
+    @param      idx             Index file
+    @param      children        Sector of the first node of the level below
+    @param      count           Nodes in the level below
+    @param      parent          Sector of the first node to write
+    @param      level           Level of the nodes written
+
+    @retval     EXIT_SUCCESS        Level was written
+    @retval     EXIT_READ_FAIL      A node could not be read
+    @retval     EXIT_WRITE_FAIL     A node could not be written
+
+*/
+EXIT_STATUS fat32IndexLevel(FILE *idx, uint32_t children, uint32_t count, uint32_t parent, uint16_t level);
+
+
+/*
+    Write the keys of a directory's index file. The file's old clusters are freed
+    and the keys are written to new ones: the leaves as sorted runs, merged until
+    they are one run, then the levels of nodes above them. The header is written
+    last, so a write which is stopped leaves keys which are not used.
+
+    @param      index           Index file, whose entry is written through dir
+    @param      dir             Directory the index file is in
+
+    @retval     EXIT_SUCCESS        Keys were written
+    @retval     others              Index file could not be written
+
+*/
+EXIT_STATUS fat32IndexWrite(IndexFile *index, FILE *dir);
+
+
+/*
+    Build the keys of a directory's index file (see fat32IndexWrite). The index file
+    is only linked to the directory while they are written, and its keys are used by
+    lookups if they were.
+
+    @param      index           Index file
+    @param      dir             Directory the index file is in
+
+    @retval     EXIT_SUCCESS        Keys were built
+    @retval     others              Index file could not be written
+
+*/
+EXIT_STATUS fat32IndexBuild(IndexFile *index, FILE *dir);
+
+
+/*
+    Get the index file of a directory for a lookup. Stale keys (the directory was
+    changed by another OS, or by this driver since they were built) are not used,
+    and are only built again by FSIndexDirectory.
+
+    @param      dir             Directory
+
+    @retval     != NULL         Index file with valid keys
+    @retval     NULL            The directory has no index file, or its keys are stale
+*/
+IndexFile *fat32IndexFileGet(FILE *dir);
+
+
+/*
+    Find a file by name through a directory's index file. The nodes are followed down
+    to the first leaf which can have the name's hash, and each file with the hash is
+    read from the directory to compare its names.
+
+    @param      IN  index           Index file of the directory
+    @param      IN  name            Name to find, compared without case
+    @param      IN  it              Directory being read. Set to the offset after the short entry found
+    @param      OUT entry           Short entry of the file
+    @param      OUT entryName       Long name of the file, or its short name if it has none.
+                                    NAME_BUF_LEN bytes
+
+    @retval     EXIT_SUCCESS        File was found
+    @retval     EXIT_NOT_FOUND      File is not in the directory
+    @retval     EXIT_READ_FAIL      A node could not be read
+*/
+EXIT_STATUS fat32IndexFileSearch(IndexFile *index, char *name, DIR *it, FileEntry *entry, char *entryName);
+
+
+/*
+    Check that a directory still matches the keys of its index file, so a name they
+    do not have is not in the directory. Another OS can have removed or renamed files
+    anywhere in it, so the directory is read and summed up to the end it had when the
+    keys were built. This is done once per index file read, the first time a name is
+    not found in the keys; keys which do not match are stale.
+
+    @param      index           Index file with valid keys
+    @param      dir             Directory the index file is in
+
+    @retval     TRUE            The directory matches the keys
+    @retval     FALSE           The directory does not match the keys, or could not be read
+*/
+bool fat32IndexFileCheck(IndexFile *index, FILE *dir);
+
+
+/*
+    Add an empty index file to a directory, in its first sector. If the sector has no
+    free entry, the first file in it is moved to the end of the directory.
+
+    @param      dir                 Directory
+    @param      open                Files open in the directory, may be NULL if openCount is 0
+    @param      openCount           Amount of files in open
+
+    @retval     EXIT_SUCCESS        Index file was added
+    @retval     EXIT_FAIL           No file could be moved out of the first sector
+    @retval     EXIT_READ_FAIL      Directory could not be read
+    @retval     EXIT_WRITE_FAIL     Directory could not be written
+
+*/
+EXIT_STATUS fat32IndexFileCreate(FILE *dir, FILE **open, uint8_t openCount);
+
+
+/*
+    Open a file in a directory, using the remembered result of an earlier lookup
+    if there is one and its entry still holds the file. The result is remembered,
+    even if the file was not found.
+
+    @param      IN  name            Name of the file
+    @param      IN  dir             Directory to search
+    @param      OUT file            File which was found
+
+    @retval     EXIT_SUCCESS        File was found
+    @retval     EXIT_NOT_FOUND      File is not in the directory
+    @retval     others              Search failed
+*/
+EXIT_STATUS fat32Lookup(char *name, FILE *dir, FILE *file);
+
+
+/*
+    Find the first free entry in a sector of the FAT. Entries are checked four
+    at a time, and groups where every entry is in use are skipped.
+
+    @param      buf             FAT sector contents
+    @param      from            First entry to check
+    @param      to              Entry to stop at (not checked)
+
+    @retval     < to            Index of the first free entry
+    @retval     to              No free entry was found
+
+*/
+uint16_t fat32FindFreeEntry(Block *buf, uint16_t from, uint16_t to);
+
+
+/*
+    Count the free entries in a sector of the FAT. Entries are counted four at a time.
+
+    @param      buf             FAT sector contents
+    @param      from            First entry to count
+    @param      to              Entry to stop at (not counted)
+
+    @return     Amount of free entries
+
+*/
+uint16_t fat32CountFreeEntries(Block *buf, uint16_t from, uint16_t to);
+
+
+/*
+    Build the free cluster map from the FAT, and optionally verify the free cluster
+    count. If counting, the whole FAT is read a sector at a time and FSI_Free_Count
+    is corrected if it does not match the amount of free clusters found, and full
+    FAT sectors past the map are marked in the map of full FAT sectors. Otherwise
+    only the FAT sectors covered by the map are read. Called when a partition is mounted.
+
+    @param      count           TRUE to count every free cluster in the FAT
+
+    @retval    EXIT_SUCCUSS     Succussful
+    @retval    EXIT_READ_FAIL   FAT could not be read
+
+*/
+EXIT_STATUS fat32BuildFreeMap(bool count);
+
+
+/*
+    Write data to a sector through the memory table and straight to the device, then
+    wait until the device has stored it. Sectors written back later by the memory
+    table can then not reach the device before it.
+
+    @param      data            Data to write
+    @param      sector          Device sector to write to
+    @param      offset          Byte offset in the sector
+    @param      len             Amount of bytes to write, not past the end of the sector
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+    @retval     EXIT_WRITE_FAIL         Device write failed
+    @retval     EXIT_HARDWARE_FAIL      Device did not store the write
+
+*/
+EXIT_STATUS fat32WriteThrough(uint8_t *data, uint32_t sector, uint32_t offset, uint32_t len);
+
+
+/*
+    Set or clear the dirty state of the volume. The clean shutdown bit of FAT[1]
+    is cleared on the first write after a mount, and set again on eject. The FAT
+    entry is only written if the state changes, and is written through to the
+    device, so the volume is marked dirty on the device before anything else
+    changed reaches it.
+
+    @param      dirty           TRUE to mark the volume dirty, FALSE to mark it clean
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table or device write failed
+
+*/
+EXIT_STATUS fat32SetDirty(bool dirty);
+
+
+/*
+    Write the free cluster count and next free cluster hint to the FSInfo sector.
+    The sector is only written if they have changed.
+
+    @retval    EXIT_SUCCUSS             Succussful
+    @retval    EXIT_READ_FAIL           FSInfo sector could not be read
+    @retval    EXIT_WRITE_FAIL          FSInfo sector could not be written
+
+*/
+EXIT_STATUS fat32WriteFSInfo();
+
+
+/*
+    Get the bit of a cluster's FAT sector in the map of full FAT sectors.
+
+    @param      cluster         Cluster past the free cluster map
+
+    @retval     < FULL_MAP_SECTORS  Bit of the cluster's FAT sector
+    @retval     FULL_MAP_SECTORS    The cluster's FAT sector is not in the map
+
+*/
+uint32_t fat32FullMapBit(uint32_t cluster);
+
+
+/*
+    Update the free cluster map for a cluster given its new FAT table entry.
+    For clusters past the map, a freed cluster clears its FAT sector's bit in the
+    map of full FAT sectors.
+
+    @param      cluster         Cluster which had its FAT entry updated
+    @param      status          New FAT table entry
+
+*/
+void fat32FreeMapSet(uint32_t cluster, uint32_t status);
+
+
+/*
+    Find a free cluster, starting the search at a given cluster and wrapping
+    around to cluster 2. The free cluster map is searched a word at a time, and
+    clusters beyond the map are searched in the FAT, skipping the FAT sectors known
+    to be full. A FAT sector found to be full is marked as such.
+
+    @param      start           Cluster to start searching at
+
+    @retval     > 0             Free cluster number
+    @retval     0               No free cluster
+
+*/
+uint32_t fat32FindFreeCluster(uint32_t start);
+
+
+/*
+    Check if a cluster is free, using the free cluster map if the cluster is in it,
+    or the map of full FAT sectors if its FAT sector is known to be full.
+
+    @param      cluster         Cluster to check
+
+    @retval     TRUE            Cluster is free
+    @retval     FALSE           Cluster is in use or invalid
+
+*/
+bool fat32IsFreeCluster(uint32_t cluster);
+
+
+/*
+    Check if a cluster is in the headroom kept for a file other than owner.
+
+    @param      cluster         Cluster to check
+    @param      owner           First cluster of the file which can use its own headroom, or 0
+
+    @retval     > 0             Cluster after the end of the headroom the cluster is in
+    @retval     0               Cluster is not in another file's headroom
+
+*/
+uint32_t fat32HeadroomEnd(uint32_t cluster, uint32_t owner);
+
+
+/*
+    Keep headroom for a file after the end of its chain. The file's slot is reused
+    if it has one, otherwise a free slot or the oldest slot is taken. Files are
+    known by their first cluster, so a file which is never closed holds a slot
+    only until it is the oldest.
+
+    @param      owner           First cluster of the file being written
+    @param      cluster         Cluster after the file's last cluster
+
+*/
+void fat32KeepHeadroom(uint32_t owner, uint32_t cluster);
+
+
+/*
+    Release the headroom kept for a file. Called when the file is closed or removed.
+
+    @param      owner           First cluster of the file to release headroom for, or 0
+
+*/
+void fat32ReleaseHeadroom(uint32_t owner);
+
+
+/*
+    Find where to start looking for the first clusters of a file. Files are placed
+    in the allocation group of their parent directory, near the directory itself.
+    New directories are placed in the group after their parent's group, so the
+    files of different directories are kept apart.
+
+    @param      file            File (or directory) without clusters. Its dir must be set
+
+    @return     Cluster to start searching at
+
+*/
+uint32_t fat32GroupGoal(FILE *file);
+
+
+/*
+    Find a run of free clusters. The first run of count clusters at or after start
+    is used (wrapping around to cluster 2). If there is no run that long, the
+    longest run found is used, once the whole volume or ALLOC_SEARCH_RUNS runs
+    have been looked at. Headroom kept for files other than owner can be skipped.
+
+    @param      IN  start           Cluster to start searching at
+    @param      IN  count           Amount of clusters wanted
+    @param      OUT first           First cluster of the run found
+    @param      IN  owner           First cluster of the file the run is for, or 0
+    @param      IN  keepHeadroom    TRUE to skip headroom kept for other files
+
+    @retval     > 0                 Length of the run found, at most count
+    @retval     0                   No free cluster
+
+*/
+uint32_t fat32FindFreeRun(uint32_t start, uint32_t count, uint32_t *first, uint32_t owner, bool keepHeadroom);
+
+
+/*
+    Get the amount of FAT tables which are written on each FAT change, and record
+    the changed FAT sector if only the first FAT is written.
+
+    @param      index               Sector within the FAT being changed
+
+    @return     Amount of FAT tables to write, starting at the first
+
+*/
+uint8_t fat32FatCopies(uint32_t index);
+
+
+/*
+    Copy a range of sectors of the active FAT to the other FAT tables, a sector at
+    a time through one sector buffer. The range of each copy is hinted as one run,
+    so the device can prepare all of it. A device which ends a run of writes when
+    it is read from writes the rest of the run a sector at a time.
+
+    @param      first               First sector within the FAT to copy
+    @param      last                Last sector within the FAT to copy
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          Active FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32SyncFatCopies(uint32_t first, uint32_t last);
+
+
+/*
+    Bring the FAT copies up to date with the FAT sectors changed while mirroring is
+    disabled. Does nothing if mirroring is enabled.
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          Active FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32FlushFatCopies();
+
+
+/*
+    Write a sector of the FAT to every FAT table (or only the first, if mirroring
+    is disabled).
+
+    @param      index               Sector number within the FAT
+    @param      buf                 Sector contents
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32WriteFatSector(uint32_t index, Block *buf);
+
+
+/*
+    Link a run of contiguous clusters into a chain, each cluster pointing to the
+    next and the last pointing to tail. Each FAT sector touched is read and written
+    once instead of once per entry.
+
+    @param      first               First cluster of the run
+    @param      count               Amount of clusters in the run
+    @param      tail                FAT entry for the last cluster (FAT_EOC or the next cluster)
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_READ_FAIL          FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32LinkRun(uint32_t first, uint32_t count, uint32_t tail);
+
+
+/*
+    Free a cluster chain. The chain is walked and its entries are grouped by FAT
+    sector, so each FAT sector is read once and rewritten once per FAT table for
+    each stretch of the chain within it, instead of once per cluster. The free
+    count and free cluster map are updated with the clusters freed.
+
+    @param      cluster         First cluster of the chain
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
+    @retval     EXIT_READ_FAIL          FAT could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS fat32FreeChain(uint32_t cluster);
+
+
+/*
+    Move a cluster of a file to a free cluster. The data is copied, the new cluster
+    takes the old cluster's place in the chain and the old cluster is freed. The
+    chain is valid after each step, so a move can be interrupted safely.
+
+    @param      file            File the cluster belongs to
+    @param      prev            Cluster before cluster in the chain, 0 if it is the first cluster
+    @param      cluster         Cluster to move
+    @param      to              Free cluster to move it to
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
+    @retval     EXIT_READ_FAIL          Cluster could not be read
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+    @retval     EXIT_WRITE_FAIL         Directory entry could not be written
+
+*/
+EXIT_STATUS fat32MoveCluster(FILE *file, uint32_t prev, uint32_t cluster, uint32_t to);
+
+
+/*
+    Get the first cluster of the directory that a file is in.
+
+    @param      file            File to write back to disk
+
+    @retval    EXIT_SUCCUSS     Succussful
+    @retval    EXIT_WRITE_FAIL  Disk write failed.
+
+*/
+uint32_t fat32GetDirCluster(FILE *file);
+
+
+/*
+    Get the first cluster of a file.
+
+    @param      file            File to get the first cluster of
+
+    @retval     > 0             First cluster
+    @retval     0               File has no clusters allocated
+
+*/
+uint32_t fat32GetFirstCluster(FILE *file);
+
+
+/*
+    Get the cluster after a given cluster in a file's chain. The file's extent cache
+    is used if it has the cluster, and is filled in when the FAT is read. If the chain
+    ends and count is not 0, an extent of up to count clusters is allocated and linked
+    to the end of the chain.
+
+    @param      IN  file            File the chain belongs to
+    @param      IN  index           Cluster index within the file of cluster
+    @param      IN  cluster         Current cluster in the chain
+    @param      IN  count           Clusters to allocate if the chain ends
+    @param      OUT allocated       Amount of clusters allocated, 0 if none were
+
+    @retval     > 0                 Next cluster
+    @retval     0                   End of chain or fail
+
+*/
+uint32_t fat32NextCluster(FILE *file, uint32_t index, uint32_t cluster, uint32_t count, uint32_t *allocated);
+
+
+/*
+    Clear the cached cluster positions of a file (extents, cursor and last cluster).
+    Called when a file is opened or its chain is replaced.
+
+    @param      file            File to clear
+
+*/
+void fat32ResetCache(FILE *file);
+
+
+/*
+    Look up a cluster of a file in its extent cache with a binary search. The
+    cache is cleared if it does not match the file's first cluster.
+
+    @param      file            File to look up
+    @param      index           Cluster index within the file
+
+    @retval     > 0             Cluster number
+    @retval     0               Cluster is not in the cache
+
+*/
+uint32_t fat32CachedCluster(FILE *file, uint32_t index);
+
+
+/*
+    Add a cluster of a file to its extent cache. Only the cluster right after the
+    cached part of the chain is added. It extends the last extent if it is
+    contiguous, or starts a new extent if there is room.
+
+    @param      file            File the cluster belongs to
+    @param      index           Cluster index within the file
+    @param      cluster         Cluster number
+
+*/
+void fat32CacheCluster(FILE *file, uint32_t index, uint32_t cluster);
+
+
+/*
+    Get the cluster at a cluster index within a file. Cached clusters are found
+    with a binary search, otherwise the chain is walked from the end of the cache
+    or from the file's cursor, whichever is further along.
+
+    @param      file            File to look up
+    @param      index           Cluster index within the file (offset / bytes per cluster)
+
+    @retval     > 0             Cluster number
+    @retval     0               File is not that long, or the chain is invalid
+
+*/
+uint32_t fat32ClusterAt(FILE *file, uint32_t index);
+
+
+/*
+    Add newly allocated clusters to the allocated length of a file, if it is known.
+
+    @param      file            File which had clusters allocated
+    @param      clusters        Amount of clusters allocated
+
+*/
+void fat32AddAllocated(FILE *file, uint32_t clusters);
+
+///////////////////  FILE SYSTEM FUNCTIONS //////////////////////////////
+
+
+
+/*
+    Allocate a new cluster to the end of a file. The search starts after from, so
+    a growing directory stays together.
+
+    @param      from                File End Of Cluster file, or zero, if there is not a cluster allocated
+    for a file.
+
+    @retval    > 0                      New Cluster Number
+    @retval    0                        Fail   
+
+*/
+uint32_t FSAllocateCluster(uint32_t from);
+
+
+/*
+    Allocate a contiguous extent of clusters to the end of a file. The extent is
+    linked into a chain in one pass over the FAT. If there is no run of free clusters
+    long enough, a shorter extent is allocated.
+    The search starts after from, or in the allocation group of the file's directory
+    if the file has no clusters. Headroom kept for other files being written is only
+    used if there is no other free cluster, and headroom is kept after the extent.
+
+    @param      IN  file                File the extent is for, or NULL
+    @param      IN  from                File End Of Cluster file, or zero, if there is not a cluster
+                                        allocated for a file.
+    @param      IN  count               Amount of clusters wanted
+    @param      OUT allocated           Amount of clusters allocated
+
+    @retval    > 0                      First cluster of the extent
+    @retval    0                        Fail
+
+*/
+uint32_t FSAllocateExtent(FILE *file, uint32_t from, uint32_t count, uint32_t *allocated);
+
+
+
+/*
+    Update a FAT table entry with a given status
+
+    @param      cluster     Cluster which is to have FAT value updated
+    @param      status      New FAT table entry. The first four bits will be unchanged
+
+    @retval     EXIT_SUCCUSS            On Success
+    @retval     EXIT_INVALID_PARAMETER  Cluster value provided was invalid
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table write failed
+
+*/
+EXIT_STATUS FSFatTableUpdate(uint32_t cluster, uint32_t status);
+
+
+/*
+    Get the first physcial sector of a cluster given the cluster
+
+    @param      cluster     Cluster which is to have FAT value updated
+    @param      status      New FAT table entry. The first four bits will be unchanged
+
+    @retval     sector number       On Success
+    @retval     0                   Fail - Not valid cluster                       
+
+*/
+uint32_t FSGetSector(uint32_t cluster);
+
+
+/*
+    Get the cluster that a physical sector is in. It is possible to get a cluster
+    value equal to MAX_CLUSTER because of the final incomplete cluster on a partition.
+
+    @param      cluster     Cluster which is to have FAT value updated
+    @param      status      New FAT table entry. The first four bits will be unchanged
+
+    @retval     cluster number    On Success
+    @retval     0                 Fail - Sector not in partition data area                       
+
+*/
+uint32_t FSGetCluster(uint32_t sector);
+
+
+/*
+    Get a value in the FAT table given a cluster entry
+
+    @param      cluster     Cluster which is to have FAT value updated
+
+    @retval     0           Fail or invalid
+    @retval     > 0         Sector number in table                       
+
+*/
+uint32_t FSGetFatTableEntry(uint32_t cluster);
+
+
+/*
+    Search a directory for a file name and return it if found. Names are compared
+    without case, against both the long and the short name of each file. The
+    directory's hash index is used if it can be, so only files with a matching
+    name hash are read. The hash index only holds the first files of a large
+    directory (see fat32DirIndexGet), so a name which is not among them is looked
+    for by reading the rest of the directory. FSIndexDirectory gives a large
+    directory an index file of every name, so a file in it is found by reading a
+    few sectors, even after a mount. The first name after a mount which is not in
+    the index file reads the directory once, to check another OS did not change it.
+
+    @param      IN  name            File/directory to search for
+    @param      IN  directory       Directory which is to be searched
+    @param      OUT new             File/directory to be returned
+
+    @retval     EXIT_SUCCESS            Directory succussfully found
+    @retval     EXIT_NOT_FOUND          Directory not found
+    @retval     EXIT_INVALID_PARAMETER  Device Error
+    @retval     EXIT_MEMORY_TABLE_FAIL  Memory table driver failed
+*/
+EXIT_STATUS FSDirectorySearch(char *name, FILE *directory, FILE *new);
+
+
+
+/*
+    Initializes the drive and memory table for which the hardware driver is configured.
+
+    @param      partition       Physical MBR partition number which is to be formatted with 
+    corresponding flags (usually 0)
+    @param      args            Hardware Init. arguments. Varies based on implementation
+
+    @retval     EXIT_SUCCESS            Succuss
+    @retval     EXIT_HARDWARE_FAIL      Hardware Driver Failed
+    @retval     EXIT_INCORRECT_FORMAT   Partition was not formatted because its not FAT32
+    @retval     EXIT_ALREADY_INIT       Drive is already initilized
+    @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
+    @retval     EXIT_READ_FAIL          Device Read Failed
+    @retval     EXIT_WRITE_FAIL         Device Write Failed
+    @retval     EXIT_INVALID_DEVICE     Device is unrecognizable
+    @retval     Others                  Fail
+*/
+EXIT_STATUS FSInit(uint8_t partition, void *args);
+
+
+/*
+    Eject a FAT32 File System. This method should be called to ensure that all
+    sectors are written back to the device and that hardware is deinitilized.
+    Every changed sector is written back and stored by the device before the
+    volume is marked clean, so a failure before then leaves it marked dirty.
+
+    @param      args            Hardware eject arguments. Varies based on implementation
+
+    @retval     EXIT_SUCCESS            Succuss
+    @retval     EXIT_HARDWARE_FAIL      Hardware Driver Failed
+    @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
+    @retval     EXIT_READ_FAIL          FSInfo sector could not be read
+    @retval     EXIT_WRITE_FAIL         FSInfo sector could not be written
+    @retval     Others                  Fail    
+
+*/
+EXIT_STATUS FSEject(void *args);
+
+
+/*
+    Write everything changed in memory back to the device without ejecting it. The
+    free cluster count and next free cluster hint are written to the FSInfo sector,
+    the FAT copies are updated if mirroring is disabled, then every changed sector
+    in the memory table is written back. Once the device has stored every write, any
+    write which failed after write_block returned is reported.
+
+    @retval     EXIT_SUCCESS            Succuss
+    @retval     EXIT_MEMORY_TABLE_FAIL  The memory table driver failed
+    @retval     EXIT_READ_FAIL          FSInfo sector could not be read
+    @retval     EXIT_WRITE_FAIL         FSInfo sector could not be written
+    @retval     EXIT_HARDWARE_FAIL      A write failed on the device
+
+*/
+EXIT_STATUS FSSync();
 
 
 /*
     Mount a FAT32 File System. This is also reformat a partition if set
 
     @param      partition           Physical MBR partition number which is to be used. Set REFORMAT
-                                    flag to reformat the partition
+                                    flag to reformat the partition. Set SINGLE_FAT to only write
+                                    the first FAT until FSEject. FSSync updates the copies
 
     @retval    EXIT_SUCCESS             Succuss
     @retval    EXIT_INCORRECT_FORMAT    Partition is not FAT32
@@ -560,6 +2086,9 @@ EXIT_STATUS FSEject(void *args);
     @retval    EXIT_INVALID_DEVICE      Device is unrecknoizable
     @retval    others                   Fail      
 
+    If the volume was not cleanly ejected (or has a hard error set), FS_UNCLEAN is set
+    in flg and the free clusters are recounted.
+
 */
 EXIT_STATUS FSMount(uint8_t partition);
 
@@ -592,6 +2121,78 @@ uint32_t FSReadFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file);
 uint32_t FSWriteFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file);
 
 
+/*
+    Reserve space for a file without writing to it. Clusters are allocated to the
+    end of the file as contiguous extents until the file has at least the given
+    amount of bytes allocated. The file size (the valid length) is not changed, so
+    later writes up to the reserved length only transfer data.
+    The new first cluster of an empty file is written back by FSClose.
+
+    @param      file                File to reserve space for
+    @param      bytes               Amount of bytes the file should have allocated
+
+    @return     EXIT_SUCCESS        Space was reserved
+    @return     EXIT_FAIL           Not enough free space, or the cluster chain is invalid
+
+*/
+EXIT_STATUS FSReserve(FILE *file, uint32_t bytes);
+
+
+/*
+    Find how fragmented a file is. The cluster chain is walked and split into runs
+    of contiguous clusters.
+
+    @param      IN  file            File to check
+    @param      OUT info            Clusters, fragments and longest fragment of the file
+
+    @return     EXIT_SUCCESS        Succuss
+    @return     EXIT_FAIL           The cluster chain is invalid or loops
+
+*/
+EXIT_STATUS FSFileFragments(FILE *file, FragInfo *info);
+
+
+/*
+    Find how fragmented the free space is. The whole FAT is read a sector at a time
+    and the free clusters are split into runs of contiguous clusters.
+
+    @param      OUT info            Free clusters, free runs and longest free run
+
+    @return     EXIT_SUCCESS        Succuss
+    @return     EXIT_READ_FAIL      FAT could not be read
+
+*/
+EXIT_STATUS FSFreeFragments(FragInfo *info);
+
+
+/*
+    Defragment a file, moving at most a given amount of clusters per call so it can
+    be run in bounded time slices. The file is moved into one contiguous run of
+    clusters: the rest of the file is placed directly after its first fragment if
+    that space is free, otherwise the whole file is moved to a free run large enough
+    to hold it. Every cluster move leaves a valid chain, and each call starts again
+    from the chain on the disk, so other file operations can be done between calls.
+    Directories are not moved.
+
+    The driver does not keep track of open files, so other handles to the file must
+    be passed in to be given its new first cluster and have their cached clusters
+    cleared.
+
+    @param      file                File to defragment
+    @param      open                Other handles to the file, may be NULL if openCount is 0
+    @param      openCount           Amount of handles in open
+    @param      maxMoves            Most clusters to move in this call
+
+    @return     EXIT_SUCCESS        The file is contiguous
+    @return     EXIT_INCOMPLETE     maxMoves clusters were moved, call again to continue
+    @return     EXIT_INVALID_PARAMETER  File is a directory
+    @return     EXIT_FAIL           There is no free run large enough, or the chain is invalid
+    @return     others              A cluster move failed
+
+*/
+EXIT_STATUS FSDefragFile(FILE *file, FILE **open, uint8_t openCount, uint32_t maxMoves);
+
+
 /*
     Create a file or directory.
 
@@ -601,12 +2202,51 @@ uint32_t FSWriteFile(uint8_t *data, uint32_t offset, uint32_t len, FILE *file);
 
     @return     EXIT_SUCCUSS            Function exited succussfully
     @return     EXIT_INVALID_PARAMETER  Invalid parameter
+    @return     EXIT_ALREADY_EXIST      Every short name tail for the name is taken
 
 
 */
 EXIT_STATUS FSCreateFile(FILE *file, FILE *dir, uint8_t *name, uint8_t flags, FileTime *time);
 
 
+/*
+    Free the clusters allocated to files FSCreateFiles was creating.
+
+    @param      files           Files being created
+    @param      count           Amount of files
+
+*/
+void fat32CreateUndo(FileSpec *files, uint16_t count);
+
+
+/*
+    Create many files in one directory. The names are checked against each other and
+    against the directory with one read of it. The entries of all of the files are
+    placed one after another and written a sector at a time, and each file is
+    allocated its size in contiguous extents, one file after another. The file sizes
+    (the valid lengths) are left at 0, as with FSReserve. The short name tails taken
+    in the directory are found during the same read.
+    Nothing is created unless every name can be used and there is enough free space.
+    The clusters are allocated before any entry is taken. If an entry cannot be
+    written, the entries taken are marked removed and the clusters are freed. If the
+    entries cannot be marked either, the clusters are left to them.
+
+    @param      dir                 Directory to add the files to
+    @param      files               Files to create. Their hash and cluster are set
+    @param      count               Amount of files
+    @param      time                Time to give the files. NULL means 1/1/1980
+
+    @return     EXIT_SUCCUSS            Files were created
+    @return     EXIT_INVALID_PARAMETER  A name is empty, too long, a directory, or used twice
+    @return     EXIT_ALREADY_EXIST      A name is already in the directory, or a short name could not be made
+    @return     EXIT_INVALID_TIME       Time passed was not valid
+    @return     EXIT_FAIL               Not enough free entries or clusters
+    @return     EXIT_WRITE_FAIL         An entry could not be written
+
+*/
+EXIT_STATUS FSCreateFiles(FILE *dir, FileSpec *files, uint16_t count, FileTime *time);
+
+
 /*
     Remove a file or directory.
 
@@ -618,6 +2258,62 @@ EXIT_STATUS FSCreateFile(FILE *file, FILE *dir, uint8_t *name, uint8_t flags, Fi
 */
 EXIT_STATUS FSRemoveFile(FILE *file);
 
+
+/*
+    Compact a directory, moving files down over removed entries so the live entries
+    are contiguous. Once every file has been moved, the end marker is placed after
+    the last file and the clusters after it are freed. At most maxFiles files are
+    moved per call so it can be run in bounded time slices. The entries left behind
+    by a call are marked removed, and each call starts again from the directory on
+    the disk, so other file operations can be done between calls. Long entries
+    which do not belong to a short entry are dropped.
+
+    The driver does not keep track of open files, so files open in the directory
+    must be passed in to have their entry offsets updated.
+
+    @param      dir                 Directory to compact
+    @param      open                Files open in the directory, may be NULL if openCount is 0
+    @param      openCount           Amount of files in open
+    @param      maxFiles            Most files to move in this call
+
+    @return     EXIT_SUCCESS            The directory is compacted
+    @return     EXIT_INCOMPLETE         maxFiles files were moved, call again to continue
+    @return     EXIT_INVALID_PARAMETER  dir is not a directory
+    @return     EXIT_WRITE_FAIL         Entries could not be written
+    @return     others                  Trailing clusters could not be freed
+
+*/
+EXIT_STATUS FSCompactDirectory(FILE *dir, FILE **open, uint8_t openCount, uint32_t maxFiles);
+
+
+/*
+    Build an index file for a directory, so a lookup in it reads a few sectors
+    instead of the whole directory, even the first lookup after a mount. The index
+    file (DIRINDEX.SYS, hidden and system) holds a B-tree of the hashes of the
+    names in the directory. It is kept in the directory's first sector so it is
+    found without reading the rest of the directory; if that sector is full, its
+    first file is moved to the end of the directory. The directory is compacted
+    first, so files another OS adds go at its end, where they are noticed. Another
+    OS can also remove or rename files, so the first name the keys do not have after
+    the index file is read makes the directory be read and checked against them.
+
+    Changing the directory, or another OS changing it, makes the keys stale, and
+    lookups read the directory until this function is called again. Lookups never
+    build the keys, as that writes the whole index file.
+
+    @param      dir                 Directory to index
+    @param      open                Files open in the directory, may be NULL if openCount is 0
+    @param      openCount           Amount of files in open
+
+    @return     EXIT_SUCCESS            Index file was built
+    @return     EXIT_INVALID_PARAMETER  dir is not a directory
+    @return     EXIT_FAIL               No room could be made for the index file
+    @return     others                  Directory could not be compacted, or the index file written
+
+*/
+EXIT_STATUS FSIndexDirectory(FILE *dir, FILE **open, uint8_t openCount);
+
+
 /*
     Change the attributes of a file or directory.
 
@@ -647,6 +2343,67 @@ EXIT_STATUS FSChangeAttribues(FILE *file, uint8_t flags, FileTime *time, uint8_t
 EXIT_STATUS FSOpen(uint8_t *name, FILE *dir, FILE *file);
 
 
+/*
+    Open the root directory.
+
+    @param      root                Empty file for the root directory
+
+    @return     EXIT_SUCCESS        Root directory was opened
+    @return     EXIT_NOT_EXIST      No file system is mounted
+
+*/
+EXIT_STATUS FSOpenRoot(FILE *root);
+
+
+/*
+    Open a file or directory from its full path, such as "/logs/2026/run.bin".
+    Each component is looked up through a cache of recent lookups, which also
+    remembers names that were not found, so opening deep paths again does not
+    search every directory on the way.
+    OPEN FILES MUST BE CLOSED TO AVOID UNDEFINED BEHAVIOUR
+
+    @param      IN  path            Path from the root directory, separated by '/'
+    @param      OUT dir             Directory which file is in. It must be kept while the file
+                                    is open, and has no parent directory of its own
+    @param      OUT file            Empty file for the file
+
+    @return     EXIT_SUCCESS        File was opened
+    @return     EXIT_NOT_FOUND      A component of the path did not exist, or was not a directory
+    @return     EXIT_INVALID_PARAMETER  Path is empty or a component is too long
+    @return     others              Other failure
+
+*/
+EXIT_STATUS FSOpenPath(uint8_t *path, FILE *dir, FILE *file);
+
+
+/*
+    Start reading the files of a directory.
+
+    @param      IN  dir             Directory to read. It must be kept while it is being read
+    @param      OUT it              Position within the directory, set to its first file
+
+    @return     EXIT_SUCCESS            Directory can be read
+    @return     EXIT_INVALID_PARAMETER  File is not a directory
+
+*/
+EXIT_STATUS FSDirOpen(FILE *dir, DIR *it);
+
+
+/*
+    Read the next files of a directory. Long names are put together and each file
+    is returned as one record. Up to count files are read per call, and each
+    directory sector is only read once.
+
+    @param      IN  it              Position within the directory, from FSDirOpen
+    @param      OUT records         Where to place the files read
+    @param      IN  count           Most files to read
+
+    @return     Amount of files read. Less than count once the end of the directory is reached
+
+*/
+uint16_t FSDirNext(DIR *it, DirRecord *records, uint16_t count);
+
+
 /*
     Close a file (or directory) and write it back to the disk.
 